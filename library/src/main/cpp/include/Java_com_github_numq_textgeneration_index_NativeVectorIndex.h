@@ -0,0 +1,146 @@
+#include <jni.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#if defined(__AVX2__) && defined(__FMA__)
+#define VECTOR_INDEX_AVX2
+#elif defined(__GNUC__)
+#define VECTOR_INDEX_AVX2 __attribute__((target("avx2,fma")))
+#define VECTOR_INDEX_AVX2_DISPATCH
+#endif
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+enum class VectorMetric : int32_t {
+    DOT_PRODUCT = 0,
+    COSINE = 1
+};
+
+enum class VectorQuantization : int32_t {
+    FLOAT32 = 0,
+    INT8 = 1
+};
+
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path);
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    [[nodiscard]] const uint8_t *data() const { return data_; }
+
+    [[nodiscard]] size_t size() const { return size_; }
+
+private:
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+struct VectorList {
+    size_t size = 0;
+
+    std::vector<int64_t> ownedIds;
+    std::vector<float> ownedVectors;
+    std::vector<int8_t> ownedCodes;
+    std::vector<float> ownedScales;
+
+    const int64_t *ids = nullptr;
+    const float *vectors = nullptr;
+    const int8_t *codes = nullptr;
+    const float *scales = nullptr;
+};
+
+struct VectorIndex {
+    int32_t dimension = 0;
+    VectorMetric metric = VectorMetric::DOT_PRODUCT;
+    VectorQuantization quantization = VectorQuantization::FLOAT32;
+
+    std::vector<float> centroids;
+    std::vector<VectorList> lists;
+
+    std::unique_ptr<MappedFile> mapping;
+
+    std::shared_mutex mutex;
+};
+
+#ifndef _Included_com_github_numq_textgeneration_index_NativeVectorIndex
+#define _Included_com_github_numq_textgeneration_index_NativeVectorIndex
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_createNative
+        (JNIEnv *, jclass, jint, jint, jint, jint);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_loadNative
+        (JNIEnv *, jclass, jstring);
+
+JNIEXPORT jint JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_getDimensionNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_getSizeNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_trainNative
+        (JNIEnv *, jclass, jlong, jobject, jint, jint);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_addNative
+        (JNIEnv *, jclass, jlong, jlongArray, jobject, jint);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_searchNative
+        (JNIEnv *, jclass, jlong, jobject, jint, jint, jint, jint, jlongArray, jfloatArray);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_saveNative
+        (JNIEnv *, jclass, jlong, jstring);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_index_NativeVectorIndex_freeNative
+        (JNIEnv *, jclass, jlong);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
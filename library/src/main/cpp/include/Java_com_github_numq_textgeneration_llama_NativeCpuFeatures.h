@@ -0,0 +1,34 @@
+#include <jni.h>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_FEATURES_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+enum class CpuVariant : int32_t {
+    BASELINE = 0,
+    AVX2 = 1,
+    AVX512 = 2,
+    AVX512_VNNI = 3,
+    AMX = 4
+};
+
+#ifndef _Included_com_github_numq_textgeneration_llama_NativeCpuFeatures
+#define _Included_com_github_numq_textgeneration_llama_NativeCpuFeatures
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+JNIEXPORT jint JNICALL Java_com_github_numq_textgeneration_llama_NativeCpuFeatures_detectVariantNative
+        (JNIEnv *, jclass);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
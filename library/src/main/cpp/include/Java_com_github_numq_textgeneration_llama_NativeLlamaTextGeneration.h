@@ -5,20 +5,293 @@
 #include <unordered_map>
 #include <memory>
 #include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <optional>
+#include <numeric>
 #include "llama.h"
 #include "llama-cpp.h"
+#include "common.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #ifndef _Included_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration
 #define _Included_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration
+constexpr uint32_t MAX_EMBEDDING_SEQUENCES = 64;
+constexpr uint32_t MAX_PARALLEL_SEQUENCES = 16;
+constexpr size_t CACHE_REUSE_CHUNK_SIZE = 16;
+constexpr size_t ASSISTANT_PREFIX_TOKENS = 8;
+
+constexpr uint32_t CALIBRATION_TOKENS = 1024;
+constexpr uint32_t CALIBRATION_BATCH_SIZES[] = {128, 256, 512, 1024, 2048};
+
+constexpr size_t PREFETCH_CHUNK_SIZE = 64 * 1024 * 1024;
+constexpr size_t PREFETCH_BUFFER_SIZE = 4 * 1024 * 1024;
+
+constexpr int64_t QUANTIZATION_PROGRESS_INTERVAL = 100;
+
+constexpr uint32_t GGUF_FILE_MAGIC = 0x46554747;
+
+constexpr uint64_t GGUF_DEFAULT_ALIGNMENT = 32;
+
+constexpr uint32_t GGUF_TYPE_UINT32 = 4;
+constexpr uint32_t GGUF_TYPE_STRING = 8;
+constexpr uint32_t GGUF_TYPE_ARRAY = 9;
+
+constexpr size_t GGUF_TYPE_SIZES[] = {1, 1, 2, 2, 4, 4, 4, 1, 0, 0, 8, 8, 8};
+
+constexpr uint32_t SNAPSHOT_MAGIC = 0x4C545347;
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t modelSize;
+    uint64_t tokenCount;
+    uint64_t turnCount;
+    uint64_t stateSize;
+};
+
+using ProgressCallback = std::function<bool(size_t, size_t)>;
+
+using LoadCallback = std::function<bool(float)>;
+
+struct CancellationException : std::runtime_error {
+    CancellationException() : std::runtime_error("Generation was cancelled") {}
+};
+
+struct TruncationPolicy {
+    bool enabled;
+    bool keepSystemMessage;
+    int keepLastTurns;
+    int reservedTokens;
+};
+
+enum class Rewind {
+    NONE,
+    RESPONSE,
+    TURN
+};
+
+struct Turn {
+    size_t begin;
+    size_t promptEnd;
+};
+
+struct Conversation {
+    std::vector<llama_token> tokens;
+    std::vector<Turn> turns;
+    std::unordered_map<size_t, int32_t> messageTokenCounts;
+};
+
+struct LoadReport {
+    size_t splitCount = 0;
+    size_t size = 0;
+    int64_t readTime = 0;
+    int64_t loadTime = 0;
+};
+
+struct GgufTensorInfo {
+    std::string name;
+    uint64_t nElements = 1;
+    uint32_t type = 0;
+    uint64_t offset = 0;
+};
+
+struct GgufFile {
+    std::vector<GgufTensorInfo> tensors;
+    uint64_t dataOffset = 0;
+};
+
+struct Benchmark {
+    size_t size = 0;
+    int64_t loadTime = 0;
+    double prefillThroughput = 0.0;
+    double decodeThroughput = 0.0;
+    double perplexity = 0.0;
+};
+
+struct LoraAdapter {
+    std::shared_ptr<llama_model> model;
+    llama_adapter_lora_ptr adapter;
+};
+
+struct ControlVector {
+    std::shared_ptr<llama_model> model;
+    std::vector<float> data;
+    int32_t layerStart = 0;
+    int32_t layerEnd = 0;
+};
+
+struct AdapterSelection {
+    std::shared_ptr<LoraAdapter> lora;
+    float loraScale = 0.0f;
+    std::shared_ptr<ControlVector> controlVector;
+    float controlVectorScale = 0.0f;
+};
+
+struct ContextPool {
+    std::shared_ptr<llama_model> model;
+    std::mutex mutex;
+    std::vector<uint32_t> sizeClasses;
+    std::unordered_map<uint32_t, std::vector<llama_context_ptr>> contexts;
+    size_t capacity = 0;
+};
+
+struct ThreadpoolDeleter {
+    void operator()(ggml_threadpool *threadpool) const { ggml_threadpool_free(threadpool); }
+};
+
+using ThreadpoolPtr = std::unique_ptr<ggml_threadpool, ThreadpoolDeleter>;
+
+struct NumaPlacement {
+    int node = -1;
+    std::vector<int> cpus;
+    ThreadpoolPtr threadpool;
+    ThreadpoolPtr batchThreadpool;
+    ThreadpoolPtr batchGenerationThreadpool;
+};
+
+struct Instance {
+    std::shared_ptr<llama_model> model;
+    llama_context_params contextParams;
+    std::unique_ptr<NumaPlacement> placement;
+    llama_context_ptr context;
+    llama_context_ptr embeddingContext;
+    llama_context_ptr parallelContext;
+    llama_context_ptr completionContext;
+    std::shared_ptr<llama_model> batchModel;
+    llama_context_ptr batchContext;
+    std::mutex batchUsage;
+    Conversation conversation;
+    std::mutex usage;
+    uint64_t lastUsed = 0;
+    std::vector<uint8_t> swappedState;
+    LoadReport loadReport;
+    AdapterSelection adapters;
+    std::shared_ptr<ContextPool> pool;
+};
+
+struct StagedModel {
+    jlong owner = 0;
+    std::shared_ptr<llama_model> model;
+    llama_context_ptr context;
+    LoadReport loadReport;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_initNumaNative
+        (JNIEnv *, jclass, jint);
+
+JNIEXPORT jint JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getCpuVariantNative
+        (JNIEnv *, jclass);
+
 JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_initNative
-        (JNIEnv *, jclass, jstring, jint, jint);
+        (JNIEnv *, jclass, jstring, jint, jint, jint, jint, jint, jboolean, jint, jint, jint, jintArray, jint,
+         jboolean, jboolean, jboolean, jboolean, jboolean, jobject);
 
 JNIEXPORT jstring JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_generateNative
-        (JNIEnv *, jclass, jlong, jobjectArray, jfloat, jfloat, jfloat, jint, jint);
+        (JNIEnv *, jclass, jlong, jobjectArray, jfloat, jfloat, jfloat, jint, jint, jint, jboolean, jboolean, jint, jint,
+         jlong, jfloat, jlong, jfloat, jobject);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_prefillNative
+        (JNIEnv *, jclass, jlong, jobjectArray, jstring, jobject);
+
+JNIEXPORT jstring JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_regenerateNative
+        (JNIEnv *, jclass, jlong, jobjectArray, jfloat, jfloat, jfloat, jint, jint, jint, jboolean, jboolean, jint, jint,
+         jlong, jfloat, jlong, jfloat, jobject);
+
+JNIEXPORT jstring JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_editLastNative
+        (JNIEnv *, jclass, jlong, jobjectArray, jfloat, jfloat, jfloat, jint, jint, jint, jboolean, jboolean, jint, jint,
+         jlong, jfloat, jlong, jfloat, jobject);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_generateBatchNative
+        (JNIEnv *, jclass, jlong, jstring, jobjectArray, jfloat, jfloat, jfloat, jint, jint, jint, jint, jlong, jfloat, jlong,
+         jfloat, jobject);
+
+JNIEXPORT jint JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getEmbeddingSizeNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_embedNative
+        (JNIEnv *, jclass, jlong, jobjectArray, jint, jboolean, jobject);
+
+JNIEXPORT jfloatArray JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_scoreNative
+        (JNIEnv *, jclass, jlong, jstring, jstring, jobjectArray);
+
+JNIEXPORT jstring JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_completeNative
+        (JNIEnv *, jclass, jlong, jintArray, jfloat, jfloat, jfloat, jint, jint, jint, jlong, jfloat, jlong, jfloat);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_resetNative
+        (JNIEnv *, jclass, jlong, jstring);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getSnapshotSizeNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_snapshotNative
+        (JNIEnv *, jclass, jlong, jobject, jlong);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_restoreNative
+        (JNIEnv *, jclass, jlong, jobject, jlong, jlong);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_setMaxResidentCellsNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT jlongArray JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getMemoryUsageNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT jlongArray JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getLoadReportNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT jintArray JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getConfigurationNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_prepareModelNative
+        (JNIEnv *, jclass, jlong, jstring, jboolean, jboolean, jboolean, jboolean, jobject);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_swapModelNative
+        (JNIEnv *, jclass, jlong, jlong);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_loadAdapterNative
+        (JNIEnv *, jclass, jlong, jstring);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_freeAdapterNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_loadControlVectorNative
+        (JNIEnv *, jclass, jlong, jstring);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_freeControlVectorNative
+        (JNIEnv *, jclass, jlong);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_quantizeNative
+        (JNIEnv *, jclass, jstring, jstring, jint, jobject);
+
+JNIEXPORT jdoubleArray JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_benchmarkNative
+        (JNIEnv *, jclass, jstring, jstring, jint, jint, jint);
+
+JNIEXPORT jlongArray JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_probeNative
+        (JNIEnv *, jclass, jstring, jobject);
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_openConversationNative
+        (JNIEnv *, jclass, jlong);
 
 JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_freeNative
         (JNIEnv *, jclass, jlong);
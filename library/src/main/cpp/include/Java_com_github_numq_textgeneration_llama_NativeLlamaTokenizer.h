@@ -0,0 +1,36 @@
+#include <jni.h>
+#include <shared_mutex>
+#include <mutex>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <string>
+#include "llama.h"
+#include "llama-cpp.h"
+#include "common.h"
+
+#ifndef _Included_com_github_numq_textgeneration_llama_NativeLlamaTokenizer
+#define _Included_com_github_numq_textgeneration_llama_NativeLlamaTokenizer
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+JNIEXPORT jlong JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_initNative
+        (JNIEnv *, jclass, jstring);
+
+JNIEXPORT jintArray JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_tokenizeNative
+        (JNIEnv *, jclass, jlong, jobjectArray, jboolean, jintArray);
+
+JNIEXPORT jintArray JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_countTokensNative
+        (JNIEnv *, jclass, jlong, jobjectArray, jboolean);
+
+JNIEXPORT jstring JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_detokenizeNative
+        (JNIEnv *, jclass, jlong, jintArray, jboolean);
+
+JNIEXPORT void JNICALL Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_freeNative
+        (JNIEnv *, jclass, jlong);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
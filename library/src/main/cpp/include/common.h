@@ -0,0 +1,35 @@
+#pragma once
+
+#include <jni.h>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llama.h"
+
+constexpr size_t SPLIT_SUFFIX_LENGTH = sizeof("-00001-of-00001.gguf") - 1;
+
+extern jclass exceptionClass;
+
+void handleException(JNIEnv *env, const std::string &errorMessage);
+
+std::string jstringToString(JNIEnv *env, jstring string);
+
+std::string getMetadata(const llama_model *model, const std::string &key);
+
+std::vector<llama_token> tokenize(const llama_vocab *vocab, const std::string &text, bool addSpecial);
+
+int32_t countTokens(const llama_vocab *vocab, const std::string &text, bool addSpecial);
+
+std::string tokenToPiece(const llama_vocab *vocab, llama_token token);
+
+std::string detokenize(const llama_vocab *vocab, const std::vector<llama_token> &tokens, bool removeSpecial);
+
+void parallelFor(size_t count, const std::function<void(size_t)> &task);
+
+std::vector<std::string> discoverSplits(const std::string &path);
@@ -0,0 +1,890 @@
+#include "Java_com_github_numq_textgeneration_index_NativeVectorIndex.h"
+
+static constexpr uint32_t INDEX_MAGIC = 0x49564754;
+static constexpr uint32_t INDEX_VERSION = 1;
+static constexpr size_t INDEX_ALIGNMENT = 64;
+static constexpr size_t SEARCH_CHUNK_SIZE = 8192;
+static constexpr int TRAIN_ITERATIONS = 16;
+
+static std::shared_mutex mutex;
+static std::unordered_map<jlong, std::unique_ptr<VectorIndex>> pointers;
+
+static bool isValidMetric(int32_t metric) {
+    return metric == static_cast<int32_t>(VectorMetric::DOT_PRODUCT) ||
+           metric == static_cast<int32_t>(VectorMetric::COSINE);
+}
+
+static bool isValidQuantization(int32_t quantization) {
+    return quantization == static_cast<int32_t>(VectorQuantization::FLOAT32) ||
+           quantization == static_cast<int32_t>(VectorQuantization::INT8);
+}
+
+static VectorIndex *getPointer(jlong handle) {
+    auto it = pointers.find(handle);
+    if (it == pointers.end()) {
+        throw std::runtime_error("Invalid handle");
+    }
+    return it->second.get();
+}
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &path) {
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                        nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Failed to open index file");
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file_, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file_);
+        throw std::runtime_error("Failed to get index file size");
+    }
+    size_ = static_cast<size_t>(fileSize.QuadPart);
+
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) {
+        CloseHandle(file_);
+        throw std::runtime_error("Failed to map index file");
+    }
+
+    data_ = static_cast<const uint8_t *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (!data_) {
+        CloseHandle(mapping_);
+        CloseHandle(file_);
+        throw std::runtime_error("Failed to map index file");
+    }
+}
+
+MappedFile::~MappedFile() {
+    UnmapViewOfFile(data_);
+    CloseHandle(mapping_);
+    CloseHandle(file_);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &path) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open index file");
+    }
+
+    struct stat fileStat{};
+    if (fstat(fd_, &fileStat) != 0 || fileStat.st_size == 0) {
+        close(fd_);
+        throw std::runtime_error("Failed to get index file size");
+    }
+    size_ = static_cast<size_t>(fileStat.st_size);
+
+    auto address = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (address == MAP_FAILED) {
+        close(fd_);
+        throw std::runtime_error("Failed to map index file");
+    }
+    data_ = static_cast<const uint8_t *>(address);
+
+    madvise(address, size_, MADV_WILLNEED);
+}
+
+MappedFile::~MappedFile() {
+    munmap(const_cast<uint8_t *>(data_), size_);
+    close(fd_);
+}
+
+#endif
+
+#ifdef VECTOR_INDEX_AVX2
+VECTOR_INDEX_AVX2 static float dotFloatAvx2(const float *a, const float *b, int32_t n) {
+    int32_t i = 0;
+
+    auto sum0 = _mm256_setzero_ps();
+    auto sum1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    auto sum = _mm256_add_ps(sum0, sum1);
+    auto half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_hadd_ps(half, half);
+    half = _mm_hadd_ps(half, half);
+    auto result = _mm_cvtss_f32(half);
+
+    for (; i < n; ++i) {
+        result += a[i] * b[i];
+    }
+
+    return result;
+}
+
+VECTOR_INDEX_AVX2 static int32_t dotInt8Avx2(const int8_t *a, const int8_t *b, int32_t n) {
+    int32_t i = 0;
+
+    auto sum = _mm256_setzero_si256();
+    for (; i + 16 <= n; i += 16) {
+        auto va = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+        auto vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(va, vb));
+    }
+    auto half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_hadd_epi32(half, half);
+    half = _mm_hadd_epi32(half, half);
+    auto result = _mm_cvtsi128_si32(half);
+
+    for (; i < n; ++i) {
+        result += static_cast<int32_t>(a[i]) * static_cast<int32_t>(b[i]);
+    }
+
+    return result;
+}
+#endif
+
+#ifdef VECTOR_INDEX_AVX2_DISPATCH
+/**
+ * The library is built for baseline x86, so the AVX2 kernels are compiled for that target separately and chosen once
+ * the CPU is known to support them.
+ */
+static const bool hasAvx2 = [] {
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}();
+#endif
+
+static float dotFloat(const float *a, const float *b, int32_t n) {
+#if defined(VECTOR_INDEX_AVX2_DISPATCH)
+    if (hasAvx2) {
+        return dotFloatAvx2(a, b, n);
+    }
+#elif defined(VECTOR_INDEX_AVX2)
+    return dotFloatAvx2(a, b, n);
+#endif
+
+    int32_t i = 0;
+    float result = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    auto sum0 = vdupq_n_f32(0);
+    auto sum1 = vdupq_n_f32(0);
+    for (; i + 8 <= n; i += 8) {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vfmaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    result = vaddvq_f32(vaddq_f32(sum0, sum1));
+#else
+    float sum[4] = {0, 0, 0, 0};
+    for (; i + 4 <= n; i += 4) {
+        sum[0] += a[i] * b[i];
+        sum[1] += a[i + 1] * b[i + 1];
+        sum[2] += a[i + 2] * b[i + 2];
+        sum[3] += a[i + 3] * b[i + 3];
+    }
+    result = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+#endif
+
+    for (; i < n; ++i) {
+        result += a[i] * b[i];
+    }
+
+    return result;
+}
+
+static int32_t dotInt8(const int8_t *a, const int8_t *b, int32_t n) {
+#if defined(VECTOR_INDEX_AVX2_DISPATCH)
+    if (hasAvx2) {
+        return dotInt8Avx2(a, b, n);
+    }
+#elif defined(VECTOR_INDEX_AVX2)
+    return dotInt8Avx2(a, b, n);
+#endif
+
+    int32_t i = 0;
+    int32_t result = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    auto sum = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16) {
+        auto va = vld1q_s8(a + i);
+        auto vb = vld1q_s8(b + i);
+        sum = vpadalq_s16(sum, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        sum = vpadalq_s16(sum, vmull_high_s8(va, vb));
+    }
+    result = vaddvq_s32(sum);
+#endif
+
+    for (; i < n; ++i) {
+        result += static_cast<int32_t>(a[i]) * static_cast<int32_t>(b[i]);
+    }
+
+    return result;
+}
+
+static void normalize(float *vector, int32_t n) {
+    auto norm = std::sqrt(dotFloat(vector, vector, n));
+    if (norm > 0) {
+        for (int32_t i = 0; i < n; ++i) vector[i] /= norm;
+    }
+}
+
+static float quantize(const float *vector, int32_t n, int8_t *codes) {
+    float maxAbs = 0;
+    for (int32_t i = 0; i < n; ++i) maxAbs = std::max(maxAbs, std::fabs(vector[i]));
+
+    auto scale = maxAbs > 0 ? maxAbs / 127.0f : 1.0f;
+    for (int32_t i = 0; i < n; ++i) {
+        codes[i] = static_cast<int8_t>(std::lround(std::clamp(vector[i] / scale, -127.0f, 127.0f)));
+    }
+
+    return scale;
+}
+
+static size_t nearestCentroid(const VectorIndex &index, const float *vector) {
+    auto nCentroids = index.centroids.size() / index.dimension;
+
+    size_t best = 0;
+    auto bestScore = -std::numeric_limits<float>::infinity();
+
+    for (size_t c = 0; c < nCentroids; ++c) {
+        auto score = dotFloat(vector, index.centroids.data() + c * index.dimension, index.dimension);
+        if (score > bestScore) {
+            bestScore = score;
+            best = c;
+        }
+    }
+
+    return best;
+}
+
+static void refreshViews(VectorList &list) {
+    list.ids = list.ownedIds.data();
+    list.vectors = list.ownedVectors.data();
+    list.codes = list.ownedCodes.data();
+    list.scales = list.ownedScales.data();
+}
+
+static void materialize(VectorIndex &index) {
+    if (!index.mapping) return;
+
+    auto dimension = static_cast<size_t>(index.dimension);
+
+    for (auto &list: index.lists) {
+        list.ownedIds.assign(list.ids, list.ids + list.size);
+        if (index.quantization == VectorQuantization::INT8) {
+            list.ownedCodes.assign(list.codes, list.codes + list.size * dimension);
+            list.ownedScales.assign(list.scales, list.scales + list.size);
+        } else {
+            list.ownedVectors.assign(list.vectors, list.vectors + list.size * dimension);
+        }
+        refreshViews(list);
+    }
+
+    index.mapping = nullptr;
+}
+
+/**
+ * Spherical k-means over the training vectors: centroids are kept at unit length and vectors are assigned to the
+ * centroid with the highest dot product, which is the same rule used to route vectors on insertion and queries on
+ * search.
+ */
+static void train(VectorIndex &index, const float *data, size_t count) {
+    auto dimension = static_cast<size_t>(index.dimension);
+    auto nCentroids = index.lists.size();
+
+    if (nCentroids < 2) {
+        throw std::runtime_error("Flat index does not require training");
+    }
+
+    if (!index.centroids.empty()) {
+        throw std::runtime_error("Index has already been trained");
+    }
+
+    if (count < nCentroids) {
+        throw std::runtime_error("Training requires at least as many vectors as lists");
+    }
+
+    std::vector<float> points(data, data + count * dimension);
+    if (index.metric == VectorMetric::COSINE) {
+        parallelFor(count, [&](size_t i) { normalize(points.data() + i * dimension, index.dimension); });
+    }
+
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) order[i] = i;
+
+    std::mt19937 random(42);
+    std::shuffle(order.begin(), order.end(), random);
+
+    index.centroids.resize(nCentroids * dimension);
+    for (size_t c = 0; c < nCentroids; ++c) {
+        std::copy_n(points.data() + order[c] * dimension, dimension, index.centroids.data() + c * dimension);
+        normalize(index.centroids.data() + c * dimension, index.dimension);
+    }
+
+    std::vector<size_t> assignments(count);
+
+    for (int iteration = 0; iteration < TRAIN_ITERATIONS; ++iteration) {
+        parallelFor(count, [&](size_t i) {
+            assignments[i] = nearestCentroid(index, points.data() + i * dimension);
+        });
+
+        std::vector<double> sums(nCentroids * dimension, 0);
+        std::vector<size_t> counts(nCentroids, 0);
+
+        for (size_t i = 0; i < count; ++i) {
+            auto c = assignments[i];
+            counts[c]++;
+            for (size_t j = 0; j < dimension; ++j) sums[c * dimension + j] += points[i * dimension + j];
+        }
+
+        for (size_t c = 0; c < nCentroids; ++c) {
+            auto centroid = index.centroids.data() + c * dimension;
+
+            if (counts[c] == 0) {
+                std::copy_n(points.data() + order[random() % count] * dimension, dimension, centroid);
+            } else {
+                for (size_t j = 0; j < dimension; ++j) centroid[j] = static_cast<float>(sums[c * dimension + j]);
+            }
+
+            normalize(centroid, index.dimension);
+        }
+    }
+}
+
+static void add(VectorIndex &index, const int64_t *ids, const float *data, size_t count) {
+    auto dimension = static_cast<size_t>(index.dimension);
+
+    if (index.lists.size() > 1 && index.centroids.empty()) {
+        throw std::runtime_error("Index should be trained before adding vectors");
+    }
+
+    materialize(index);
+
+    std::vector<float> vector(dimension);
+    std::vector<int8_t> codes(dimension);
+
+    for (size_t i = 0; i < count; ++i) {
+        std::copy_n(data + i * dimension, dimension, vector.data());
+
+        if (index.metric == VectorMetric::COSINE) {
+            normalize(vector.data(), index.dimension);
+        }
+
+        auto &list = index.lists[index.centroids.empty() ? 0 : nearestCentroid(index, vector.data())];
+
+        list.ownedIds.push_back(ids[i]);
+
+        if (index.quantization == VectorQuantization::INT8) {
+            list.ownedScales.push_back(quantize(vector.data(), index.dimension, codes.data()));
+            list.ownedCodes.insert(list.ownedCodes.end(), codes.begin(), codes.end());
+        } else {
+            list.ownedVectors.insert(list.ownedVectors.end(), vector.begin(), vector.end());
+        }
+
+        list.size++;
+    }
+
+    for (auto &list: index.lists) {
+        refreshViews(list);
+    }
+}
+
+using SearchHit = std::pair<float, int64_t>;
+
+static void pushHit(std::vector<SearchHit> &heap, size_t limit, float score, int64_t id) {
+    if (heap.size() < limit) {
+        heap.emplace_back(score, id);
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    } else if (score > heap.front().first) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+        heap.back() = {score, id};
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
+}
+
+struct SearchTask {
+    size_t query;
+    const VectorList *list;
+    size_t begin;
+    size_t end;
+};
+
+/**
+ * Splits every probed list of every query into fixed-size chunks and scans the chunks on all hardware threads,
+ * keeping a top-k heap per chunk that is merged per query at the end.
+ */
+static void search(const VectorIndex &index, const float *queries, size_t count, size_t limit, size_t probes,
+                   int64_t *outputIds, float *outputScores) {
+    auto dimension = static_cast<size_t>(index.dimension);
+    auto isQuantized = index.quantization == VectorQuantization::INT8;
+
+    std::vector<float> prepared(queries, queries + count * dimension);
+    std::vector<int8_t> preparedCodes(isQuantized ? count * dimension : 0);
+    std::vector<float> preparedScales(isQuantized ? count : 0);
+
+    std::vector<SearchTask> tasks;
+
+    for (size_t q = 0; q < count; ++q) {
+        auto query = prepared.data() + q * dimension;
+
+        if (index.metric == VectorMetric::COSINE) {
+            normalize(query, index.dimension);
+        }
+
+        if (isQuantized) {
+            preparedScales[q] = quantize(query, index.dimension, preparedCodes.data() + q * dimension);
+        }
+
+        std::vector<size_t> probed;
+
+        if (index.centroids.empty()) {
+            probed.push_back(0);
+        } else {
+            auto nCentroids = index.lists.size();
+
+            std::vector<std::pair<float, size_t>> scores(nCentroids);
+            for (size_t c = 0; c < nCentroids; ++c) {
+                scores[c] = {dotFloat(query, index.centroids.data() + c * dimension, index.dimension), c};
+            }
+
+            auto nProbes = std::min(std::max<size_t>(probes, 1), nCentroids);
+            std::partial_sort(scores.begin(), scores.begin() + static_cast<std::ptrdiff_t>(nProbes), scores.end(),
+                              std::greater<>());
+
+            for (size_t p = 0; p < nProbes; ++p) probed.push_back(scores[p].second);
+        }
+
+        for (auto l: probed) {
+            const auto &list = index.lists[l];
+            for (size_t begin = 0; begin < list.size; begin += SEARCH_CHUNK_SIZE) {
+                tasks.push_back({q, &list, begin, std::min(begin + SEARCH_CHUNK_SIZE, list.size)});
+            }
+        }
+    }
+
+    std::vector<std::vector<SearchHit>> taskHits(tasks.size());
+
+    parallelFor(tasks.size(), [&](size_t t) {
+        const auto &task = tasks[t];
+        auto &heap = taskHits[t];
+        heap.reserve(limit + 1);
+
+        if (isQuantized) {
+            auto queryCodes = preparedCodes.data() + task.query * dimension;
+            auto queryScale = preparedScales[task.query];
+
+            for (auto i = task.begin; i < task.end; ++i) {
+                auto dot = dotInt8(queryCodes, task.list->codes + i * dimension, index.dimension);
+                pushHit(heap, limit, static_cast<float>(dot) * queryScale * task.list->scales[i], task.list->ids[i]);
+            }
+        } else {
+            auto query = prepared.data() + task.query * dimension;
+
+            for (auto i = task.begin; i < task.end; ++i) {
+                pushHit(heap, limit, dotFloat(query, task.list->vectors + i * dimension, index.dimension),
+                        task.list->ids[i]);
+            }
+        }
+    });
+
+    std::vector<std::vector<SearchHit>> queryHits(count);
+
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        auto &heap = queryHits[tasks[t].query];
+        for (const auto &[score, id]: taskHits[t]) pushHit(heap, limit, score, id);
+    }
+
+    for (size_t q = 0; q < count; ++q) {
+        auto &hits = queryHits[q];
+        std::sort(hits.begin(), hits.end(), std::greater<>());
+
+        for (size_t k = 0; k < limit; ++k) {
+            outputIds[q * limit + k] = k < hits.size() ? hits[k].second : -1;
+            outputScores[q * limit + k] = k < hits.size() ? hits[k].first : -std::numeric_limits<float>::infinity();
+        }
+    }
+}
+
+static size_t alignOffset(size_t offset) {
+    return (offset + INDEX_ALIGNMENT - 1) / INDEX_ALIGNMENT * INDEX_ALIGNMENT;
+}
+
+/**
+ * File layout: a header (magic, version, dimension, metric, quantization, centroid count), the list sizes, the
+ * centroids, then for each list its ids followed by its vectors or its int8 codes and scales. Every array starts at
+ * a 64-byte aligned offset so that a memory-mapped index is searched in place.
+ */
+static void save(const VectorIndex &index, const std::string &path) {
+    auto temporaryPath = path + ".tmp";
+
+    std::ofstream stream(temporaryPath, std::ios::binary | std::ios::trunc);
+    if (!stream) {
+        throw std::runtime_error("Failed to open index file");
+    }
+
+    size_t offset = 0;
+
+    auto write = [&](const void *data, size_t size) {
+        stream.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+        offset += size;
+    };
+
+    auto pad = [&] {
+        static const char zeros[INDEX_ALIGNMENT] = {};
+        write(zeros, alignOffset(offset) - offset);
+    };
+
+    auto nCentroids = static_cast<int32_t>(index.centroids.size() / index.dimension);
+    auto metric = static_cast<int32_t>(index.metric);
+    auto quantization = static_cast<int32_t>(index.quantization);
+    auto nLists = static_cast<int32_t>(index.lists.size());
+
+    write(&INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    write(&INDEX_VERSION, sizeof(INDEX_VERSION));
+    write(&index.dimension, sizeof(index.dimension));
+    write(&metric, sizeof(metric));
+    write(&quantization, sizeof(quantization));
+    write(&nCentroids, sizeof(nCentroids));
+    write(&nLists, sizeof(nLists));
+
+    for (const auto &list: index.lists) {
+        auto size = static_cast<uint64_t>(list.size);
+        write(&size, sizeof(size));
+    }
+
+    pad();
+    write(index.centroids.data(), index.centroids.size() * sizeof(float));
+
+    auto dimension = static_cast<size_t>(index.dimension);
+
+    for (const auto &list: index.lists) {
+        pad();
+        write(list.ids, list.size * sizeof(int64_t));
+        pad();
+        if (index.quantization == VectorQuantization::INT8) {
+            write(list.codes, list.size * dimension);
+            pad();
+            write(list.scales, list.size * sizeof(float));
+        } else {
+            write(list.vectors, list.size * dimension * sizeof(float));
+        }
+    }
+
+    stream.close();
+
+    if (!stream) {
+        throw std::runtime_error("Failed to write index file");
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporaryPath, path, error);
+    if (error) {
+        std::filesystem::remove(temporaryPath, error);
+        throw std::runtime_error("Failed to replace index file");
+    }
+}
+
+static std::unique_ptr<VectorIndex> load(const std::string &path) {
+    auto mapping = std::make_unique<MappedFile>(path);
+
+    size_t offset = 0;
+
+    auto read = [&](size_t size) {
+        if (offset > mapping->size() || size > mapping->size() - offset) {
+            throw std::runtime_error("Index file is truncated");
+        }
+        auto data = mapping->data() + offset;
+        offset += size;
+        return data;
+    };
+
+    auto arraySize = [&](uint64_t count, size_t elementSize) {
+        if (count > mapping->size() / elementSize) {
+            throw std::runtime_error("Index file is truncated");
+        }
+        return static_cast<size_t>(count) * elementSize;
+    };
+
+    auto readValue = [&]<typename T>(T &value) { std::memcpy(&value, read(sizeof(T)), sizeof(T)); };
+
+    uint32_t magic, version;
+    int32_t metric, quantization, nCentroids, nLists;
+
+    auto index = std::make_unique<VectorIndex>();
+
+    readValue(magic);
+    readValue(version);
+    if (magic != INDEX_MAGIC || version != INDEX_VERSION) {
+        throw std::runtime_error("Unsupported index file");
+    }
+
+    readValue(index->dimension);
+    readValue(metric);
+    readValue(quantization);
+    readValue(nCentroids);
+    readValue(nLists);
+
+    if (index->dimension <= 0 || nLists <= 0 || nCentroids < 0 || (nCentroids > 0 && nCentroids != nLists) ||
+        !isValidMetric(metric) || !isValidQuantization(quantization)) {
+        throw std::runtime_error("Corrupted index file");
+    }
+
+    arraySize(nLists, sizeof(uint64_t));
+
+    index->metric = static_cast<VectorMetric>(metric);
+    index->quantization = static_cast<VectorQuantization>(quantization);
+    index->lists.resize(nLists);
+
+    for (auto &list: index->lists) {
+        uint64_t size;
+        readValue(size);
+        list.size = static_cast<size_t>(size);
+    }
+
+    auto dimension = static_cast<size_t>(index->dimension);
+
+    offset = alignOffset(offset);
+    auto centroids = reinterpret_cast<const float *>(read(arraySize(nCentroids * dimension, sizeof(float))));
+    index->centroids.assign(centroids, centroids + nCentroids * dimension);
+
+    for (auto &list: index->lists) {
+        offset = alignOffset(offset);
+        list.ids = reinterpret_cast<const int64_t *>(read(arraySize(list.size, sizeof(int64_t))));
+        offset = alignOffset(offset);
+        if (index->quantization == VectorQuantization::INT8) {
+            list.codes = reinterpret_cast<const int8_t *>(read(arraySize(list.size, dimension)));
+            offset = alignOffset(offset);
+            list.scales = reinterpret_cast<const float *>(read(arraySize(list.size, sizeof(float))));
+        } else {
+            list.vectors = reinterpret_cast<const float *>(read(arraySize(list.size, dimension * sizeof(float))));
+        }
+    }
+
+    index->mapping = std::move(mapping);
+
+    return index;
+}
+
+static const float *getVectors(JNIEnv *env, jobject buffer, jint offset, jint count, jint dimension) {
+    auto data = static_cast<const float *>(env->GetDirectBufferAddress(buffer));
+    if (!data) {
+        throw std::runtime_error("Vector buffer should be direct");
+    }
+
+    if (offset < 0 || count < 0 ||
+        env->GetDirectBufferCapacity(buffer) < offset + static_cast<jlong>(count) * dimension) {
+        throw std::runtime_error("Vector buffer is too small");
+    }
+
+    return data + offset;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_createNative(JNIEnv *env, jclass thisClass,
+                                                                         jint dimension, jint metric,
+                                                                         jint quantization, jint lists) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        if (dimension <= 0) {
+            throw std::runtime_error("Dimension should be positive");
+        }
+
+        if (lists <= 0) {
+            throw std::runtime_error("Number of lists should be positive");
+        }
+
+        if (!isValidMetric(metric)) {
+            throw std::runtime_error("Invalid metric");
+        }
+
+        if (!isValidQuantization(quantization)) {
+            throw std::runtime_error("Invalid quantization");
+        }
+
+        auto index = std::make_unique<VectorIndex>();
+        index->dimension = dimension;
+        index->metric = static_cast<VectorMetric>(metric);
+        index->quantization = static_cast<VectorQuantization>(quantization);
+        index->lists.resize(lists);
+
+        auto handle = reinterpret_cast<jlong>(index.get());
+
+        pointers[handle] = std::move(index);
+
+        return handle;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_loadNative(JNIEnv *env, jclass thisClass, jstring path) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        const char *pathChars = env->GetStringUTFChars(path, nullptr);
+        if (!pathChars) {
+            throw std::runtime_error("Failed to get index path string");
+        }
+
+        std::string pathStr(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+
+        auto index = load(pathStr);
+
+        auto handle = reinterpret_cast<jlong>(index.get());
+
+        pointers[handle] = std::move(index);
+
+        return handle;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT jint JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_getDimensionNative(JNIEnv *env, jclass thisClass,
+                                                                               jlong handle) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        return getPointer(handle)->dimension;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_getSizeNative(JNIEnv *env, jclass thisClass,
+                                                                          jlong handle) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto index = getPointer(handle);
+
+        std::shared_lock<std::shared_mutex> indexLock(index->mutex);
+
+        size_t size = 0;
+        for (const auto &list: index->lists) size += list.size;
+
+        return static_cast<jlong>(size);
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_trainNative(JNIEnv *env, jclass thisClass, jlong handle,
+                                                                        jobject vectors, jint offset, jint count) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto index = getPointer(handle);
+
+        std::unique_lock<std::shared_mutex> indexLock(index->mutex);
+
+        train(*index, getVectors(env, vectors, offset, count, index->dimension), count);
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_addNative(JNIEnv *env, jclass thisClass, jlong handle,
+                                                                      jlongArray ids, jobject vectors, jint offset) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto index = getPointer(handle);
+
+        auto count = env->GetArrayLength(ids);
+        auto data = getVectors(env, vectors, offset, count, index->dimension);
+
+        std::vector<int64_t> idValues(count);
+        env->GetLongArrayRegion(ids, 0, count, reinterpret_cast<jlong *>(idValues.data()));
+
+        std::unique_lock<std::shared_mutex> indexLock(index->mutex);
+
+        add(*index, idValues.data(), data, count);
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_searchNative(JNIEnv *env, jclass thisClass, jlong handle,
+                                                                         jobject queries, jint offset, jint count,
+                                                                         jint limit, jint probes, jlongArray ids,
+                                                                         jfloatArray scores) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto index = getPointer(handle);
+
+        if (limit <= 0) {
+            throw std::runtime_error("Limit should be positive");
+        }
+
+        auto data = getVectors(env, queries, offset, count, index->dimension);
+
+        auto nResults = static_cast<jsize>(count) * limit;
+        if (env->GetArrayLength(ids) < nResults || env->GetArrayLength(scores) < nResults) {
+            throw std::runtime_error("Result arrays are too small");
+        }
+
+        std::vector<int64_t> resultIds(nResults);
+        std::vector<float> resultScores(nResults);
+
+        {
+            std::shared_lock<std::shared_mutex> indexLock(index->mutex);
+
+            search(*index, data, count, limit, probes, resultIds.data(), resultScores.data());
+        }
+
+        env->SetLongArrayRegion(ids, 0, nResults, reinterpret_cast<const jlong *>(resultIds.data()));
+        env->SetFloatArrayRegion(scores, 0, nResults, resultScores.data());
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_saveNative(JNIEnv *env, jclass thisClass, jlong handle,
+                                                                       jstring path) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto index = getPointer(handle);
+
+        const char *pathChars = env->GetStringUTFChars(path, nullptr);
+        if (!pathChars) {
+            throw std::runtime_error("Failed to get index path string");
+        }
+
+        std::string pathStr(pathChars);
+        env->ReleaseStringUTFChars(path, pathChars);
+
+        std::shared_lock<std::shared_mutex> indexLock(index->mutex);
+
+        save(*index, pathStr);
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_index_NativeVectorIndex_freeNative(JNIEnv *env, jclass thisClass, jlong handle) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        if (pointers.erase(handle) == 0) {
+            handleException(env, "Unable to free native pointer");
+        }
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
@@ -0,0 +1,102 @@
+#include "Java_com_github_numq_textgeneration_llama_NativeCpuFeatures.h"
+
+#ifdef CPU_FEATURES_X86
+struct CpuidRegisters {
+    uint32_t eax = 0;
+    uint32_t ebx = 0;
+    uint32_t ecx = 0;
+    uint32_t edx = 0;
+};
+
+static CpuidRegisters cpuid(uint32_t leaf, uint32_t subleaf) {
+    CpuidRegisters registers;
+
+#ifdef _MSC_VER
+    int values[4];
+    __cpuidex(values, static_cast<int>(leaf), static_cast<int>(subleaf));
+
+    registers.eax = values[0];
+    registers.ebx = values[1];
+    registers.ecx = values[2];
+    registers.edx = values[3];
+#else
+    __cpuid_count(leaf, subleaf, registers.eax, registers.ebx, registers.ecx, registers.edx);
+#endif
+
+    return registers;
+}
+
+/**
+ * Reads the register states the operating system saves on context switches, without which the instructions that use
+ * those registers cannot be used even if the CPU has them.
+ */
+static uint64_t getEnabledStates() {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+static bool hasBit(uint32_t value, int bit) {
+    return (value >> bit) & 1;
+}
+
+/**
+ * Detects the best CPU variant from CPUID. The variants are nested, each requiring the features of the one below.
+ */
+static CpuVariant detectVariant() {
+    if (cpuid(0, 0).eax < 7) {
+        return CpuVariant::BASELINE;
+    }
+
+    auto basic = cpuid(1, 0);
+
+    if (!hasBit(basic.ecx, 27)) {
+        return CpuVariant::BASELINE;
+    }
+
+    auto states = getEnabledStates();
+
+    auto avxStates = (states & 0x6) == 0x6;
+    auto avx512States = (states & 0xe6) == 0xe6;
+    auto amxStates = (states & 0x60000) == 0x60000;
+
+    auto extended = cpuid(7, 0);
+
+    auto avx2 = avxStates && hasBit(extended.ebx, 5) && hasBit(basic.ecx, 12) && hasBit(basic.ecx, 29) &&
+                hasBit(extended.ebx, 8);
+    if (!avx2) {
+        return CpuVariant::BASELINE;
+    }
+
+    auto avx512 = avx512States && hasBit(extended.ebx, 16) && hasBit(extended.ebx, 17) && hasBit(extended.ebx, 30) &&
+                  hasBit(extended.ebx, 31);
+    if (!avx512) {
+        return CpuVariant::AVX2;
+    }
+
+    if (!hasBit(extended.ecx, 11)) {
+        return CpuVariant::AVX512;
+    }
+
+    auto amx = amxStates && hasBit(extended.edx, 24) && hasBit(extended.edx, 25) && hasBit(cpuid(7, 1).eax, 5);
+    if (!amx) {
+        return CpuVariant::AVX512_VNNI;
+    }
+
+    return CpuVariant::AMX;
+}
+#else
+static CpuVariant detectVariant() {
+    return CpuVariant::BASELINE;
+}
+#endif
+
+JNIEXPORT jint JNICALL
+Java_com_github_numq_textgeneration_llama_NativeCpuFeatures_detectVariantNative(JNIEnv *env, jclass thisClass) {
+    return static_cast<jint>(detectVariant());
+}
@@ -1,15 +1,17 @@
 #include "Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration.h"
 
-static jclass exceptionClass;
 static std::shared_mutex mutex;
-static std::unordered_map<jlong, llama_context_ptr> pointers;
-static llama_model_ptr model;
+static std::unordered_map<jlong, std::unique_ptr<Instance>> pointers;
+static std::mutex stagedMutex;
+static std::unordered_map<jlong, std::unique_ptr<StagedModel>> stagedModels;
+static std::unordered_map<jlong, std::shared_ptr<LoraAdapter>> adapters;
+static std::unordered_map<jlong, std::shared_ptr<ControlVector>> controlVectors;
 
-void handleException(JNIEnv *env, const std::string &errorMessage) {
-    env->ThrowNew(exceptionClass, errorMessage.c_str());
-}
+static std::mutex swapMutex;
+static uint64_t useClock = 0;
+static size_t maxResidentCells = 0;
 
-llama_context *getPointer(jlong handle) {
+Instance *getPointer(jlong handle) {
     auto it = pointers.find(handle);
     if (it == pointers.end()) {
         throw std::runtime_error("Invalid handle");
@@ -17,268 +19,3690 @@ llama_context *getPointer(jlong handle) {
     return it->second.get();
 }
 
-static std::string generate(
-        const llama_vocab *vocab,
-        llama_context *ctx,
-        llama_sampler *sampler,
-        const std::string &prompt
-) {
-    std::string response;
+struct SamplingParameters {
+    float temperature;
+    float topP;
+    float repetitionPenalty;
+    int topK;
+    int seed;
+};
+
+static llama_sampler_ptr createSampler(const SamplingParameters &parameters) {
+    auto sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    if (!sampler) {
+        throw std::runtime_error("Failed to initialize sampler");
+    }
+
+    llama_sampler_ptr ptr(sampler);
+
+    llama_sampler_chain_add(
+            sampler,
+            llama_sampler_init_top_k(parameters.topK)
+    );
+
+    llama_sampler_chain_add(
+            sampler,
+            llama_sampler_init_top_p(parameters.topP, true)
+    );
+
+    llama_sampler_chain_add(
+            sampler,
+            parameters.seed > 0 ? llama_sampler_init_dist(parameters.seed) : llama_sampler_init_greedy()
+    );
+
+    llama_sampler_chain_add(
+            sampler,
+            llama_sampler_init_temp(parameters.temperature)
+    );
+
+    llama_sampler_chain_add(
+            sampler,
+            llama_sampler_init_penalties(
+                    0,
+                    parameters.repetitionPenalty,
+                    0,
+                    0
+            )
+    );
+
+    return ptr;
+}
+
+static std::string applyTemplate(const llama_model *llamaModel,
+                                  const std::vector<std::pair<std::string, std::string>> &messages,
+                                  bool addAssistant = true) {
+    std::vector<llama_chat_message> chatMessages(messages.size());
+    size_t totalLength = 0;
+
+    for (size_t i = 0; i < messages.size(); ++i) {
+        chatMessages[i].role = messages[i].first.c_str();
+        chatMessages[i].content = messages[i].second.c_str();
+        totalLength += messages[i].first.size() + messages[i].second.size();
+    }
+
+    auto tmpl = llama_model_chat_template(llamaModel, nullptr);
+
+    std::vector<char> formatted(2 * totalLength + 256);
+
+    int newLength = llama_chat_apply_template(tmpl, chatMessages.data(), chatMessages.size(), addAssistant,
+                                              formatted.data(), static_cast<int32_t>(formatted.size()));
+
+    if (newLength > static_cast<int>(formatted.size())) {
+        formatted.resize(newLength);
+        newLength = llama_chat_apply_template(tmpl, chatMessages.data(), chatMessages.size(), addAssistant,
+                                              formatted.data(), static_cast<int32_t>(formatted.size()));
+    }
+
+    if (newLength < 0) {
+        throw std::runtime_error("Failed to apply chat template");
+    }
+
+    return {formatted.begin(), formatted.begin() + newLength};
+}
+
+struct BatchGuard {
+    llama_batch batch;
+
+    BatchGuard(int32_t nTokens, int32_t nSeqMax) : batch(llama_batch_init(nTokens, 0, nSeqMax)) {}
+
+    BatchGuard(const BatchGuard &) = delete;
+
+    BatchGuard &operator=(const BatchGuard &) = delete;
+
+    ~BatchGuard() { llama_batch_free(batch); }
+};
+
+/**
+ * Leaves a context that is kept between requests empty and without adapters, whether the request succeeded or not.
+ */
+struct CompletionGuard {
+    llama_context *ctx;
+
+    explicit CompletionGuard(llama_context *ctx) : ctx(ctx) {}
+
+    CompletionGuard(const CompletionGuard &) = delete;
+
+    CompletionGuard &operator=(const CompletionGuard &) = delete;
+
+    ~CompletionGuard() {
+        llama_kv_cache_clear(ctx);
+        llama_clear_adapter_lora(ctx);
+        llama_apply_adapter_cvec(ctx, nullptr, 0, llama_model_n_embd(llama_get_model(ctx)), 0, 0);
+    }
+};
+
+static void addToBatch(llama_batch &batch, llama_token token, llama_pos pos, llama_seq_id seqId, bool logits) {
+    batch.token[batch.n_tokens] = token;
+    batch.pos[batch.n_tokens] = pos;
+    batch.n_seq_id[batch.n_tokens] = 1;
+    batch.seq_id[batch.n_tokens][0] = seqId;
+    batch.logits[batch.n_tokens] = logits;
+    batch.n_tokens++;
+}
+
+/**
+ * Brings the KV cache of sequence 0 in line with the prompt while keeping as much of it as possible: the common
+ * prefix is kept, and spans of cached tokens that the prompt no longer contains, such as truncated messages, are
+ * removed by shifting the following cells back instead of decoding them again.
+ *
+ * @return the number of prompt tokens that are already in the cache.
+ */
+static size_t reuseCache(llama_context *ctx, std::vector<llama_token> &cache, const std::vector<llama_token> &prompt) {
+    size_t nReused = 0;
+
+    while (true) {
+        while (nReused < cache.size() && nReused < prompt.size() && cache[nReused] == prompt[nReused]) {
+            nReused++;
+        }
+
+        if (nReused == cache.size() || nReused == prompt.size() || !llama_kv_cache_can_shift(ctx)) {
+            break;
+        }
+
+        auto nChunk = std::min(CACHE_REUSE_CHUNK_SIZE, prompt.size() - nReused);
+
+        auto match = std::search(cache.begin() + static_cast<std::ptrdiff_t>(nReused) + 1, cache.end(),
+                                 prompt.begin() + static_cast<std::ptrdiff_t>(nReused),
+                                 prompt.begin() + static_cast<std::ptrdiff_t>(nReused + nChunk));
+
+        if (match == cache.end()) {
+            break;
+        }
+
+        auto begin = static_cast<llama_pos>(nReused);
+        auto end = static_cast<llama_pos>(match - cache.begin());
+
+        llama_kv_cache_seq_rm(ctx, 0, begin, end);
+        llama_kv_cache_seq_add(ctx, 0, end, -1, begin - end);
+
+        cache.erase(cache.begin() + begin, cache.begin() + end);
+    }
+
+    if (nReused == prompt.size()) {
+        nReused--;
+    }
+
+    llama_kv_cache_seq_rm(ctx, 0, static_cast<llama_pos>(nReused), -1);
+    cache.resize(nReused);
+
+    return nReused;
+}
+
+/**
+ * Decodes the part of the prompt that is not cached yet and samples a response, keeping the cache in sync with every
+ * token that ends up in the KV cache of sequence 0.
+ *
+ * The prompt is decoded in chunks of the batch size, reporting progress after each chunk. Cancelling keeps the chunks
+ * decoded so far, so the next request for the same prompt continues from there.
+ */
+static std::string generate(
+        const llama_vocab *vocab,
+        llama_context *ctx,
+        llama_sampler *sampler,
+        std::vector<llama_token> &cache,
+        const std::vector<llama_token> &promptTokens,
+        int maxTokens,
+        const ProgressCallback &onProgress = nullptr
+) {
+    if (promptTokens.empty()) {
+        throw std::runtime_error("Prompt should not be empty");
+    }
+
+    auto nCtx = llama_n_ctx(ctx);
+    if (promptTokens.size() >= nCtx) {
+        throw std::runtime_error("Context size exceeded");
+    }
+
+    try {
+        auto nBatch = static_cast<size_t>(llama_n_batch(ctx));
+
+        BatchGuard guard(static_cast<int32_t>(nBatch), 1);
+        auto batch = &guard.batch;
+
+        auto nReused = reuseCache(ctx, cache, promptTokens);
+
+        for (auto i = nReused; i < promptTokens.size();) {
+            batch->n_tokens = 0;
+
+            for (; i < promptTokens.size() && static_cast<size_t>(batch->n_tokens) < nBatch; ++i) {
+                addToBatch(*batch, promptTokens[i], static_cast<llama_pos>(i), 0, i + 1 == promptTokens.size());
+            }
+
+            if (llama_decode(ctx, *batch)) {
+                throw std::runtime_error("Failed to decode");
+            }
+
+            cache.insert(cache.end(), promptTokens.begin() + static_cast<std::ptrdiff_t>(cache.size()),
+                         promptTokens.begin() + static_cast<std::ptrdiff_t>(i));
+
+            if (onProgress && !onProgress(i - nReused, promptTokens.size() - nReused)) {
+                throw CancellationException();
+            }
+        }
+
+        std::string response;
+
+        for (int nGenerated = 0; (maxTokens < 0 || nGenerated < maxTokens) && cache.size() < nCtx; ++nGenerated) {
+            auto newTokenId = llama_sampler_sample(sampler, ctx, -1);
+
+            if (llama_vocab_is_eog(vocab, newTokenId)) {
+                break;
+            }
+
+            response += tokenToPiece(vocab, newTokenId);
+
+            batch->n_tokens = 0;
+            addToBatch(*batch, newTokenId, static_cast<llama_pos>(cache.size()), 0, true);
+
+            if (llama_decode(ctx, *batch)) {
+                throw std::runtime_error("Failed to decode");
+            }
+
+            cache.push_back(newTokenId);
+        }
+
+        return response;
+    } catch (const CancellationException &) {
+        throw;
+    } catch (...) {
+        llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+        cache.clear();
+
+        throw;
+    }
+}
+
+static int32_t countMessageTokens(
+        const llama_model *llamaModel,
+        Conversation &conversation,
+        const std::pair<std::string, std::string> &message
+) {
+    auto key = std::hash<std::string>{}(message.first + '\0' + message.second);
+
+    auto it = conversation.messageTokenCounts.find(key);
+    if (it != conversation.messageTokenCounts.end()) {
+        return it->second;
+    }
+
+    auto count = countTokens(llama_model_get_vocab(llamaModel), applyTemplate(llamaModel, {message}, false), false);
+
+    conversation.messageTokenCounts[key] = count;
+
+    return count;
+}
+
+/**
+ * Selects the messages that fit into the token budget: the system message and the last turns are always kept, and
+ * the oldest turns in between are dropped one by one, each with the responses that follow it.
+ *
+ * The fit is estimated from cached per-message token counts and only confirmed by tokenizing the rendered prompt,
+ * so the history is not tokenized again for every candidate selection.
+ */
+static std::vector<llama_token> tokenizeTruncated(
+        const llama_model *llamaModel,
+        Conversation &conversation,
+        const std::vector<std::pair<std::string, std::string>> &messages,
+        const TruncationPolicy &policy,
+        size_t budget
+) {
+    auto vocab = llama_model_get_vocab(llamaModel);
+
+    std::vector<int32_t> counts(messages.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        counts[i] = countMessageTokens(llamaModel, conversation, messages[i]);
+    }
+
+    std::erase_if(conversation.messageTokenCounts, [&](const auto &entry) {
+        return std::none_of(messages.begin(), messages.end(), [&](const auto &message) {
+            return std::hash<std::string>{}(message.first + '\0' + message.second) == entry.first;
+        });
+    });
+
+    auto hasSystem = !messages.empty() && messages.front().first == "system";
+
+    std::vector<size_t> turns;
+    for (size_t i = hasSystem ? 1 : 0; i < messages.size(); ++i) {
+        if (messages[i].first == "user") turns.push_back(i);
+    }
+
+    auto nKeptTurns = std::min(turns.size(), static_cast<size_t>(std::max(policy.keepLastTurns, 1)));
+    auto keptFrom = turns.empty() ? messages.size() : turns[turns.size() - nKeptTurns];
+
+    std::vector<bool> selected(messages.size(), true);
+
+    auto estimate = [&] {
+        size_t total = 0;
+        for (size_t i = 0; i < messages.size(); ++i) {
+            if (selected[i]) total += counts[i];
+        }
+        return total + ASSISTANT_PREFIX_TOKENS;
+    };
+
+    size_t nextTurn = 0;
+
+    auto dropOldestTurn = [&] {
+        while (nextTurn < turns.size() && turns[nextTurn] < keptFrom) {
+            auto begin = turns[nextTurn++];
+            auto end = nextTurn < turns.size() ? turns[nextTurn] : keptFrom;
+
+            for (auto i = begin; i < end; ++i) selected[i] = false;
+
+            return true;
+        }
+
+        if (hasSystem && !policy.keepSystemMessage && selected[0]) {
+            selected[0] = false;
+            return true;
+        }
+
+        return false;
+    };
+
+    if (hasSystem) {
+        for (size_t i = 1; i < (turns.empty() ? keptFrom : turns.front()); ++i) selected[i] = false;
+    }
+
+    while (estimate() > budget && dropOldestTurn()) {}
+
+    while (true) {
+        std::vector<std::pair<std::string, std::string>> selectedMessages;
+        for (size_t i = 0; i < messages.size(); ++i) {
+            if (selected[i]) selectedMessages.push_back(messages[i]);
+        }
+
+        auto tokens = tokenize(vocab, applyTemplate(llamaModel, selectedMessages), true);
+
+        if (tokens.size() <= budget) {
+            return tokens;
+        }
+
+        if (!dropOldestTurn()) {
+            throw std::runtime_error("Context size exceeded");
+        }
+    }
+}
+
+struct BatchSlot {
+    size_t index = 0;
+    bool active = false;
+    size_t nConsumed = 0;
+    llama_pos nPast = 0;
+    int nGenerated = 0;
+    int iBatch = -1;
+    llama_token lastToken = 0;
+    llama_sampler_ptr sampler;
+    std::string response;
+};
+
+/**
+ * Runs continuous batching over a multi-sequence context: every sequence slot is refilled with the next prompt as
+ * soon as its previous prompt finishes, so each decode carries as many sequences as the context allows.
+ *
+ * A decode never carries more than the batch size: when more sequences are generating than fit, they take turns, and
+ * prompts are admitted in chunks that fill the rest of the batch.
+ *
+ * The callback receives either the response or an error for every prompt, and returns false to stop early.
+ */
+static void generateBatch(
+        const llama_vocab *vocab,
+        llama_context *ctx,
+        const std::vector<std::vector<llama_token>> &prompts,
+        const SamplingParameters &samplingParameters,
+        int maxTokens,
+        const std::function<bool(size_t, const std::string *, const std::string *)> &callback
+) {
+    auto nSeq = static_cast<int>(llama_n_seq_max(ctx));
+    auto nBatch = static_cast<int>(llama_n_batch(ctx));
+    auto nCtxSeq = static_cast<llama_pos>(llama_n_ctx(ctx)) / nSeq;
+
+    std::vector<BatchSlot> slots(nSeq);
+
+    BatchGuard guard(nBatch, 1);
+    auto batch = &guard.batch;
+
+    size_t nextPrompt = 0;
+
+    int firstSeqId = 0;
+
+    llama_kv_cache_clear(ctx);
+
+    while (true) {
+        for (auto &slot: slots) {
+            while (!slot.active && nextPrompt < prompts.size()) {
+                auto index = nextPrompt++;
+
+                if (prompts[index].empty() || static_cast<llama_pos>(prompts[index].size()) >= nCtxSeq) {
+                    std::string error = prompts[index].empty() ? "Prompt should not be empty" : "Context size exceeded";
+                    if (!callback(index, nullptr, &error)) return;
+                    continue;
+                }
+
+                slot.index = index;
+                slot.active = true;
+                slot.nConsumed = 0;
+                slot.nPast = 0;
+                slot.nGenerated = 0;
+                slot.response.clear();
+                slot.sampler = createSampler(samplingParameters);
+            }
+        }
+
+        batch->n_tokens = 0;
+
+        for (auto &slot: slots) {
+            slot.iBatch = -1;
+        }
+
+        for (int i = 0; i < nSeq && batch->n_tokens < nBatch; ++i) {
+            auto seqId = (firstSeqId + i) % nSeq;
+
+            auto &slot = slots[seqId];
+
+            if (slot.active && slot.nConsumed == prompts[slot.index].size()) {
+                slot.iBatch = batch->n_tokens;
+                addToBatch(*batch, slot.lastToken, slot.nPast++, seqId, true);
+            }
+        }
+
+        firstSeqId = (firstSeqId + 1) % nSeq;
+
+        for (int seqId = 0; seqId < nSeq && batch->n_tokens < nBatch; ++seqId) {
+            auto &slot = slots[seqId];
+            if (!slot.active) continue;
+
+            const auto &promptTokens = prompts[slot.index];
+
+            while (slot.nConsumed < promptTokens.size() && batch->n_tokens < nBatch) {
+                auto isLast = slot.nConsumed + 1 == promptTokens.size();
+                if (isLast) {
+                    slot.iBatch = batch->n_tokens;
+                }
+                addToBatch(*batch, promptTokens[slot.nConsumed++], slot.nPast++, seqId, isLast);
+            }
+        }
+
+        if (batch->n_tokens == 0) {
+            break;
+        }
+
+        if (llama_decode(ctx, *batch)) {
+            throw std::runtime_error("Failed to decode");
+        }
+
+        for (int seqId = 0; seqId < nSeq; ++seqId) {
+            auto &slot = slots[seqId];
+            if (!slot.active || slot.iBatch < 0) continue;
+
+            auto token = llama_sampler_sample(slot.sampler.get(), ctx, slot.iBatch);
+
+            auto isEog = llama_vocab_is_eog(vocab, token);
+            if (!isEog) {
+                slot.response += tokenToPiece(vocab, token);
+            }
+
+            slot.lastToken = token;
+            slot.nGenerated++;
+
+            if (isEog || (maxTokens >= 0 && slot.nGenerated >= maxTokens) || slot.nPast >= nCtxSeq) {
+                slot.active = false;
+                slot.sampler = nullptr;
+
+                llama_kv_cache_seq_rm(ctx, seqId, -1, -1);
+
+                if (!callback(slot.index, &slot.response, nullptr)) return;
+            }
+        }
+    }
+}
+
+static llama_context_ptr createContext(llama_model *llamaModel, const llama_context_params &contextParams) {
+    if (ggml_is_quantized(contextParams.type_v) && !contextParams.flash_attn) {
+        throw std::runtime_error("Quantized V cache requires flash attention");
+    }
+
+    auto context = llama_init_from_model(llamaModel, contextParams);
+    if (!context) {
+        throw std::runtime_error("Failed to create context");
+    }
+
+    return llama_context_ptr(context);
+}
+
+/**
+ * Reads the CPUs of a NUMA node from sysfs, where they are listed as ranges such as `0-7,16-23`.
+ */
+static std::vector<int> getNodeCpus(int node) {
+#ifdef __linux__
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    if (!file) {
+        throw std::runtime_error("NUMA node " + std::to_string(node) + " does not exist");
+    }
+
+    std::vector<int> cpus;
+
+    std::string range;
+    while (std::getline(file, range, ',')) {
+        int first, last;
+
+        auto count = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (count < 1) {
+            continue;
+        }
+
+        if (count == 1) {
+            last = first;
+        }
+
+        for (auto cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    if (cpus.empty()) {
+        throw std::runtime_error("NUMA node " + std::to_string(node) + " has no CPUs");
+    }
+
+    return cpus;
+#else
+    throw std::runtime_error("NUMA node pinning is only supported on Linux");
+#endif
+}
+
+/**
+ * Runs a function on a thread bound to the given CPUs, so that the buffers it touches first are allocated on their
+ * node. Without CPUs the function runs on the calling thread.
+ */
+static void runOnCpus(const std::vector<int> &cpus, const std::function<void()> &function) {
+    if (cpus.empty()) {
+        function();
+
+        return;
+    }
+
+    std::exception_ptr exception;
+
+    std::thread thread([&] {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        for (auto cpu: cpus) {
+            CPU_SET(cpu, &set);
+        }
+
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+
+        try {
+            function();
+        } catch (...) {
+            exception = std::current_exception();
+        }
+    });
+
+    thread.join();
+
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+static ThreadpoolPtr createThreadpool(const std::vector<int> &cpus, int nThreads) {
+    auto params = ggml_threadpool_params_default(nThreads);
+
+    for (auto cpu: cpus) {
+        if (cpu < GGML_MAX_N_THREADS) {
+            params.cpumask[cpu] = true;
+        }
+    }
+
+    params.poll = 0;
+
+    auto threadpool = ggml_threadpool_new(&params);
+    if (!threadpool) {
+        throw std::runtime_error("Failed to create threadpool");
+    }
+
+    return ThreadpoolPtr(threadpool);
+}
+
+/**
+ * Creates the threadpools of an instance pinned to a NUMA node. Every instance gets its own threadpools, as a
+ * threadpool runs one graph at a time, and batch generation gets a separate one, as it runs alongside the conversation.
+ */
+static std::unique_ptr<NumaPlacement> createPlacement(int node, const llama_context_params &contextParams) {
+    auto placement = std::make_unique<NumaPlacement>();
+    placement->node = node;
+    placement->cpus = getNodeCpus(node);
+    placement->threadpool = createThreadpool(placement->cpus, contextParams.n_threads);
+    placement->batchThreadpool = createThreadpool(placement->cpus, contextParams.n_threads_batch);
+    placement->batchGenerationThreadpool = createThreadpool(placement->cpus, contextParams.n_threads_batch);
+
+    return placement;
+}
+
+static const std::vector<int> &getPlacementCpus(const Instance *instance) {
+    static const std::vector<int> noCpus;
+
+    return instance->placement ? instance->placement->cpus : noCpus;
+}
+
+static void attachThreadpools(const Instance *instance, llama_context *ctx) {
+    if (instance->placement) {
+        llama_attach_threadpool(ctx, instance->placement->threadpool.get(), instance->placement->batchThreadpool.get());
+    }
+}
+
+/**
+ * Creates a context of an instance on the node it is pinned to, with the threadpools of that node attached.
+ */
+static llama_context_ptr createInstanceContext(const Instance *instance, const llama_context_params &contextParams) {
+    llama_context_ptr context;
+
+    runOnCpus(getPlacementCpus(instance), [&] {
+        context = createContext(instance->model.get(), contextParams);
+    });
+
+    attachThreadpools(instance, context.get());
+
+    return context;
+}
+
+/**
+ * Reads an integer hyperparameter of the model architecture from its metadata.
+ */
+static int64_t getArchitectureValue(const llama_model *llamaModel, const std::string &key, int64_t defaultValue) {
+    auto value = getMetadata(llamaModel, getMetadata(llamaModel, "general.architecture") + "." + key);
+
+    return value.empty() ? defaultValue : std::strtoll(value.c_str(), nullptr, 10);
+}
+
+/**
+ * Computes the size of the KV cache from the model hyperparameters, as it is allocated for every layer and cell.
+ */
+static size_t getKvCacheSize(const llama_model *llamaModel, const llama_context_params &contextParams) {
+    int64_t nHead = llama_model_n_head(llamaModel);
+    int64_t nHeadKv = getArchitectureValue(llamaModel, "attention.head_count_kv", nHead);
+    int64_t nEmbdHead = nHead > 0 ? llama_model_n_embd(llamaModel) / nHead : 0;
+
+    int64_t nEmbdK = getArchitectureValue(llamaModel, "attention.key_length", nEmbdHead) * nHeadKv;
+    int64_t nEmbdV = getArchitectureValue(llamaModel, "attention.value_length", nEmbdHead) * nHeadKv;
+
+    auto cellSize = ggml_row_size(contextParams.type_k, nEmbdK) + ggml_row_size(contextParams.type_v, nEmbdV);
+
+    return cellSize * llama_model_n_layer(llamaModel) * contextParams.n_ctx;
+}
+
+/**
+ * Estimates the compute buffers of a context from the largest tensors of its graph for one micro batch: the logits,
+ * the attention scores, which flash attention computes in tiles instead, and the feed-forward activations with the
+ * hidden states around them.
+ *
+ * llama.cpp does not expose the size of the buffers it allocates, so the estimate is taken from the parameters.
+ */
+static size_t getComputeBufferSize(const llama_model *llamaModel, const llama_context_params &contextParams) {
+    auto vocab = llama_model_get_vocab(llamaModel);
+
+    int64_t nUbatch = std::min(contextParams.n_batch, contextParams.n_ubatch);
+    int64_t nEmbd = llama_model_n_embd(llamaModel);
+    int64_t nFf = getArchitectureValue(llamaModel, "feed_forward_length", 4 * nEmbd);
+
+    auto elements = nUbatch * (llama_vocab_n_tokens(vocab) + 2 * nFf + 4 * nEmbd);
+
+    if (!contextParams.flash_attn) {
+        elements += nUbatch * llama_model_n_head(llamaModel) * static_cast<int64_t>(contextParams.n_ctx);
+    }
+
+    return static_cast<size_t>(elements) * sizeof(float);
+}
+
+/**
+ * Measures the prefill throughput of the context on a synthetic prompt, after a warmup decode.
+ *
+ * @return the number of prompt tokens decoded per second.
+ */
+static double measurePrefill(llama_context *ctx, const std::vector<llama_token> &tokens) {
+    auto nBatch = std::min(static_cast<size_t>(llama_n_batch(ctx)), tokens.size());
+
+    BatchGuard guard(static_cast<int32_t>(nBatch), 1);
+    auto batch = &guard.batch;
+
+    auto prefill = [&](size_t count) {
+        llama_kv_cache_clear(ctx);
+
+        for (size_t i = 0; i < count;) {
+            batch->n_tokens = 0;
+
+            for (; i < count && static_cast<size_t>(batch->n_tokens) < nBatch; ++i) {
+                addToBatch(*batch, tokens[i], static_cast<llama_pos>(i), 0, i + 1 == count);
+            }
+
+            if (llama_decode(ctx, *batch)) {
+                throw std::runtime_error("Failed to decode");
+            }
+        }
+    };
+
+    prefill(std::min(nBatch, tokens.size()));
+
+    auto start = std::chrono::steady_clock::now();
+
+    prefill(tokens.size());
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    llama_kv_cache_clear(ctx);
+
+    return static_cast<double>(tokens.size()) / std::max(elapsed.count(), 1e-9);
+}
+
+/**
+ * Picks the fastest prefill configuration on this machine by timing a synthetic prompt, tuning the number of batch
+ * threads, then the physical batch size and then the logical batch size, each with the best values found so far.
+ */
+static llama_context_params calibrate(llama_model *llamaModel, llama_context_params contextParams) {
+    auto vocab = llama_model_get_vocab(llamaModel);
+
+    auto nTokens = std::min(CALIBRATION_TOKENS, contextParams.n_ctx - 1);
+
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<llama_token> distribution(0, llama_vocab_n_tokens(vocab) - 1);
+
+    std::vector<llama_token> tokens(nTokens);
+    for (auto &token: tokens) {
+        token = distribution(generator);
+    }
+
+    auto best = contextParams;
+    auto bestRate = 0.0;
+
+    auto hardwareThreads = static_cast<int32_t>(std::max(std::thread::hardware_concurrency(), 1u));
+
+    std::vector<int32_t> threadCounts;
+    for (auto threads: {hardwareThreads / 4, hardwareThreads / 2, hardwareThreads * 3 / 4, hardwareThreads}) {
+        if (threads > 0 && std::find(threadCounts.begin(), threadCounts.end(), threads) == threadCounts.end()) {
+            threadCounts.push_back(threads);
+        }
+    }
+
+    {
+        auto context = createContext(llamaModel, best);
+
+        for (auto threads: threadCounts) {
+            llama_set_n_threads(context.get(), best.n_threads, threads);
+
+            if (auto rate = measurePrefill(context.get(), tokens); rate > bestRate) {
+                bestRate = rate;
+                best.n_threads_batch = threads;
+            }
+        }
+    }
+
+    auto measure = [&](uint32_t nBatch, uint32_t nUbatch) {
+        auto candidate = best;
+        candidate.n_batch = nBatch;
+        candidate.n_ubatch = nUbatch;
+
+        auto context = createContext(llamaModel, candidate);
+
+        if (auto rate = measurePrefill(context.get(), tokens); rate > bestRate) {
+            bestRate = rate;
+            best = candidate;
+        }
+    };
+
+    auto initial = best;
+
+    for (auto nUbatch: CALIBRATION_BATCH_SIZES) {
+        if (nUbatch <= nTokens && nUbatch != initial.n_ubatch) {
+            measure(std::max(initial.n_batch, nUbatch), nUbatch);
+        }
+    }
+
+    auto nUbatch = best.n_ubatch;
+
+    for (auto nBatch: CALIBRATION_BATCH_SIZES) {
+        if (nBatch >= nUbatch && nBatch <= contextParams.n_ctx && nBatch != best.n_batch) {
+            measure(nBatch, nUbatch);
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Returns a context to the pool of its model under its size class, unless that class is already full. The threadpools
+ * of the instance it belonged to are detached, as they are freed with that instance.
+ */
+static void returnContext(ContextPool &pool, llama_context_ptr context) {
+    auto ctx = context.get();
+
+    llama_detach_threadpool(ctx);
+    llama_kv_cache_clear(ctx);
+    llama_clear_adapter_lora(ctx);
+    llama_apply_adapter_cvec(ctx, nullptr, 0, llama_model_n_embd(pool.model.get()), 0, 0);
+
+    std::lock_guard<std::mutex> poolLock(pool.mutex);
+
+    auto &contexts = pool.contexts[llama_n_ctx(ctx)];
+
+    if (contexts.size() < pool.capacity) {
+        contexts.push_back(std::move(context));
+    }
+}
+
+/**
+ * Takes a context of the size of the instance from the pool of the model, or creates one if there is none.
+ */
+static llama_context_ptr acquireContext(const Instance *instance) {
+    auto &pool = instance->pool;
+
+    if (pool) {
+        std::lock_guard<std::mutex> poolLock(pool->mutex);
+
+        auto &contexts = pool->contexts[instance->contextParams.n_ctx];
+
+        if (!contexts.empty()) {
+            auto context = std::move(contexts.back());
+            contexts.pop_back();
+
+            attachThreadpools(instance, context.get());
+
+            return context;
+        }
+    }
+
+    return createInstanceContext(instance, instance->contextParams);
+}
+
+/**
+ * Frees the contexts of an idle instance, keeping the KV state of its conversation in host memory. The conversation
+ * context goes back to the pool of its model, so swapping the instance in again does not create a new one.
+ */
+static void swapOut(Instance *instance) {
+    auto ctx = instance->context.get();
+
+    if (!instance->conversation.tokens.empty()) {
+        instance->swappedState.resize(llama_state_seq_get_size(ctx, 0));
+
+        auto size = llama_state_seq_get_data(ctx, instance->swappedState.data(), instance->swappedState.size(), 0);
+
+        instance->swappedState.resize(size);
+    }
+
+    if (instance->pool && instance->pool->model == instance->model) {
+        returnContext(*instance->pool, std::move(instance->context));
+    }
+
+    instance->context = nullptr;
+    instance->embeddingContext = nullptr;
+    instance->parallelContext = nullptr;
+    instance->completionContext = nullptr;
+}
+
+static void swapIn(Instance *instance) {
+    instance->context = acquireContext(instance);
+
+    auto context = instance->context.get();
+
+    auto &state = instance->swappedState;
+
+    if (state.empty() || llama_state_seq_set_data(context, state.data(), state.size(), 0) == 0) {
+        llama_kv_cache_seq_rm(context, 0, -1, -1);
+
+        instance->conversation.tokens.clear();
+        instance->conversation.turns.clear();
+    }
+
+    std::vector<uint8_t>().swap(state);
+}
+
+/**
+ * Counts the cells of a context: the occupied cells if it is idle, or its full size if it is in use and may fill up
+ * while it is counted.
+ */
+static size_t getContextCells(llama_context *ctx, bool idle) {
+    if (!ctx) {
+        return 0;
+    }
+
+    return idle ? static_cast<size_t>(std::max(llama_get_kv_cache_used_cells(ctx), 0)) : llama_n_ctx(ctx);
+}
+
+/**
+ * Counts the cells an instance occupies across its conversation, embedding, parallel, completion and batch contexts.
+ * The first four are guarded by usage and the batch context by batchUsage, and whether each lock is free decides
+ * whether its contexts count as idle.
+ */
+static size_t getResidentCells(const Instance *instance, bool idle, bool batchIdle) {
+    return getContextCells(instance->context.get(), idle) + getContextCells(instance->embeddingContext.get(), idle) +
+           getContextCells(instance->parallelContext.get(), idle) +
+           getContextCells(instance->completionContext.get(), idle) +
+           getContextCells(instance->batchContext.get(), batchIdle);
+}
+
+/**
+ * Swaps out the least recently used idle instances until the cells occupied by the other instances, together with the
+ * requested cells, fit into the maximum number of resident cells. The conversation contexts and the batch context of
+ * an instance are guarded by separate locks, and each is only swapped out while it is not in use.
+ *
+ * Context pointers of an instance only change under swapMutex, which the caller holds, so they can be read here while
+ * the instance is in use.
+ */
+static void enforceResidentCells(const Instance *current, size_t requestedCells) {
+    if (maxResidentCells == 0) {
+        return;
+    }
+
+    while (true) {
+        auto residentCells = requestedCells;
+
+        Instance *leastRecentlyUsed = nullptr;
+
+        for (const auto &[handle, instance]: pointers) {
+            if (instance.get() == current) {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> usage(instance->usage, std::try_to_lock);
+            std::unique_lock<std::mutex> batchUsage(instance->batchUsage, std::try_to_lock);
+
+            auto cells = getResidentCells(instance.get(), usage.owns_lock(), batchUsage.owns_lock());
+
+            residentCells += cells;
+
+            auto isIdle = (usage.owns_lock() && (instance->context || instance->embeddingContext ||
+                                                 instance->parallelContext || instance->completionContext)) ||
+                          (batchUsage.owns_lock() && instance->batchContext);
+
+            if (cells > 0 && isIdle && (!leastRecentlyUsed || instance->lastUsed < leastRecentlyUsed->lastUsed)) {
+                leastRecentlyUsed = instance.get();
+            }
+        }
+
+        if (residentCells <= maxResidentCells || !leastRecentlyUsed) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> usage(leastRecentlyUsed->usage, std::try_to_lock);
+
+        if (usage.owns_lock()) {
+            if (leastRecentlyUsed->context) {
+                swapOut(leastRecentlyUsed);
+            }
+
+            leastRecentlyUsed->embeddingContext = nullptr;
+            leastRecentlyUsed->parallelContext = nullptr;
+            leastRecentlyUsed->completionContext = nullptr;
+        }
+
+        std::unique_lock<std::mutex> batchUsage(leastRecentlyUsed->batchUsage, std::try_to_lock);
+
+        if (batchUsage.owns_lock()) {
+            leastRecentlyUsed->batchContext = nullptr;
+            leastRecentlyUsed->batchModel = nullptr;
+        }
+    }
+}
+
+/**
+ * Marks the instance as in use for the lifetime of the returned lock, restoring its context if it was swapped out.
+ * Calls that only use the embedding context pass restoreContext = false, so a swapped out conversation stays in host
+ * memory.
+ */
+static std::unique_lock<std::mutex> useInstance(Instance *instance, bool restoreContext = true) {
+    std::unique_lock<std::mutex> usage(instance->usage);
+
+    std::lock_guard<std::mutex> swapLock(swapMutex);
+
+    instance->lastUsed = ++useClock;
+
+    if (restoreContext) {
+        auto requestedCells = getResidentCells(instance, true, false);
+
+        if (!instance->context) {
+            requestedCells += instance->conversation.tokens.size();
+        }
+
+        enforceResidentCells(instance, requestedCells);
+
+        if (!instance->context) {
+            swapIn(instance);
+        }
+    }
+
+    return usage;
+}
+
+static llama_context *getEmbeddingContext(Instance *instance, enum llama_pooling_type pooling) {
+    if (!instance->embeddingContext || llama_pooling_type(instance->embeddingContext.get()) != pooling) {
+        {
+            std::lock_guard<std::mutex> swapLock(swapMutex);
+
+            instance->embeddingContext = nullptr;
+        }
+
+        auto contextParams = instance->contextParams;
+        contextParams.n_ubatch = contextParams.n_batch;
+        contextParams.n_seq_max = MAX_EMBEDDING_SEQUENCES;
+        contextParams.embeddings = true;
+        contextParams.pooling_type = pooling;
+
+        llama_context *context = nullptr;
+
+        runOnCpus(getPlacementCpus(instance), [&] {
+            context = llama_init_from_model(instance->model.get(), contextParams);
+        });
+
+        if (!context) {
+            throw std::runtime_error("Failed to create embedding context");
+        }
+
+        {
+            std::lock_guard<std::mutex> swapLock(swapMutex);
+
+            instance->embeddingContext = llama_context_ptr(context);
+        }
+
+        attachThreadpools(instance, context);
+    }
+
+    return instance->embeddingContext.get();
+}
+
+/**
+ * Packs as many texts as the batch allows into one decode, one sequence per text, and writes the pooled embedding
+ * of every text into consecutive rows of the output.
+ */
+static void embed(
+        llama_context *ctx,
+        const std::vector<std::vector<llama_token>> &texts,
+        bool normalize,
+        float *output
+) {
+    auto nBatch = static_cast<size_t>(llama_n_batch(ctx));
+    auto nSeq = static_cast<size_t>(llama_n_seq_max(ctx));
+    auto nEmbd = llama_model_n_embd(llama_get_model(ctx));
+    auto isEncoder = llama_model_has_encoder(llama_get_model(ctx)) && !llama_model_has_decoder(llama_get_model(ctx));
+
+    BatchGuard guard(static_cast<int32_t>(nBatch), 1);
+    auto batch = &guard.batch;
+
+    size_t first = 0;
+
+    auto flush = [&](size_t end) {
+        if (batch->n_tokens == 0) return;
+
+        llama_kv_cache_clear(ctx);
+
+        if ((isEncoder ? llama_encode(ctx, *batch) : llama_decode(ctx, *batch)) != 0) {
+            throw std::runtime_error("Failed to decode");
+        }
+
+        for (auto i = first; i < end; ++i) {
+            auto embedding = llama_get_embeddings_seq(ctx, static_cast<llama_seq_id>(i - first));
+            if (!embedding) {
+                throw std::runtime_error("Failed to get sequence embeddings");
+            }
+
+            auto row = output + i * nEmbd;
+
+            auto norm = 1.0;
+            if (normalize) {
+                auto sum = 0.0;
+                for (int j = 0; j < nEmbd; ++j) sum += embedding[j] * embedding[j];
+                norm = sum > 0 ? std::sqrt(sum) : 1.0;
+            }
+
+            for (int j = 0; j < nEmbd; ++j) row[j] = static_cast<float>(embedding[j] / norm);
+        }
+
+        batch->n_tokens = 0;
+        first = end;
+    };
+
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const auto &tokens = texts[i];
+
+        if (tokens.empty()) {
+            throw std::runtime_error("Text should not be empty");
+        }
+
+        if (tokens.size() > nBatch) {
+            throw std::runtime_error("Text exceeds batch size");
+        }
+
+        if (batch->n_tokens + tokens.size() > nBatch || i - first == nSeq) {
+            flush(i);
+        }
+
+        for (size_t pos = 0; pos < tokens.size(); ++pos) {
+            addToBatch(*batch, tokens[pos], static_cast<llama_pos>(pos), static_cast<llama_seq_id>(i - first), true);
+        }
+    }
+
+    flush(texts.size());
+}
+
+static llama_context *getParallelContext(Instance *instance) {
+    if (!instance->parallelContext) {
+        auto contextParams = instance->contextParams;
+        contextParams.n_seq_max = MAX_PARALLEL_SEQUENCES;
+
+        llama_context *context = nullptr;
+
+        runOnCpus(getPlacementCpus(instance), [&] {
+            context = llama_init_from_model(instance->model.get(), contextParams);
+        });
+
+        if (!context) {
+            throw std::runtime_error("Failed to create parallel context");
+        }
+
+        {
+            std::lock_guard<std::mutex> swapLock(swapMutex);
+
+            instance->parallelContext = llama_context_ptr(context);
+        }
+
+        attachThreadpools(instance, context);
+    }
+
+    return instance->parallelContext.get();
+}
+
+/**
+ * Returns the single-sequence context completions are decoded on, created on first use at the full context size of
+ * the instance and kept with it like the embedding context, so it is created once and counts towards the resident
+ * cells.
+ */
+static llama_context *getCompletionContext(Instance *instance) {
+    if (!instance->completionContext) {
+        auto contextParams = instance->contextParams;
+
+        if (instance->pool && !instance->pool->sizeClasses.empty()) {
+            contextParams.n_ctx = instance->pool->sizeClasses.back();
+        }
+
+        {
+            std::lock_guard<std::mutex> swapLock(swapMutex);
+
+            enforceResidentCells(instance, getResidentCells(instance, false, false) + contextParams.n_ctx);
+        }
+
+        auto context = createInstanceContext(instance, contextParams);
+
+        {
+            std::lock_guard<std::mutex> swapLock(swapMutex);
+
+            instance->completionContext = std::move(context);
+        }
+    }
+
+    return instance->completionContext.get();
+}
+
+/**
+ * Returns the context batches are generated on, created on first use and kept with the instance like the embedding
+ * context. It is guarded by batchUsage rather than usage, so a batch runs alongside the conversation, and keeps the
+ * model it was created with, so a batch started before a model swap finishes on the previous model.
+ */
+static llama_context *getBatchContext(Instance *instance, const std::shared_ptr<llama_model> &llamaModel,
+                                      const llama_context_params &contextParams) {
+    std::lock_guard<std::mutex> swapLock(swapMutex);
+
+    instance->lastUsed = ++useClock;
+
+    auto context = instance->batchContext.get();
+
+    if (context && instance->batchModel == llamaModel && llama_n_ctx(context) == contextParams.n_ctx &&
+        llama_n_seq_max(context) == contextParams.n_seq_max) {
+        return context;
+    }
+
+    instance->batchContext = nullptr;
+    instance->batchModel = nullptr;
+
+    enforceResidentCells(instance, getResidentCells(instance, false, false) + contextParams.n_ctx);
+
+    runOnCpus(getPlacementCpus(instance), [&] {
+        context = llama_init_from_model(llamaModel.get(), contextParams);
+    });
+
+    if (!context) {
+        throw std::runtime_error("Failed to create batch context");
+    }
+
+    instance->batchModel = llamaModel;
+    instance->batchContext = llama_context_ptr(context);
+
+    if (instance->placement) {
+        auto threadpool = instance->placement->batchGenerationThreadpool.get();
+
+        llama_attach_threadpool(context, threadpool, threadpool);
+    }
+
+    return context;
+}
+
+static float logProbability(const float *logits, int32_t nVocab, llama_token token) {
+    auto maxLogit = *std::max_element(logits, logits + nVocab);
+
+    auto sum = 0.0;
+    for (int32_t i = 0; i < nVocab; ++i) sum += std::exp(logits[i] - maxLogit);
+
+    return static_cast<float>(logits[token] - maxLogit - std::log(sum));
+}
+
+/**
+ * Prefills the prompt once on sequence 0, then forks it into one sequence per candidate and evaluates as many
+ * candidates as fit into a single decode, summing the log-probabilities of their tokens.
+ */
+static std::vector<float> score(
+        llama_context *ctx,
+        const std::vector<llama_token> &prompt,
+        const std::vector<std::vector<llama_token>> &candidates
+) {
+    auto nVocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    auto nBatch = static_cast<size_t>(llama_n_batch(ctx));
+    auto nSeq = static_cast<size_t>(llama_n_seq_max(ctx));
+    auto nPrompt = static_cast<llama_pos>(prompt.size());
+
+    if (prompt.empty()) {
+        throw std::runtime_error("Prompt should not be empty");
+    }
+
+    size_t nRequired = prompt.size();
+    for (const auto &candidate: candidates) {
+        if (candidate.empty()) {
+            throw std::runtime_error("Candidate should not be empty");
+        }
+
+        if (candidate.size() > nBatch) {
+            throw std::runtime_error("Candidate exceeds batch size");
+        }
+
+        nRequired = std::max(nRequired, prompt.size() + candidate.size());
+    }
+
+    if (nRequired > llama_n_ctx(ctx)) {
+        throw std::runtime_error("Context size exceeded");
+    }
+
+    llama_kv_cache_clear(ctx);
+
+    BatchGuard guard(static_cast<int32_t>(nBatch), 1);
+    auto batch = &guard.batch;
+
+    std::vector<float> promptLogits;
+
+    for (size_t begin = 0; begin < prompt.size(); begin += nBatch) {
+        auto end = std::min(begin + nBatch, prompt.size());
+
+        batch->n_tokens = 0;
+        for (auto i = begin; i < end; ++i) {
+            addToBatch(*batch, prompt[i], static_cast<llama_pos>(i), 0, i + 1 == prompt.size());
+        }
+
+        if (llama_decode(ctx, *batch)) {
+            throw std::runtime_error("Failed to decode");
+        }
+    }
+
+    auto lastLogits = llama_get_logits_ith(ctx, batch->n_tokens - 1);
+    promptLogits.assign(lastLogits, lastLogits + nVocab);
+
+    std::vector<float> scores(candidates.size());
+
+    size_t next = 0;
+
+    while (next < candidates.size()) {
+        batch->n_tokens = 0;
+
+        std::vector<std::pair<size_t, int32_t>> group;
+
+        while (next < candidates.size() && group.size() + 1 < nSeq &&
+               batch->n_tokens + candidates[next].size() <= nBatch) {
+            auto seqId = static_cast<llama_seq_id>(group.size() + 1);
+
+            llama_kv_cache_seq_cp(ctx, 0, seqId, -1, -1);
+
+            group.emplace_back(next, batch->n_tokens);
+
+            const auto &candidate = candidates[next];
+            for (size_t j = 0; j < candidate.size(); ++j) {
+                addToBatch(*batch, candidate[j], nPrompt + static_cast<llama_pos>(j), seqId, j + 1 < candidate.size());
+            }
+
+            next++;
+        }
+
+        if (llama_decode(ctx, *batch)) {
+            throw std::runtime_error("Failed to decode");
+        }
+
+        for (const auto &[index, first]: group) {
+            const auto &candidate = candidates[index];
+
+            auto sum = logProbability(promptLogits.data(), nVocab, candidate[0]);
+            for (size_t j = 1; j < candidate.size(); ++j) {
+                sum += logProbability(llama_get_logits_ith(ctx, first + static_cast<int32_t>(j) - 1), nVocab,
+                                      candidate[j]);
+            }
+
+            scores[index] = sum;
+        }
+
+        for (size_t seqId = 1; seqId <= group.size(); ++seqId) {
+            llama_kv_cache_seq_rm(ctx, static_cast<llama_seq_id>(seqId), -1, -1);
+        }
+    }
+
+    return scores;
+}
+
+static std::vector<std::pair<std::string, std::string>> getMessages(JNIEnv *env, jobjectArray messages) {
+    jsize messageCount = env->GetArrayLength(messages);
+    std::vector<std::pair<std::string, std::string>> chatMessages(messageCount);
+
+    for (jsize i = 0; i < messageCount; ++i) {
+        jobject messageObj = env->GetObjectArrayElement(messages, i);
+        jclass messageClass = env->GetObjectClass(messageObj);
+
+        jfieldID roleFieldID = env->GetFieldID(messageClass, "role", "Ljava/lang/String;");
+        auto role = reinterpret_cast<jstring>(env->GetObjectField(messageObj, roleFieldID));
+        chatMessages[i].first = jstringToString(env, role);
+
+        jfieldID contentFieldID = env->GetFieldID(messageClass, "content", "Ljava/lang/String;");
+        auto content = reinterpret_cast<jstring>(env->GetObjectField(messageObj, contentFieldID));
+        chatMessages[i].second = jstringToString(env, content);
+
+        env->DeleteLocalRef(role);
+        env->DeleteLocalRef(content);
+        env->DeleteLocalRef(messageClass);
+        env->DeleteLocalRef(messageObj);
+    }
+
+    return chatMessages;
+}
+
+static ProgressCallback getProgressCallback(JNIEnv *env, jobject callback) {
+    if (!callback) {
+        return nullptr;
+    }
+
+    auto callbackClass = env->GetObjectClass(callback);
+    auto onProgress = env->GetMethodID(callbackClass, "onProgress", "(II)Z");
+    env->DeleteLocalRef(callbackClass);
+
+    if (!onProgress) {
+        throw std::runtime_error("Failed to find progress callback method");
+    }
+
+    return [env, callback, onProgress](size_t processed, size_t total) {
+        auto proceed = env->CallBooleanMethod(callback, onProgress, static_cast<jint>(processed),
+                                              static_cast<jint>(total));
+
+        return !env->ExceptionCheck() && proceed;
+    };
+}
+
+/**
+ * Reads the tensor infos of a GGUF file, skipping the metadata, which is read through llama.cpp once the model is
+ * loaded.
+ */
+static GgufFile readGgufFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+
+    auto readValue = [&]<typename T>(T &value) {
+        if (!file.read(reinterpret_cast<char *>(&value), sizeof(T))) {
+            throw std::runtime_error("Unexpected end of file " + path);
+        }
+    };
+
+    auto readString = [&] {
+        uint64_t length;
+        readValue(length);
+
+        std::string value(length, '\0');
+        if (!file.read(value.data(), static_cast<std::streamsize>(length))) {
+            throw std::runtime_error("Unexpected end of file " + path);
+        }
+
+        return value;
+    };
+
+    auto skipValue = [&](auto &&self, uint32_t type) -> void {
+        switch (type) {
+            case GGUF_TYPE_STRING:
+                readString();
+                break;
+            case GGUF_TYPE_ARRAY: {
+                uint32_t elementType;
+                uint64_t count;
+                readValue(elementType);
+                readValue(count);
+
+                for (uint64_t i = 0; i < count; ++i) {
+                    self(self, elementType);
+                }
+                break;
+            }
+            default:
+                if (type >= std::size(GGUF_TYPE_SIZES) || GGUF_TYPE_SIZES[type] == 0) {
+                    throw std::runtime_error("Unsupported value type in " + path);
+                }
+
+                file.seekg(GGUF_TYPE_SIZES[type], std::ios::cur);
+        }
+    };
+
+    uint32_t magic, version;
+    uint64_t tensorCount, kvCount;
+    readValue(magic);
+    readValue(version);
+    readValue(tensorCount);
+    readValue(kvCount);
+
+    if (magic != GGUF_FILE_MAGIC || version < 2) {
+        throw std::runtime_error("Invalid GGUF file " + path);
+    }
+
+    uint64_t alignment = GGUF_DEFAULT_ALIGNMENT;
+
+    for (uint64_t i = 0; i < kvCount; ++i) {
+        auto key = readString();
+
+        uint32_t type;
+        readValue(type);
+
+        if (key == "general.alignment" && type == GGUF_TYPE_UINT32) {
+            uint32_t value;
+            readValue(value);
+            alignment = value;
+        } else {
+            skipValue(skipValue, type);
+        }
+    }
+
+    GgufFile gguf;
+
+    for (uint64_t i = 0; i < tensorCount; ++i) {
+        GgufTensorInfo tensor;
+        tensor.name = readString();
+
+        uint32_t nDims;
+        readValue(nDims);
+
+        for (uint32_t d = 0; d < nDims; ++d) {
+            uint64_t dim;
+            readValue(dim);
+            tensor.nElements *= dim;
+        }
+
+        readValue(tensor.type);
+        readValue(tensor.offset);
+
+        gguf.tensors.push_back(std::move(tensor));
+    }
+
+    auto position = static_cast<uint64_t>(file.tellg());
+
+    gguf.dataOffset = (position + alignment - 1) / alignment * alignment;
+
+    return gguf;
+}
+
+/**
+ * Reads a control vector from a GGUF file with one `direction.<layer>` tensor of floats per steered layer, as written
+ * by the llama.cpp control vector generator. Layers without a tensor are left at zero.
+ */
+static std::shared_ptr<ControlVector> readControlVector(const std::shared_ptr<llama_model> &llamaModel,
+                                                        const std::string &path) {
+    auto gguf = readGgufFile(path);
+
+    auto nEmbd = llama_model_n_embd(llamaModel.get());
+    auto nLayer = llama_model_n_layer(llamaModel.get());
+
+    auto controlVector = std::make_shared<ControlVector>();
+    controlVector->model = llamaModel;
+    controlVector->data.assign(static_cast<size_t>(nEmbd) * nLayer, 0.0f);
+    controlVector->layerStart = nLayer;
+    controlVector->layerEnd = 0;
+
+    std::vector<std::pair<int32_t, uint64_t>> directions;
+
+    for (const auto &tensor: gguf.tensors) {
+        int32_t layer = 0;
+
+        if (std::sscanf(tensor.name.c_str(), "direction.%d", &layer) != 1) {
+            continue;
+        }
+
+        if (tensor.type != GGML_TYPE_F32 || tensor.nElements != static_cast<uint64_t>(nEmbd)) {
+            throw std::runtime_error("Control vector does not match the model");
+        }
+
+        if (layer < 1 || layer >= nLayer) {
+            throw std::runtime_error("Control vector layer is out of range");
+        }
+
+        directions.emplace_back(layer, tensor.offset);
+    }
+
+    if (directions.empty()) {
+        throw std::runtime_error("Control vector has no directions");
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+
+    for (const auto &[layer, offset]: directions) {
+        file.seekg(static_cast<std::streamoff>(gguf.dataOffset + offset));
+
+        auto direction = controlVector->data.data() + static_cast<size_t>(layer - 1) * nEmbd;
+
+        if (!file.read(reinterpret_cast<char *>(direction), static_cast<std::streamsize>(nEmbd * sizeof(float)))) {
+            throw std::runtime_error("Unexpected end of control vector file");
+        }
+
+        controlVector->layerStart = std::min(controlVector->layerStart, layer);
+        controlVector->layerEnd = std::max(controlVector->layerEnd, layer);
+    }
+
+    return controlVector;
+}
+
+static AdapterSelection getAdapterSelection(jlong adapter, jfloat adapterScale, jlong controlVector,
+                                            jfloat controlVectorScale) {
+    AdapterSelection selection;
+
+    if (adapter != 0) {
+        auto it = adapters.find(adapter);
+        if (it == adapters.end()) {
+            throw std::runtime_error("Invalid adapter handle");
+        }
+
+        selection.lora = it->second;
+        selection.loraScale = adapterScale;
+    }
+
+    if (controlVector != 0) {
+        auto it = controlVectors.find(controlVector);
+        if (it == controlVectors.end()) {
+            throw std::runtime_error("Invalid control vector handle");
+        }
+
+        selection.controlVector = it->second;
+        selection.controlVectorScale = controlVectorScale;
+    }
+
+    return selection;
+}
+
+/**
+ * Sets the adapter and the control vector of a selection on a context, replacing the ones it had.
+ */
+static void setAdapters(llama_context *ctx, const std::shared_ptr<llama_model> &llamaModel,
+                        const AdapterSelection &selection) {
+    if ((selection.lora && selection.lora->model != llamaModel) ||
+        (selection.controlVector && selection.controlVector->model != llamaModel)) {
+        throw std::runtime_error("Adapter was loaded for another model");
+    }
+
+    llama_clear_adapter_lora(ctx);
+
+    if (selection.lora && llama_set_adapter_lora(ctx, selection.lora->adapter.get(), selection.loraScale) != 0) {
+        throw std::runtime_error("Failed to apply adapter");
+    }
+
+    auto nEmbd = llama_model_n_embd(llamaModel.get());
+
+    if (!selection.controlVector) {
+        llama_apply_adapter_cvec(ctx, nullptr, 0, nEmbd, 0, 0);
+        return;
+    }
+
+    const auto &controlVector = *selection.controlVector;
+
+    std::vector<float> scaled(controlVector.data.size());
+
+    std::transform(controlVector.data.begin(), controlVector.data.end(), scaled.begin(), [&](float value) {
+        return value * selection.controlVectorScale;
+    });
+
+    if (llama_apply_adapter_cvec(ctx, scaled.data(), scaled.size(), nEmbd, controlVector.layerStart,
+                                 controlVector.layerEnd) != 0) {
+        throw std::runtime_error("Failed to apply control vector");
+    }
+}
+
+/**
+ * Applies the adapters selected for a request to the context of the instance. The context holds a single conversation,
+ * so when the selection differs from the one its cache was computed with, the cache is cleared and the conversation is
+ * decoded again with the new selection.
+ */
+static void applyAdapters(Instance *instance, const AdapterSelection &selection) {
+    auto &current = instance->adapters;
+
+    if (selection.lora != current.lora || selection.loraScale != current.loraScale ||
+        selection.controlVector != current.controlVector ||
+        selection.controlVectorScale != current.controlVectorScale) {
+        if ((selection.lora && selection.lora->model != instance->model) ||
+            (selection.controlVector && selection.controlVector->model != instance->model)) {
+            throw std::runtime_error("Adapter was loaded for another model");
+        }
+
+        llama_kv_cache_seq_rm(instance->context.get(), 0, -1, -1);
+
+        instance->conversation.tokens.clear();
+        instance->conversation.turns.clear();
+
+        current = selection;
+    }
+
+    setAdapters(instance->context.get(), instance->model, selection);
+}
+
+/**
+ * Returns the context of an instance that is being freed to the pool of its model, with the cache cleared.
+ */
+static void releaseContext(Instance *instance) {
+    if (!instance->pool || !instance->context || instance->pool->model != instance->model) {
+        return;
+    }
+
+    returnContext(*instance->pool, std::move(instance->context));
+}
+
+/**
+ * Moves the conversation of an instance to a context of the smallest size class that holds the required cells, or of
+ * the largest class if none does, by copying the KV cache of sequence 0. The previous context is returned to the pool.
+ *
+ * @return the context of the instance after the move.
+ */
+static llama_context *growContext(Instance *instance, size_t requiredCells) {
+    auto context = instance->context.get();
+
+    auto &pool = instance->pool;
+
+    if (!pool || pool->model != instance->model || requiredCells <= llama_n_ctx(context)) {
+        return context;
+    }
+
+    auto sizeClass = std::lower_bound(pool->sizeClasses.begin(), pool->sizeClasses.end(), requiredCells);
+
+    auto nCtx = sizeClass == pool->sizeClasses.end() ? pool->sizeClasses.back() : *sizeClass;
+
+    if (nCtx <= llama_n_ctx(context)) {
+        return context;
+    }
+
+    std::vector<uint8_t> state;
+
+    if (!instance->conversation.tokens.empty()) {
+        state.resize(llama_state_seq_get_size(context, 0));
+        state.resize(llama_state_seq_get_data(context, state.data(), state.size(), 0));
+    }
+
+    {
+        std::lock_guard<std::mutex> swapLock(swapMutex);
+
+        enforceResidentCells(instance, requiredCells);
+
+        auto previous = std::move(instance->context);
+
+        instance->contextParams.n_ctx = nCtx;
+        instance->context = acquireContext(instance);
+        instance->embeddingContext = nullptr;
+        instance->parallelContext = nullptr;
+
+        returnContext(*pool, std::move(previous));
+    }
+
+    context = instance->context.get();
+
+    if (!state.empty() && llama_state_seq_set_data(context, state.data(), state.size(), 0) == 0) {
+        llama_kv_cache_seq_rm(context, 0, -1, -1);
+
+        instance->conversation.tokens.clear();
+        instance->conversation.turns.clear();
+    }
+
+    applyAdapters(instance, instance->adapters);
+
+    return context;
+}
+
+/**
+ * Decodes the conversation into the KV cache without sampling, so that a later turn only decodes what follows it.
+ *
+ * A partial prompt is rendered as the beginning of a user message and cut right after its text, dropping the last
+ * token whose boundary may still change as the text grows. The cached tokens are reused by the next turn as far as its
+ * prompt extends them.
+ */
+static void prefillTurn(
+        JNIEnv *env,
+        Instance *instance,
+        jobjectArray messages,
+        jstring partialPrompt,
+        const ProgressCallback &onProgress
+) {
+    auto usage = useInstance(instance);
+
+    applyAdapters(instance, instance->adapters);
+
+    auto context = instance->context.get();
+    auto &conversation = instance->conversation;
+
+    auto vocab = llama_model_get_vocab(instance->model.get());
+    if (!vocab) {
+        throw std::runtime_error("Failed to get model vocab");
+    }
+
+    auto chatMessages = getMessages(env, messages);
+
+    std::string partial = partialPrompt ? jstringToString(env, partialPrompt) : "";
+
+    if (!partial.empty()) {
+        chatMessages.emplace_back("user", partial);
+    }
+
+    if (chatMessages.empty()) {
+        return;
+    }
+
+    auto formattedPrompt = applyTemplate(instance->model.get(), chatMessages, false);
+
+    if (!partial.empty()) {
+        auto position = formattedPrompt.rfind(partial);
+        if (position == std::string::npos) {
+            throw std::runtime_error("Failed to find partial prompt in the template");
+        }
+
+        formattedPrompt.resize(position + partial.size());
+    }
+
+    auto promptTokens = tokenize(vocab, formattedPrompt, true);
+
+    if (!partial.empty() && promptTokens.size() > 1) {
+        promptTokens.pop_back();
+    }
+
+    context = growContext(instance, promptTokens.size());
+
+    size_t begin = 0;
+    while (begin < conversation.tokens.size() && begin < promptTokens.size() &&
+           conversation.tokens[begin] == promptTokens[begin]) {
+        begin++;
+    }
+
+    std::erase_if(conversation.turns, [&](const Turn &turn) { return turn.promptEnd > begin; });
+
+    try {
+        generate(vocab, context, nullptr, conversation.tokens, promptTokens, 0, onProgress);
+    } catch (const CancellationException &) {
+        throw;
+    } catch (...) {
+        conversation.turns.clear();
+
+        throw;
+    }
+}
+
+/**
+ * Generates the response to the last message of the conversation and records the turn checkpoint.
+ *
+ * With Rewind::RESPONSE the cached prompt of the last turn is reused as it is and only the response is sampled
+ * again, and with Rewind::TURN the cache is cut back to where the last turn began, so only the replacement turn is
+ * decoded. Without a checkpoint both fall back to the regular prefix reuse.
+ */
+static std::string generateTurn(
+        JNIEnv *env,
+        Instance *instance,
+        jobjectArray messages,
+        const SamplingParameters &parameters,
+        int maxTokens,
+        const TruncationPolicy &policy,
+        Rewind rewind,
+        const AdapterSelection &selection,
+        const ProgressCallback &onProgress
+) {
+    auto usage = useInstance(instance);
+
+    applyAdapters(instance, selection);
+
+    auto context = instance->context.get();
+    auto &conversation = instance->conversation;
+
+    auto vocab = llama_model_get_vocab(instance->model.get());
+    if (!vocab) {
+        throw std::runtime_error("Failed to get model vocab");
+    }
+
+    auto sampler = createSampler(parameters);
+
+    std::optional<Turn> checkpoint;
+    if (rewind != Rewind::NONE && !conversation.turns.empty()) {
+        checkpoint = conversation.turns.back();
+        conversation.turns.pop_back();
+    }
+
+    std::vector<llama_token> promptTokens;
+
+    auto nReserved = static_cast<size_t>(std::max(maxTokens >= 0 ? maxTokens : policy.reservedTokens, 0));
+
+    if (checkpoint && rewind == Rewind::RESPONSE) {
+        promptTokens.assign(conversation.tokens.begin(),
+                            conversation.tokens.begin() + static_cast<std::ptrdiff_t>(checkpoint->promptEnd));
+
+        context = growContext(instance, promptTokens.size() + nReserved);
+    } else {
+        if (checkpoint) {
+            llama_kv_cache_seq_rm(context, 0, static_cast<llama_pos>(checkpoint->begin), -1);
+            conversation.tokens.resize(checkpoint->begin);
+        }
+
+        auto chatMessages = getMessages(env, messages);
+
+        promptTokens = tokenize(vocab, applyTemplate(instance->model.get(), chatMessages), true);
+
+        context = growContext(instance, promptTokens.size() + nReserved);
+
+        if (policy.enabled) {
+            auto nCtx = static_cast<size_t>(llama_n_ctx(context));
+
+            if (nReserved >= nCtx) {
+                throw std::runtime_error("Reserved tokens exceed context size");
+            }
+
+            if (promptTokens.size() > nCtx - nReserved) {
+                promptTokens = tokenizeTruncated(instance->model.get(), conversation, chatMessages, policy,
+                                                 nCtx - nReserved);
+            }
+        }
+    }
+
+    size_t begin = 0;
+    while (begin < conversation.tokens.size() && begin < promptTokens.size() &&
+           conversation.tokens[begin] == promptTokens[begin]) {
+        begin++;
+    }
+
+    std::string result;
+
+    try {
+        result = generate(vocab, context, sampler.get(), conversation.tokens, promptTokens, maxTokens, onProgress);
+    } catch (const CancellationException &) {
+        std::erase_if(conversation.turns, [&](const Turn &turn) { return turn.promptEnd > begin; });
+
+        throw;
+    } catch (...) {
+        conversation.turns.clear();
+
+        throw;
+    }
+
+    std::erase_if(conversation.turns, [&](const Turn &turn) { return turn.promptEnd > begin; });
+
+    conversation.turns.push_back({checkpoint ? std::min(checkpoint->begin, begin) : begin, promptTokens.size()});
+
+    if (result.empty()) {
+        throw std::runtime_error("Unable to generate response");
+    }
+
+    return result;
+}
+
+/**
+ * Clears the conversation while keeping the context and, when the system prompt is set, the part of the KV cache
+ * that holds it, so the next turn starts without decoding the system prompt again.
+ */
+static void resetConversation(const llama_model *llamaModel, llama_context *ctx, Conversation &conversation,
+                              const std::string &systemPrompt) {
+    conversation.turns.clear();
+    conversation.messageTokenCounts.clear();
+
+    size_t nKept = 0;
+
+    if (!systemPrompt.empty() && !conversation.tokens.empty()) {
+        auto systemTokens = tokenize(llama_model_get_vocab(llamaModel),
+                                     applyTemplate(llamaModel, {{"system", systemPrompt}}, false), true);
+
+        while (nKept < conversation.tokens.size() && nKept < systemTokens.size() &&
+               conversation.tokens[nKept] == systemTokens[nKept]) {
+            nKept++;
+        }
+    }
+
+    if (nKept == 0) {
+        llama_kv_cache_clear(ctx);
+    } else {
+        llama_kv_cache_seq_rm(ctx, 0, static_cast<llama_pos>(nKept), -1);
+    }
+
+    conversation.tokens.resize(nKept);
+}
+
+static size_t getSnapshotSize(llama_context *ctx, const Conversation &conversation) {
+    return sizeof(SnapshotHeader) + conversation.tokens.size() * sizeof(llama_token) +
+           conversation.turns.size() * 2 * sizeof(uint64_t) + llama_state_seq_get_size(ctx, 0);
+}
+
+/**
+ * Writes the conversation tokens, the turn checkpoints and the KV cache of sequence 0 straight into the output, so the
+ * state is not staged in an intermediate buffer.
+ *
+ * @return the number of bytes written.
+ */
+static size_t writeSnapshot(const llama_model *llamaModel, llama_context *ctx, const Conversation &conversation,
+                            uint8_t *output, size_t capacity) {
+    if (capacity < getSnapshotSize(ctx, conversation)) {
+        throw std::runtime_error("Snapshot buffer is too small");
+    }
+
+    auto position = output + sizeof(SnapshotHeader);
+
+    std::memcpy(position, conversation.tokens.data(), conversation.tokens.size() * sizeof(llama_token));
+    position += conversation.tokens.size() * sizeof(llama_token);
+
+    for (const auto &turn: conversation.turns) {
+        uint64_t bounds[] = {turn.begin, turn.promptEnd};
+        std::memcpy(position, bounds, sizeof(bounds));
+        position += sizeof(bounds);
+    }
+
+    auto stateSize = llama_state_seq_get_data(ctx, position, capacity - (position - output), 0);
+    if (stateSize == 0 && !conversation.tokens.empty()) {
+        throw std::runtime_error("Failed to get sequence state");
+    }
+
+    SnapshotHeader header{SNAPSHOT_MAGIC, SNAPSHOT_VERSION, llama_model_size(llamaModel),
+                          conversation.tokens.size(), conversation.turns.size(), stateSize};
+    std::memcpy(output, &header, sizeof(header));
+
+    return position - output + stateSize;
+}
+
+/**
+ * Replaces the conversation and the KV cache of sequence 0 with the snapshot, moving the conversation to a larger size
+ * class if the snapshot does not fit into its context. Every length is checked against the bytes that remain before
+ * anything is read or the current conversation is dropped.
+ *
+ * @return the number of bytes read.
+ */
+static size_t readSnapshot(Instance *instance, const uint8_t *input, size_t size) {
+    SnapshotHeader header{};
+
+    if (size < sizeof(header)) {
+        throw std::runtime_error("Invalid snapshot");
+    }
+
+    std::memcpy(&header, input, sizeof(header));
+
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+        throw std::runtime_error("Invalid snapshot");
+    }
+
+    if (header.modelSize != llama_model_size(instance->model.get())) {
+        throw std::runtime_error("Snapshot was taken with a different model");
+    }
+
+    auto position = input + sizeof(header);
+    auto remaining = size - sizeof(header);
+
+    auto take = [&](uint64_t count, size_t elementSize) {
+        if (count > remaining / elementSize) {
+            throw std::runtime_error("Invalid snapshot");
+        }
+
+        auto data = position;
+        position += count * elementSize;
+        remaining -= count * elementSize;
+
+        return data;
+    };
+
+    auto tokenData = take(header.tokenCount, sizeof(llama_token));
+    auto turnData = take(header.turnCount, 2 * sizeof(uint64_t));
+    auto stateData = take(header.stateSize, 1);
+
+    if (header.stateSize == 0 && header.tokenCount > 0) {
+        throw std::runtime_error("Invalid snapshot");
+    }
+
+    std::vector<llama_token> tokens(header.tokenCount);
+    std::memcpy(tokens.data(), tokenData, tokens.size() * sizeof(llama_token));
+
+    std::vector<Turn> turns(header.turnCount);
+    for (size_t i = 0; i < turns.size(); ++i) {
+        uint64_t bounds[2];
+        std::memcpy(bounds, turnData + i * sizeof(bounds), sizeof(bounds));
+
+        if (bounds[0] > bounds[1] || bounds[1] > tokens.size()) {
+            throw std::runtime_error("Invalid snapshot");
+        }
+
+        turns[i] = {bounds[0], bounds[1]};
+    }
+
+    auto &conversation = instance->conversation;
+
+    llama_kv_cache_seq_rm(instance->context.get(), 0, -1, -1);
+
+    conversation.tokens.clear();
+    conversation.turns.clear();
+    conversation.messageTokenCounts.clear();
+
+    auto ctx = growContext(instance, tokens.size() + 1);
+
+    if (tokens.size() >= llama_n_ctx(ctx)) {
+        throw std::runtime_error("Context size exceeded");
+    }
+
+    if (header.stateSize > 0 && llama_state_seq_set_data(ctx, stateData, header.stateSize, 0) == 0) {
+        throw std::runtime_error("Failed to set sequence state");
+    }
+
+    conversation.tokens = std::move(tokens);
+    conversation.turns = std::move(turns);
+
+    return position - input;
+}
+
+/**
+ * Validates the splits of a model in parallel and, if requested, reads them in parallel chunks so that their pages are
+ * in the page cache before the model is mapped, and mapping does not fault on every page from disk.
+ *
+ * @return the total size of the splits.
+ */
+static size_t readSplits(const std::vector<std::string> &paths, bool prefetch) {
+    std::vector<size_t> sizes(paths.size());
+
+    parallelFor(paths.size(), [&](size_t i) {
+        std::ifstream file(paths[i], std::ios::binary);
+
+        uint32_t magic = 0;
+
+        if (!file.read(reinterpret_cast<char *>(&magic), sizeof(magic)) || magic != GGUF_FILE_MAGIC) {
+            throw std::runtime_error("Invalid model file " + paths[i]);
+        }
+
+        sizes[i] = static_cast<size_t>(std::filesystem::file_size(paths[i]));
+    });
+
+    if (!prefetch) {
+        return std::accumulate(sizes.begin(), sizes.end(), size_t{0});
+    }
+
+    std::vector<std::pair<size_t, size_t>> chunks;
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        for (size_t offset = 0; offset < sizes[i]; offset += PREFETCH_CHUNK_SIZE) {
+            chunks.emplace_back(i, offset);
+        }
+    }
+
+    parallelFor(chunks.size(), [&](size_t i) {
+        auto [split, offset] = chunks[i];
+
+        std::ifstream file(paths[split], std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Failed to open " + paths[split]);
+        }
+
+        file.seekg(static_cast<std::streamoff>(offset));
+
+        std::vector<char> buffer(PREFETCH_BUFFER_SIZE);
+
+        auto remaining = std::min(PREFETCH_CHUNK_SIZE, sizes[split] - offset);
+
+        while (remaining > 0 && file.read(buffer.data(), static_cast<std::streamsize>(
+                std::min(remaining, buffer.size())))) {
+            remaining -= static_cast<size_t>(file.gcount());
+        }
+    });
+
+    return std::accumulate(sizes.begin(), sizes.end(), size_t{0});
+}
+
+/**
+ * Decodes a couple of tokens and discards them, so that the weights are paged in and the compute buffers are
+ * allocated before the first request.
+ */
+static void warmUp(const llama_model *llamaModel, llama_context *ctx) {
+    auto vocab = llama_model_get_vocab(llamaModel);
+
+    std::vector<llama_token> tokens;
+
+    for (auto token: {llama_vocab_bos(vocab), llama_vocab_eos(vocab)}) {
+        if (token != LLAMA_TOKEN_NULL) {
+            tokens.push_back(token);
+        }
+    }
+
+    if (tokens.empty()) {
+        tokens.push_back(0);
+    }
+
+    auto batch = llama_batch_get_one(tokens.data(), static_cast<int32_t>(tokens.size()));
+
+    if (llama_model_has_encoder(llamaModel) ? llama_encode(ctx, batch) : llama_decode(ctx, batch)) {
+        throw std::runtime_error("Failed to warm up");
+    }
+
+    llama_synchronize(ctx);
+
+    llama_kv_cache_clear(ctx);
+
+    llama_perf_context_reset(ctx);
+}
+
+static LoadCallback getLoadCallback(JNIEnv *env, jobject callback) {
+    if (!callback) {
+        return nullptr;
+    }
+
+    auto callbackClass = env->GetObjectClass(callback);
+    auto onProgress = env->GetMethodID(callbackClass, "onProgress", "(F)Z");
+    env->DeleteLocalRef(callbackClass);
+
+    if (!onProgress) {
+        throw std::runtime_error("Failed to find load callback method");
+    }
+
+    return [env, callback, onProgress](float progress) {
+        auto proceed = env->CallBooleanMethod(callback, onProgress, progress);
+
+        return !env->ExceptionCheck() && proceed;
+    };
+}
+
+static std::shared_ptr<llama_model> loadModel(
+        const std::string &path,
+        bool useMmap,
+        bool useMlock,
+        bool prefetch,
+        const LoadCallback &onProgress,
+        LoadReport *report
+) {
+    if (path.empty()) {
+        throw std::runtime_error("Model path should not be empty");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto paths = discoverSplits(path);
+
+    auto size = readSplits(paths, prefetch);
+
+    auto read = std::chrono::steady_clock::now();
+
+    auto modelParams = llama_model_default_params();
+    modelParams.use_mmap = useMmap;
+    modelParams.use_mlock = useMlock;
+
+    if (onProgress) {
+        modelParams.progress_callback = [](float progress, void *userData) {
+            return (*static_cast<const LoadCallback *>(userData))(progress);
+        };
+        modelParams.progress_callback_user_data = const_cast<LoadCallback *>(&onProgress);
+    }
+
+    std::vector<const char *> splitPaths;
+
+    for (const auto &splitPath: paths) {
+        splitPaths.push_back(splitPath.c_str());
+    }
+
+    std::shared_ptr<llama_model> loadedModel(
+            splitPaths.size() > 1 ? llama_model_load_from_splits(splitPaths.data(), splitPaths.size(), modelParams)
+                                  : llama_model_load_from_file(path.c_str(), modelParams),
+            llama_model_free
+    );
+
+    if (!loadedModel) {
+        throw std::runtime_error("Failed to load model");
+    }
+
+    if (report) {
+        auto loaded = std::chrono::steady_clock::now();
+
+        report->splitCount = paths.size();
+        report->size = size;
+        report->readTime = std::chrono::duration_cast<std::chrono::nanoseconds>(read - start).count();
+        report->loadTime = std::chrono::duration_cast<std::chrono::nanoseconds>(loaded - read).count();
+    }
+
+    return loadedModel;
+}
+
+/**
+ * Approximates the bits per weight of a model quantized to a file type, from the mix of tensor types llama.cpp picks
+ * for it.
+ */
+static double getBitsPerWeight(llama_ftype ftype) {
+    switch (ftype) {
+        case LLAMA_FTYPE_MOSTLY_Q8_0:
+            return 8.5;
+        case LLAMA_FTYPE_MOSTLY_Q6_K:
+            return 6.56;
+        case LLAMA_FTYPE_MOSTLY_Q5_K_M:
+            return 5.69;
+        case LLAMA_FTYPE_MOSTLY_Q5_K_S:
+        case LLAMA_FTYPE_MOSTLY_Q5_0:
+            return 5.5;
+        case LLAMA_FTYPE_MOSTLY_Q4_K_M:
+            return 4.85;
+        case LLAMA_FTYPE_MOSTLY_Q4_K_S:
+        case LLAMA_FTYPE_MOSTLY_Q4_0:
+            return 4.5;
+        case LLAMA_FTYPE_MOSTLY_Q3_K_L:
+            return 4.27;
+        case LLAMA_FTYPE_MOSTLY_Q3_K_M:
+            return 3.91;
+        case LLAMA_FTYPE_MOSTLY_Q3_K_S:
+            return 3.5;
+        case LLAMA_FTYPE_MOSTLY_Q2_K:
+            return 3.35;
+        default:
+            return 16.0;
+    }
+}
+
+/**
+ * Quantizes a model on a worker thread and reports progress from the calling thread as the share of the expected
+ * output size written so far, without touching the logger of the host.
+ *
+ * Progress stays below `1` until quantization finishes, since the expected size is an estimate.
+ */
+static int quantize(const std::string &inputPath, const std::string &outputPath,
+                    const llama_model_quantize_params &params, const LoadCallback &onProgress) {
+    auto quantization = std::async(std::launch::async, [&] {
+        return llama_model_quantize(inputPath.c_str(), outputPath.c_str(), &params);
+    });
+
+    if (!onProgress) {
+        return quantization.get();
+    }
+
+    uint64_t nElements = 0;
+
+    for (const auto &tensor: readGgufFile(inputPath).tensors) {
+        nElements += tensor.nElements;
+    }
+
+    auto expectedSize = static_cast<double>(nElements) * getBitsPerWeight(params.ftype) / 8.0;
+
+    auto reporting = onProgress(0.0f);
+
+    while (quantization.wait_for(std::chrono::milliseconds(QUANTIZATION_PROGRESS_INTERVAL)) !=
+           std::future_status::ready) {
+        std::error_code error;
+
+        auto written = std::filesystem::file_size(outputPath, error);
+
+        if (reporting && !error) {
+            reporting = onProgress(static_cast<float>(std::min(static_cast<double>(written) / expectedSize, .99)));
+        }
+    }
+
+    auto result = quantization.get();
+
+    if (reporting && result == 0) {
+        onProgress(1.0f);
+    }
+
+    return result;
+}
+
+/**
+ * Measures a model the way it is used: the time to load it, the prefill throughput and perplexity over the text, and
+ * the throughput of decoding one token at a time.
+ *
+ * The text is evaluated in windows of the context size, each starting with an empty cache. Prefill is timed the way
+ * a prompt is decoded, with logits only for the last token of a window, and perplexity is computed in a separate pass
+ * that scores every token after the first of a window against the logits of the token before it.
+ */
+static Benchmark benchmark(const std::string &modelPath, const std::string &text, int contextSize, int batchSize,
+                           int decodeTokens) {
+    Benchmark result;
+
+    auto start = std::chrono::steady_clock::now();
+
+    LoadReport loadReport;
+
+    auto llamaModel = loadModel(modelPath, true, false, false, nullptr, &loadReport);
+
+    auto contextParams = llama_context_default_params();
+    contextParams.n_ctx = contextSize;
+    contextParams.n_batch = batchSize;
+
+    auto context = createContext(llamaModel.get(), contextParams);
+    auto ctx = context.get();
+
+    warmUp(llamaModel.get(), ctx);
+
+    result.loadTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    result.size = loadReport.size;
+
+    auto vocab = llama_model_get_vocab(llamaModel.get());
+    if (!vocab) {
+        throw std::runtime_error("Failed to get model vocab");
+    }
+
+    auto tokens = tokenize(vocab, text, true);
+
+    if (tokens.size() < 2) {
+        throw std::runtime_error("Benchmark text is too short");
+    }
+
+    auto nCtx = static_cast<size_t>(llama_n_ctx(ctx));
+    auto nBatch = static_cast<size_t>(llama_n_batch(ctx));
+    auto nVocab = llama_vocab_n_tokens(vocab);
+
+    BatchGuard guard(static_cast<int32_t>(nBatch), 1);
+    auto batch = &guard.batch;
+
+    double negativeLogLikelihood = 0.0;
+    size_t scoredTokens = 0;
+
+    auto evaluate = [&](bool score) {
+        std::chrono::duration<double> elapsed{0};
+
+        for (size_t windowStart = 0; windowStart + 1 < tokens.size(); windowStart += nCtx) {
+            auto windowEnd = std::min(windowStart + nCtx, tokens.size());
+
+            llama_kv_cache_clear(ctx);
+
+            for (size_t i = windowStart; i < windowEnd;) {
+                auto batchStart = i;
+
+                batch->n_tokens = 0;
+
+                for (; i < windowEnd && static_cast<size_t>(batch->n_tokens) < nBatch; ++i) {
+                    addToBatch(*batch, tokens[i], static_cast<llama_pos>(i - windowStart), 0,
+                               score || i + 1 == windowEnd);
+                }
+
+                auto decodeStart = std::chrono::steady_clock::now();
+
+                if (llama_decode(ctx, *batch)) {
+                    throw std::runtime_error("Failed to decode");
+                }
+
+                llama_synchronize(ctx);
+
+                elapsed += std::chrono::steady_clock::now() - decodeStart;
+
+                if (!score) {
+                    continue;
+                }
+
+                for (auto j = batchStart; j < i && j + 1 < windowEnd; ++j) {
+                    auto logits = llama_get_logits_ith(ctx, static_cast<int32_t>(j - batchStart));
+
+                    auto maxLogit = *std::max_element(logits, logits + nVocab);
+
+                    double sum = 0.0;
+
+                    for (int32_t v = 0; v < nVocab; ++v) {
+                        sum += std::exp(static_cast<double>(logits[v] - maxLogit));
+                    }
+
+                    negativeLogLikelihood += std::log(sum) + maxLogit - logits[tokens[j + 1]];
+                    ++scoredTokens;
+                }
+            }
+        }
+
+        return elapsed;
+    };
+
+    auto prefillTime = evaluate(false);
+
+    evaluate(true);
+
+    result.prefillThroughput = static_cast<double>(tokens.size()) / std::max(prefillTime.count(), 1e-9);
+    result.perplexity = std::exp(negativeLogLikelihood / static_cast<double>(scoredTokens));
+
+    llama_kv_cache_clear(ctx);
+
+    llama_sampler_ptr sampler(llama_sampler_init_greedy());
+
+    auto nDecode = std::min(static_cast<size_t>(std::max(decodeTokens, 1)), nCtx - 1);
+
+    auto token = tokens.front();
+
+    auto decodeStart = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < nDecode; ++i) {
+        batch->n_tokens = 0;
+
+        addToBatch(*batch, token, static_cast<llama_pos>(i), 0, true);
+
+        if (llama_decode(ctx, *batch)) {
+            throw std::runtime_error("Failed to decode");
+        }
+
+        token = llama_sampler_sample(sampler.get(), ctx, -1);
+    }
+
+    std::chrono::duration<double> decodeTime = std::chrono::steady_clock::now() - decodeStart;
+
+    result.decodeThroughput = static_cast<double>(nDecode) / std::max(decodeTime.count(), 1e-9);
+
+    return result;
+}
+
+static std::vector<uint32_t> getSizeClasses(JNIEnv *env, jintArray contextSizeClasses, uint32_t contextSize) {
+    std::vector<uint32_t> sizeClasses{contextSize};
+
+    if (contextSizeClasses) {
+        auto length = env->GetArrayLength(contextSizeClasses);
+
+        std::vector<jint> values(length);
+        env->GetIntArrayRegion(contextSizeClasses, 0, length, values.data());
+
+        for (auto value: values) {
+            if (value <= 0 || static_cast<uint32_t>(value) > contextSize) {
+                throw std::runtime_error("Context size classes should be positive and not exceed the context size");
+            }
+
+            sizeClasses.push_back(static_cast<uint32_t>(value));
+        }
+    }
+
+    std::sort(sizeClasses.begin(), sizeClasses.end());
+    sizeClasses.erase(std::unique(sizeClasses.begin(), sizeClasses.end()), sizeClasses.end());
+
+    return sizeClasses;
+}
+
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, void *reserved) {
+    JNIEnv *env;
+
+    if (vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8) != JNI_OK) {
+        throw std::runtime_error("Failed to get JNI environment");
+    }
+
+    exceptionClass = reinterpret_cast<jclass>(env->NewGlobalRef(env->FindClass("java/lang/RuntimeException")));
+    if (exceptionClass == nullptr) {
+        throw std::runtime_error("Failed to find java/lang/RuntimeException class");
+    }
+
+    llama_backend_init();
+
+    return JNI_VERSION_1_8;
+}
+
+JNIEXPORT void JNICALL JNI_OnUnload(JavaVM *vm, void *reserved) {
+    JNIEnv *env;
+
+    if (vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8) != JNI_OK) return;
+
+    if (exceptionClass) env->DeleteGlobalRef(exceptionClass);
+
+    pointers.clear();
+
+    stagedModels.clear();
+
+    adapters.clear();
+
+    controlVectors.clear();
+
+    llama_backend_free();
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_initNumaNative(JNIEnv *env, jclass thisClass,
+                                                                                   jint strategy) {
+    try {
+        if (strategy <= GGML_NUMA_STRATEGY_DISABLED || strategy >= GGML_NUMA_STRATEGY_COUNT) {
+            throw std::runtime_error("Invalid NUMA strategy");
+        }
+
+        llama_numa_init(static_cast<ggml_numa_strategy>(strategy));
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+/**
+ * Reports the CPU variant the loaded ggml-cpu binary was built for, from the instruction sets it was compiled with, in
+ * the order of the variants of NativeCpuFeatures.
+ */
+JNIEXPORT jint JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getCpuVariantNative(JNIEnv *env,
+                                                                                        jclass thisClass) {
+    if (!ggml_cpu_has_avx2() || !ggml_cpu_has_fma() || !ggml_cpu_has_f16c()) {
+        return 0;
+    }
+
+    if (!ggml_cpu_has_avx512()) {
+        return 1;
+    }
+
+    if (!ggml_cpu_has_avx512_vnni()) {
+        return 2;
+    }
+
+    if (!ggml_cpu_has_amx_int8()) {
+        return 3;
+    }
+
+    return 4;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_initNative(JNIEnv *env, jclass thisClass,
+                                                                               jstring modelPath,
+                                                                               jint contextSize, jint batchSize,
+                                                                               jint microBatchSize, jint cacheTypeK,
+                                                                               jint cacheTypeV,
+                                                                               jboolean flashAttention,
+                                                                               jint threads, jint batchThreads,
+                                                                               jint contextPoolSize,
+                                                                               jintArray contextSizeClasses,
+                                                                               jint numaNode,
+                                                                               jboolean calibrateBatch,
+                                                                               jboolean useMmap, jboolean useMlock,
+                                                                               jboolean prefetch, jboolean warmup,
+                                                                               jobject callback) {
+    try {
+        auto modelPathStr = jstringToString(env, modelPath);
+
+        LoadReport loadReport;
+
+        auto loadedModel = loadModel(modelPathStr, useMmap, useMlock, prefetch, getLoadCallback(env, callback),
+                                     &loadReport);
+
+        auto contextParams = llama_context_default_params();
+        contextParams.n_ctx = contextSize;
+        contextParams.n_batch = batchSize;
+        if (microBatchSize > 0) {
+            contextParams.n_ubatch = microBatchSize;
+        }
+        contextParams.type_k = static_cast<ggml_type>(cacheTypeK);
+        contextParams.type_v = static_cast<ggml_type>(cacheTypeV);
+        contextParams.flash_attn = flashAttention;
+        if (threads > 0) {
+            contextParams.n_threads = threads;
+        }
+        if (batchThreads > 0) {
+            contextParams.n_threads_batch = batchThreads;
+        }
+
+        if (calibrateBatch) {
+            contextParams = calibrate(loadedModel.get(), contextParams);
+        }
+
+        auto instance = std::make_unique<Instance>();
+        instance->model = loadedModel;
+        instance->contextParams = contextParams;
+        instance->loadReport = loadReport;
+
+        if (numaNode >= 0) {
+            instance->placement = createPlacement(numaNode, contextParams);
+        }
+
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+
+            std::lock_guard<std::mutex> swapLock(swapMutex);
+
+            enforceResidentCells(nullptr, 0);
+
+            instance->context = createInstanceContext(instance.get(), contextParams);
+            instance->lastUsed = ++useClock;
+        }
+
+        if (warmup) {
+            warmUp(loadedModel.get(), instance->context.get());
+        }
+
+        instance->pool = std::make_shared<ContextPool>();
+        instance->pool->model = loadedModel;
+        instance->pool->capacity = contextPoolSize;
+        instance->pool->sizeClasses = getSizeClasses(env, contextSizeClasses, contextParams.n_ctx);
+
+        for (auto nCtx: instance->pool->sizeClasses) {
+            auto classParams = contextParams;
+            classParams.n_ctx = nCtx;
+
+            for (jint i = 0; i < contextPoolSize; ++i) {
+                llama_context_ptr context;
+
+                runOnCpus(getPlacementCpus(instance.get()), [&] {
+                    context = createContext(loadedModel.get(), classParams);
+                });
+
+                if (warmup) {
+                    warmUp(loadedModel.get(), context.get());
+                }
+
+                instance->pool->contexts[nCtx].push_back(std::move(context));
+            }
+        }
+
+        auto handle = reinterpret_cast<jlong>(instance.get());
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        pointers[handle] = std::move(instance);
+
+        return handle;
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
+        }
+        return -1;
+    }
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_generateNative(JNIEnv *env, jclass thisClass,
+                                                                                   jlong handle,
+                                                                                   jobjectArray messages,
+                                                                                   jfloat temperature,
+                                                                                   jfloat topP,
+                                                                                   jfloat repetitionPenalty, jint topK,
+                                                                                   jint seed, jint maxTokens,
+                                                                                   jboolean truncate,
+                                                                                   jboolean keepSystemMessage,
+                                                                                   jint keepLastTurns,
+                                                                                   jint reservedTokens,
+                                                                                   jlong adapter, jfloat adapterScale,
+                                                                                   jlong controlVector, jfloat controlVectorScale,
+                                                                                   jobject callback) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto result = generateTurn(env, getPointer(handle), messages,
+                                   {temperature, topP, repetitionPenalty, topK, seed}, maxTokens,
+                                   {static_cast<bool>(truncate), static_cast<bool>(keepSystemMessage), keepLastTurns,
+                                    reservedTokens}, Rewind::NONE,
+                                   getAdapterSelection(adapter, adapterScale, controlVector,
+                                                       controlVectorScale),
+                                   getProgressCallback(env, callback));
+
+        return env->NewStringUTF(result.c_str());
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
+        }
+    }
+
+    return nullptr;
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_prefillNative(JNIEnv *env, jclass thisClass,
+                                                                                  jlong handle,
+                                                                                  jobjectArray messages,
+                                                                                  jstring partialPrompt,
+                                                                                  jobject callback) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        prefillTurn(env, getPointer(handle), messages, partialPrompt, getProgressCallback(env, callback));
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
+        }
+    }
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_regenerateNative(JNIEnv *env, jclass thisClass,
+                                                                                     jlong handle,
+                                                                                     jobjectArray messages,
+                                                                                     jfloat temperature,
+                                                                                     jfloat topP,
+                                                                                     jfloat repetitionPenalty,
+                                                                                     jint topK, jint seed,
+                                                                                     jint maxTokens,
+                                                                                     jboolean truncate,
+                                                                                     jboolean keepSystemMessage,
+                                                                                     jint keepLastTurns,
+                                                                                     jint reservedTokens,
+                                                                                     jlong adapter, jfloat adapterScale,
+                                                                                     jlong controlVector, jfloat controlVectorScale,
+                                                                                     jobject callback) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto result = generateTurn(env, getPointer(handle), messages,
+                                   {temperature, topP, repetitionPenalty, topK, seed}, maxTokens,
+                                   {static_cast<bool>(truncate), static_cast<bool>(keepSystemMessage), keepLastTurns,
+                                    reservedTokens}, Rewind::RESPONSE,
+                                   getAdapterSelection(adapter, adapterScale, controlVector,
+                                                       controlVectorScale),
+                                   getProgressCallback(env, callback));
+
+        return env->NewStringUTF(result.c_str());
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
+        }
+    }
+
+    return nullptr;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_editLastNative(JNIEnv *env, jclass thisClass,
+                                                                                   jlong handle,
+                                                                                   jobjectArray messages,
+                                                                                   jfloat temperature,
+                                                                                   jfloat topP,
+                                                                                   jfloat repetitionPenalty, jint topK,
+                                                                                   jint seed, jint maxTokens,
+                                                                                   jboolean truncate,
+                                                                                   jboolean keepSystemMessage,
+                                                                                   jint keepLastTurns,
+                                                                                   jint reservedTokens,
+                                                                                   jlong adapter, jfloat adapterScale,
+                                                                                   jlong controlVector, jfloat controlVectorScale,
+                                                                                   jobject callback) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto result = generateTurn(env, getPointer(handle), messages,
+                                   {temperature, topP, repetitionPenalty, topK, seed}, maxTokens,
+                                   {static_cast<bool>(truncate), static_cast<bool>(keepSystemMessage), keepLastTurns,
+                                    reservedTokens}, Rewind::TURN,
+                                   getAdapterSelection(adapter, adapterScale, controlVector,
+                                                       controlVectorScale),
+                                   getProgressCallback(env, callback));
+
+        return env->NewStringUTF(result.c_str());
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
+        }
+    }
+
+    return nullptr;
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_generateBatchNative(JNIEnv *env, jclass thisClass,
+                                                                                        jlong handle,
+                                                                                        jstring systemPrompt,
+                                                                                        jobjectArray prompts,
+                                                                                        jfloat temperature,
+                                                                                        jfloat topP,
+                                                                                        jfloat repetitionPenalty,
+                                                                                        jint topK, jint seed,
+                                                                                        jint maxTokens,
+                                                                                        jint parallelism,
+                                                                                        jlong adapter,
+                                                                                        jfloat adapterScale,
+                                                                                        jlong controlVector,
+                                                                                        jfloat controlVectorScale,
+                                                                                        jobject callback) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        if (parallelism < 1) {
+            throw std::runtime_error("Parallelism should be positive");
+        }
+
+        auto instance = getPointer(handle);
+
+        std::lock_guard<std::mutex> batchUsage(instance->batchUsage);
+
+        std::shared_ptr<llama_model> llamaModel;
+
+        auto contextParams = llama_context_default_params();
+
+        {
+            std::lock_guard<std::mutex> usage(instance->usage);
+
+            llamaModel = instance->model;
+
+            contextParams = instance->contextParams;
+            contextParams.n_ctx = instance->pool ? instance->pool->sizeClasses.back() : instance->contextParams.n_ctx;
+        }
+
+        auto vocab = llama_model_get_vocab(llamaModel.get());
+        if (!vocab) {
+            throw std::runtime_error("Failed to get model vocab");
+        }
+
+        auto systemPromptStr = jstringToString(env, systemPrompt);
+
+        jsize promptCount = env->GetArrayLength(prompts);
+        std::vector<std::string> promptStrings(promptCount);
+
+        for (jsize i = 0; i < promptCount; ++i) {
+            auto prompt = reinterpret_cast<jstring>(env->GetObjectArrayElement(prompts, i));
+            promptStrings[i] = jstringToString(env, prompt);
+            env->DeleteLocalRef(prompt);
+        }
+
+        std::vector<std::vector<llama_token>> promptTokens(promptCount);
+
+        parallelFor(promptStrings.size(), [&](size_t i) {
+            auto formattedPrompt = applyTemplate(llamaModel.get(), {
+                    {"system", systemPromptStr},
+                    {"user",   promptStrings[i]}
+            });
+            promptTokens[i] = tokenize(vocab, formattedPrompt, true);
+        });
+
+        contextParams.n_ctx *= parallelism;
+        contextParams.n_seq_max = parallelism;
+
+        auto batchContext = getBatchContext(instance, llamaModel, contextParams);
+
+        setAdapters(batchContext, llamaModel,
+                    getAdapterSelection(adapter, adapterScale, controlVector, controlVectorScale));
+
+        auto callbackClass = env->GetObjectClass(callback);
+        auto onResult = env->GetMethodID(callbackClass, "onResult", "(ILjava/lang/String;Ljava/lang/String;)Z");
+        if (!onResult) {
+            throw std::runtime_error("Failed to find batch callback method");
+        }
+
+        generateBatch(vocab, batchContext, promptTokens, {temperature, topP, repetitionPenalty, topK, seed},
+                      maxTokens, [&](size_t index, const std::string *output, const std::string *error) {
+                    auto outputString = output ? env->NewStringUTF(output->c_str()) : nullptr;
+                    auto errorString = error ? env->NewStringUTF(error->c_str()) : nullptr;
+
+                    auto proceed = env->CallBooleanMethod(callback, onResult, static_cast<jint>(index), outputString,
+                                                          errorString);
+
+                    if (outputString) env->DeleteLocalRef(outputString);
+                    if (errorString) env->DeleteLocalRef(errorString);
+
+                    return !env->ExceptionCheck() && proceed;
+                });
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
+        }
+    }
+}
+
+JNIEXPORT jint JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getEmbeddingSizeNative(JNIEnv *env, jclass thisClass,
+                                                                                           jlong handle) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        return llama_model_n_embd(getPointer(handle)->model.get());
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return -1;
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_embedNative(JNIEnv *env, jclass thisClass,
+                                                                                jlong handle, jobjectArray texts,
+                                                                                jint pooling, jboolean normalize,
+                                                                                jobject output) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        auto usage = useInstance(instance, false);
+
+        auto vocab = llama_model_get_vocab(instance->model.get());
+        if (!vocab) {
+            throw std::runtime_error("Failed to get model vocab");
+        }
+
+        auto outputData = static_cast<float *>(env->GetDirectBufferAddress(output));
+        if (!outputData) {
+            throw std::runtime_error("Output buffer should be direct");
+        }
+
+        jsize textCount = env->GetArrayLength(texts);
+
+        if (env->GetDirectBufferCapacity(output) <
+            static_cast<jlong>(textCount) * llama_model_n_embd(instance->model.get())) {
+            throw std::runtime_error("Output buffer is too small");
+        }
+
+        std::vector<std::string> textStrings(textCount);
+
+        for (jsize i = 0; i < textCount; ++i) {
+            auto text = reinterpret_cast<jstring>(env->GetObjectArrayElement(texts, i));
+            textStrings[i] = jstringToString(env, text);
+            env->DeleteLocalRef(text);
+        }
+
+        std::vector<std::vector<llama_token>> textTokens(textCount);
+
+        parallelFor(textStrings.size(), [&](size_t i) {
+            textTokens[i] = tokenize(vocab, textStrings[i], true);
+        });
+
+        auto context = getEmbeddingContext(instance, static_cast<enum llama_pooling_type>(pooling));
+
+        embed(context, textTokens, normalize, outputData);
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_scoreNative(JNIEnv *env, jclass thisClass,
+                                                                                jlong handle, jstring systemPrompt,
+                                                                                jstring prompt,
+                                                                                jobjectArray candidates) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        auto usage = useInstance(instance);
+
+        auto vocab = llama_model_get_vocab(instance->model.get());
+        if (!vocab) {
+            throw std::runtime_error("Failed to get model vocab");
+        }
+
+        auto formattedPrompt = applyTemplate(instance->model.get(), {
+                {"system", jstringToString(env, systemPrompt)},
+                {"user",   jstringToString(env, prompt)}
+        });
+
+        auto promptTokens = tokenize(vocab, formattedPrompt, true);
+
+        jsize candidateCount = env->GetArrayLength(candidates);
+        std::vector<std::vector<llama_token>> candidateTokens(candidateCount);
+
+        for (jsize i = 0; i < candidateCount; ++i) {
+            auto candidate = reinterpret_cast<jstring>(env->GetObjectArrayElement(candidates, i));
+            candidateTokens[i] = tokenize(vocab, jstringToString(env, candidate), false);
+            env->DeleteLocalRef(candidate);
+        }
+
+        auto scores = score(getParallelContext(instance), promptTokens, candidateTokens);
+
+        auto result = env->NewFloatArray(candidateCount);
+        env->SetFloatArrayRegion(result, 0, candidateCount, scores.data());
+
+        return result;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return nullptr;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_completeNative(JNIEnv *env, jclass thisClass,
+                                                                                   jlong handle, jintArray tokens,
+                                                                                   jfloat temperature, jfloat topP,
+                                                                                   jfloat repetitionPenalty, jint topK,
+                                                                                   jint seed, jint maxTokens,
+                                                                                   jlong adapter, jfloat adapterScale,
+                                                                                   jlong controlVector,
+                                                                                   jfloat controlVectorScale) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        auto usage = useInstance(instance, false);
+
+        auto vocab = llama_model_get_vocab(instance->model.get());
+        if (!vocab) {
+            throw std::runtime_error("Failed to get model vocab");
+        }
+
+        std::vector<llama_token> promptTokens(env->GetArrayLength(tokens));
+        if (promptTokens.empty()) {
+            throw std::runtime_error("Tokens should not be empty");
+        }
+        env->GetIntArrayRegion(tokens, 0, static_cast<jsize>(promptTokens.size()), promptTokens.data());
+
+        auto nVocab = llama_vocab_n_tokens(vocab);
+        for (auto token: promptTokens) {
+            if (token < 0 || token >= nVocab) {
+                throw std::runtime_error("Invalid token " + std::to_string(token));
+            }
+        }
+
+        auto context = getCompletionContext(instance);
+
+        CompletionGuard guard(context);
+
+        setAdapters(context, instance->model,
+                    getAdapterSelection(adapter, adapterScale, controlVector, controlVectorScale));
+
+        auto sampler = createSampler({temperature, topP, repetitionPenalty, topK, seed});
+
+        std::vector<llama_token> cache;
+
+        auto result = generate(vocab, context, sampler.get(), cache, promptTokens, maxTokens);
+
+        return env->NewStringUTF(result.c_str());
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return nullptr;
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_resetNative(JNIEnv *env, jclass thisClass,
+                                                                                jlong handle, jstring systemPrompt) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        auto usage = useInstance(instance);
+
+        resetConversation(instance->model.get(), instance->context.get(), instance->conversation,
+                           jstringToString(env, systemPrompt));
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getSnapshotSizeNative(JNIEnv *env,
+                                                                                          jclass thisClass,
+                                                                                          jlong handle) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        auto usage = useInstance(instance);
+
+        return static_cast<jlong>(getSnapshotSize(instance->context.get(), instance->conversation));
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return -1;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_snapshotNative(JNIEnv *env, jclass thisClass,
+                                                                                   jlong handle, jobject buffer,
+                                                                                   jlong offset) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        auto usage = useInstance(instance);
+
+        auto data = static_cast<uint8_t *>(env->GetDirectBufferAddress(buffer));
+        if (!data) {
+            throw std::runtime_error("Snapshot buffer should be direct");
+        }
 
-    auto isFirst = llama_get_kv_cache_used_cells(ctx) == 0;
+        auto capacity = env->GetDirectBufferCapacity(buffer);
+        if (offset < 0 || offset > capacity) {
+            throw std::runtime_error("Invalid snapshot buffer offset");
+        }
 
-    auto nPromptTokens = -llama_tokenize(vocab, prompt.c_str(), static_cast<int>(prompt.size()), nullptr, 0, isFirst,
-                                         true);
-    std::vector<llama_token> promptTokens(nPromptTokens);
-    if (llama_tokenize(
-            vocab,
-            prompt.c_str(),
-            static_cast<int>(prompt.size()),
-            promptTokens.data(),
-            static_cast<int>(promptTokens.size()),
-            isFirst,
-            true
-    ) < 0) {
-        throw std::runtime_error("Failed to tokenize the prompt");
+        return static_cast<jlong>(writeSnapshot(instance->model.get(), instance->context.get(), instance->conversation, data + offset,
+                                                static_cast<size_t>(capacity - offset)));
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
     }
 
-    llama_batch batch = llama_batch_get_one(promptTokens.data(), static_cast<int>(promptTokens.size()));
-    llama_token newTokenId;
+    return -1;
+}
 
-    while (true) {
-        auto nCtx = static_cast<int>(llama_n_ctx(ctx));
-        auto nCtxUsed = llama_get_kv_cache_used_cells(ctx);
-        if (nCtxUsed + batch.n_tokens > nCtx) {
-            throw std::runtime_error("Context size exceeded");
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_restoreNative(JNIEnv *env, jclass thisClass,
+                                                                                  jlong handle, jobject buffer,
+                                                                                  jlong offset, jlong length) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        auto usage = useInstance(instance);
+
+        auto data = static_cast<const uint8_t *>(env->GetDirectBufferAddress(buffer));
+        if (!data) {
+            throw std::runtime_error("Snapshot buffer should be direct");
         }
 
-        if (llama_decode(ctx, batch)) {
-            throw std::runtime_error("Failed to decode");
+        if (offset < 0 || length < 0 || offset + length > env->GetDirectBufferCapacity(buffer)) {
+            throw std::runtime_error("Invalid snapshot buffer range");
         }
 
-        newTokenId = llama_sampler_sample(sampler, ctx, -1);
+        return static_cast<jlong>(readSnapshot(instance, data + offset, static_cast<size_t>(length)));
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
 
-        if (llama_vocab_is_eog(vocab, newTokenId)) {
-            break;
-        }
+    return -1;
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_setMaxResidentCellsNative(JNIEnv *env,
+                                                                                              jclass thisClass,
+                                                                                              jlong cells) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
 
-        char buf[256];
-        auto n = llama_token_to_piece(vocab, newTokenId, buf, sizeof(buf), 0, true);
-        if (n < 0) {
-            throw std::runtime_error("Failed to convert token to piece");
+    try {
+        if (cells < 0) {
+            throw std::runtime_error("Maximum number of resident cells should not be negative");
         }
-        std::string piece(buf, n);
-        response += piece;
 
-        batch = llama_batch_get_one(&newTokenId, 1);
+        std::lock_guard<std::mutex> swapLock(swapMutex);
+
+        maxResidentCells = static_cast<size_t>(cells);
+
+        enforceResidentCells(nullptr, 0);
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getMemoryUsageNative(JNIEnv *env,
+                                                                                         jclass thisClass,
+                                                                                         jlong handle) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        std::lock_guard<std::mutex> usage(instance->usage);
+
+        jlong memoryUsage[] = {
+                static_cast<jlong>(llama_model_size(instance->model.get())),
+                static_cast<jlong>(getKvCacheSize(instance->model.get(), instance->contextParams)),
+                static_cast<jlong>(getComputeBufferSize(instance->model.get(), instance->contextParams))
+        };
+
+        auto result = env->NewLongArray(3);
+        env->SetLongArrayRegion(result, 0, 3, memoryUsage);
+
+        return result;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
     }
 
-    return response;
+    return nullptr;
 }
 
-JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, void *reserved) {
-    JNIEnv *env;
+JNIEXPORT jlongArray JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getLoadReportNative(JNIEnv *env,
+                                                                                        jclass thisClass,
+                                                                                        jlong handle) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
 
-    if (vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8) != JNI_OK) {
-        throw std::runtime_error("Failed to get JNI environment");
+    try {
+        auto instance = getPointer(handle);
+
+        std::lock_guard<std::mutex> usage(instance->usage);
+
+        jlong report[] = {
+                static_cast<jlong>(instance->loadReport.splitCount),
+                static_cast<jlong>(instance->loadReport.size),
+                static_cast<jlong>(instance->loadReport.readTime),
+                static_cast<jlong>(instance->loadReport.loadTime)
+        };
+
+        auto result = env->NewLongArray(4);
+        env->SetLongArrayRegion(result, 0, 4, report);
+
+        return result;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
     }
 
-    exceptionClass = reinterpret_cast<jclass>(env->NewGlobalRef(env->FindClass("java/lang/RuntimeException")));
-    if (exceptionClass == nullptr) {
-        throw std::runtime_error("Failed to find java/lang/RuntimeException class");
+    return nullptr;
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_getConfigurationNative(JNIEnv *env,
+                                                                                           jclass thisClass,
+                                                                                           jlong handle) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto instance = getPointer(handle);
+
+        auto usage = useInstance(instance);
+
+        auto context = instance->context.get();
+
+        jint configuration[] = {
+                static_cast<jint>(llama_n_ctx(context)),
+                static_cast<jint>(llama_n_batch(context)),
+                static_cast<jint>(llama_n_ubatch(context)),
+                llama_n_threads(context),
+                llama_n_threads_batch(context)
+        };
+
+        auto result = env->NewIntArray(5);
+        env->SetIntArrayRegion(result, 0, 5, configuration);
+
+        return result;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
     }
 
-    llama_backend_init();
+    return nullptr;
+}
 
-    return JNI_VERSION_1_8;
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_prepareModelNative(JNIEnv *env,
+                                                                                       jclass thisClass,
+                                                                                       jlong handle,
+                                                                                       jstring modelPath,
+                                                                                       jboolean useMmap,
+                                                                                       jboolean useMlock,
+                                                                                       jboolean prefetch,
+                                                                                       jboolean warmup,
+                                                                                       jobject callback) {
+    try {
+        llama_context_params contextParams;
+
+        std::vector<int> cpus;
+
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+
+            auto instance = getPointer(handle);
+
+            contextParams = instance->contextParams;
+            cpus = getPlacementCpus(instance);
+        }
+
+        auto staged = std::make_unique<StagedModel>();
+        staged->owner = handle;
+
+        staged->model = loadModel(jstringToString(env, modelPath), useMmap, useMlock, prefetch,
+                                  getLoadCallback(env, callback), &staged->loadReport);
+
+        runOnCpus(cpus, [&] {
+            staged->context = createContext(staged->model.get(), contextParams);
+        });
+
+        if (warmup) {
+            warmUp(staged->model.get(), staged->context.get());
+        }
+
+        auto stagedHandle = reinterpret_cast<jlong>(staged.get());
+
+        std::shared_lock<std::shared_mutex> lock(mutex);
+
+        getPointer(handle);
+
+        std::lock_guard<std::mutex> stagedLock(stagedMutex);
+
+        stagedModels[stagedHandle] = std::move(staged);
+
+        return stagedHandle;
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
+        }
+    }
+
+    return -1;
 }
 
-JNIEXPORT void JNICALL JNI_OnUnload(JavaVM *vm, void *reserved) {
-    JNIEnv *env;
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_swapModelNative(JNIEnv *env, jclass thisClass,
+                                                                                    jlong handle,
+                                                                                    jlong stagedHandle) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
 
-    if (vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_8) != JNI_OK) return;
+    try {
+        std::unique_ptr<StagedModel> staged;
 
-    if (exceptionClass) env->DeleteGlobalRef(exceptionClass);
+        {
+            std::lock_guard<std::mutex> stagedLock(stagedMutex);
 
-    pointers.clear();
+            auto it = stagedModels.find(stagedHandle);
+            if (it == stagedModels.end() || it->second->owner != handle) {
+                throw std::runtime_error("Invalid staged model handle");
+            }
 
-    model = nullptr;
+            staged = std::move(it->second);
+            stagedModels.erase(it);
+        }
 
-    llama_backend_free();
+        auto instance = getPointer(handle);
+
+        attachThreadpools(instance, staged->context.get());
+
+        std::lock_guard<std::mutex> usage(instance->usage);
+
+        auto pool = std::make_shared<ContextPool>();
+        pool->model = staged->model;
+        pool->capacity = instance->pool ? instance->pool->capacity : 0;
+        pool->sizeClasses = instance->pool ? instance->pool->sizeClasses : std::vector<uint32_t>{};
+
+        std::lock_guard<std::mutex> swapLock(swapMutex);
+
+        instance->model = std::move(staged->model);
+        instance->context = std::move(staged->context);
+        instance->embeddingContext = nullptr;
+        instance->parallelContext = nullptr;
+        instance->completionContext = nullptr;
+        instance->loadReport = staged->loadReport;
+        instance->pool = std::move(pool);
+        instance->lastUsed = ++useClock;
+
+        std::unique_lock<std::mutex> batchUsage(instance->batchUsage, std::try_to_lock);
+
+        if (batchUsage.owns_lock()) {
+            instance->batchContext = nullptr;
+            instance->batchModel = nullptr;
+        }
+
+        instance->conversation = {};
+        instance->adapters = {};
+        std::vector<uint8_t>().swap(instance->swappedState);
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
 }
 
 JNIEXPORT jlong JNICALL
-Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_initNative(JNIEnv *env, jclass thisClass,
-                                                                               jstring modelPath,
-                                                                               jint contextSize, jint batchSize) {
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_loadAdapterNative(JNIEnv *env, jclass thisClass,
+                                                                                      jlong handle,
+                                                                                      jstring adapterPath) {
+    try {
+        auto loraAdapter = std::make_shared<LoraAdapter>();
+
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+
+            auto instance = getPointer(handle);
+
+            std::lock_guard<std::mutex> usage(instance->usage);
+
+            loraAdapter->model = instance->model;
+        }
+
+        auto adapterPathStr = jstringToString(env, adapterPath);
+
+        loraAdapter->adapter.reset(llama_adapter_lora_init(loraAdapter->model.get(), adapterPathStr.c_str()));
+
+        if (!loraAdapter->adapter) {
+            throw std::runtime_error("Failed to load adapter");
+        }
+
+        auto adapterHandle = reinterpret_cast<jlong>(loraAdapter.get());
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        adapters[adapterHandle] = std::move(loraAdapter);
+
+        return adapterHandle;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return -1;
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_freeAdapterNative(JNIEnv *env, jclass thisClass,
+                                                                                      jlong adapterHandle) {
     std::unique_lock<std::shared_mutex> lock(mutex);
 
     try {
-        const char *modelPathChars = env->GetStringUTFChars(modelPath, nullptr);
-        if (!modelPathChars) {
-            throw std::runtime_error("Failed to get model path string");
+        if (adapters.erase(adapterHandle) == 0) {
+            throw std::runtime_error("Invalid adapter handle");
         }
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_loadControlVectorNative(JNIEnv *env,
+                                                                                            jclass thisClass,
+                                                                                            jlong handle,
+                                                                                            jstring controlVectorPath) {
+    try {
+        std::shared_ptr<llama_model> llamaModel;
 
-        std::string modelPathStr(modelPathChars);
-        env->ReleaseStringUTFChars(modelPath, modelPathChars);
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
 
-        if (modelPathStr.empty()) {
-            throw std::runtime_error("Model path should not be empty");
+            auto instance = getPointer(handle);
+
+            std::lock_guard<std::mutex> usage(instance->usage);
+
+            llamaModel = instance->model;
         }
 
-        auto modelParams = llama_model_default_params();
+        auto controlVector = readControlVector(llamaModel, jstringToString(env, controlVectorPath));
 
-        auto loadedModel = llama_model_load_from_file(modelPathStr.c_str(), modelParams);
+        auto controlVectorHandle = reinterpret_cast<jlong>(controlVector.get());
 
-        if (!llama_model_load_from_file(modelPathStr.c_str(), modelParams)) {
-            throw std::runtime_error("Failed to load model");
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        controlVectors[controlVectorHandle] = std::move(controlVector);
+
+        return controlVectorHandle;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return -1;
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_freeControlVectorNative(JNIEnv *env,
+                                                                                            jclass thisClass,
+                                                                                            jlong controlVectorHandle) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        if (controlVectors.erase(controlVectorHandle) == 0) {
+            throw std::runtime_error("Invalid control vector handle");
         }
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
 
-        model = llama_model_ptr(loadedModel);
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_quantizeNative(JNIEnv *env, jclass thisClass,
+                                                                                   jstring inputPath,
+                                                                                   jstring outputPath,
+                                                                                   jint type, jobject callback) {
+    try {
+        auto inputPathStr = jstringToString(env, inputPath);
+        auto outputPathStr = jstringToString(env, outputPath);
 
-        auto contextParams = llama_context_default_params();
-        contextParams.n_ctx = contextSize;
-        contextParams.n_batch = batchSize;
+        if (inputPathStr.empty() || outputPathStr.empty()) {
+            throw std::runtime_error("Model path should not be empty");
+        }
 
-        auto context = llama_init_from_model(model.get(), contextParams);
-        if (!context) {
-            throw std::runtime_error("Failed to create context");
+        auto quantizeParams = llama_model_quantize_default_params();
+        quantizeParams.ftype = static_cast<llama_ftype>(type);
+        quantizeParams.allow_requantize = true;
+
+        if (quantize(inputPathStr, outputPathStr, quantizeParams, getLoadCallback(env, callback)) != 0) {
+            throw std::runtime_error("Failed to quantize model");
+        }
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
         }
+    }
+}
 
-        llama_context_ptr ptr(context);
+JNIEXPORT jdoubleArray JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_benchmarkNative(JNIEnv *env, jclass thisClass,
+                                                                                    jstring modelPath, jstring text,
+                                                                                    jint contextSize, jint batchSize,
+                                                                                    jint decodeTokens) {
+    try {
+        auto result = benchmark(jstringToString(env, modelPath), jstringToString(env, text), contextSize, batchSize,
+                                decodeTokens);
 
-        auto handle = reinterpret_cast<jlong>(ptr.get());
+        jdouble values[] = {
+                static_cast<jdouble>(result.size),
+                static_cast<jdouble>(result.loadTime),
+                result.prefillThroughput,
+                result.decodeThroughput,
+                result.perplexity
+        };
 
-        pointers[handle] = std::move(ptr);
+        auto array = env->NewDoubleArray(5);
+        env->SetDoubleArrayRegion(array, 0, 5, values);
 
-        return handle;
+        return array;
     } catch (const std::exception &e) {
         handleException(env, e.what());
-        return -1;
     }
-}
 
-JNIEXPORT jstring JNICALL
-Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_generateNative(JNIEnv *env, jclass thisClass,
-                                                                                   jlong handle,
-                                                                                   jobjectArray messages,
-                                                                                   jfloat temperature,
-                                                                                   jfloat topP,
-                                                                                   jfloat repetitionPenalty, jint topK,
-                                                                                   jint seed) {
-    std::shared_lock<std::shared_mutex> lock(mutex);
+    return nullptr;
+}
 
+JNIEXPORT jlongArray JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_probeNative(JNIEnv *env, jclass thisClass,
+                                                                                jstring modelPath,
+                                                                                jobject metadata) {
     try {
-        auto it = pointers.find(handle);
-        if (it == pointers.end()) {
-            throw std::runtime_error("Invalid handle");
+        auto modelPathStr = jstringToString(env, modelPath);
+
+        if (modelPathStr.empty()) {
+            throw std::runtime_error("Model path should not be empty");
         }
 
-        jsize messageCount = env->GetArrayLength(messages);
-        std::vector<llama_chat_message> chatMessages(messageCount);
+        auto paths = discoverSplits(modelPathStr);
 
-        for (jsize i = 0; i < messageCount; ++i) {
-            jobject messageObj = env->GetObjectArrayElement(messages, i);
-            jclass messageClass = env->GetObjectClass(messageObj);
+        std::vector<const char *> splitPaths;
 
-            jfieldID roleFieldID = env->GetFieldID(messageClass, "role", "Ljava/lang/String;");
-            auto role = reinterpret_cast<jstring>(env->GetObjectField(messageObj, roleFieldID));
-            auto roleChars = env->GetStringUTFChars(role, nullptr);
-            chatMessages[i].role = roleChars;
-            env->ReleaseStringUTFChars(role, roleChars);
+        for (const auto &splitPath: paths) {
+            splitPaths.push_back(splitPath.c_str());
+        }
+
+        auto modelParams = llama_model_default_params();
+        modelParams.vocab_only = true;
+
+        llama_model_ptr llamaModel(
+                splitPaths.size() > 1 ? llama_model_load_from_splits(splitPaths.data(), splitPaths.size(), modelParams)
+                                      : llama_model_load_from_file(modelPathStr.c_str(), modelParams)
+        );
 
-            jfieldID contentFieldID = env->GetFieldID(messageClass, "content", "Ljava/lang/String;");
-            auto content = reinterpret_cast<jstring>(env->GetObjectField(messageObj, contentFieldID));
-            auto contentChars = env->GetStringUTFChars(content, nullptr);
-            chatMessages[i].content = contentChars;
-            env->ReleaseStringUTFChars(content, contentChars);
+        if (!llamaModel) {
+            throw std::runtime_error("Failed to load model");
         }
 
-        auto context = it->second.get();
+        uint64_t nParams = 0;
+        uint64_t size = 0;
 
-        auto vocab = llama_model_get_vocab(model.get());
-        if (!vocab) {
-            throw std::runtime_error("Failed to get model vocab");
+        for (const auto &splitPath: paths) {
+            for (const auto &tensor: readGgufFile(splitPath).tensors) {
+                nParams += tensor.nElements;
+            }
+
+            size += std::filesystem::file_size(splitPath);
         }
 
-        auto sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
-        if (!sampler) {
-            throw std::runtime_error("Failed to initialize sampler");
+        auto mapClass = env->GetObjectClass(metadata);
+        auto putMethod = env->GetMethodID(mapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+
+        for (int32_t i = 0; i < llama_model_meta_count(llamaModel.get()); ++i) {
+            std::string key(llama_model_meta_key_by_index(llamaModel.get(), i, nullptr, 0) + 1, '\0');
+            llama_model_meta_key_by_index(llamaModel.get(), i, key.data(), key.size());
+            key.pop_back();
+
+            std::string value(llama_model_meta_val_str_by_index(llamaModel.get(), i, nullptr, 0) + 1, '\0');
+            llama_model_meta_val_str_by_index(llamaModel.get(), i, value.data(), value.size());
+            value.pop_back();
+
+            auto keyString = env->NewStringUTF(key.c_str());
+            auto valueString = env->NewStringUTF(value.c_str());
+
+            env->DeleteLocalRef(env->CallObjectMethod(metadata, putMethod, keyString, valueString));
+
+            env->DeleteLocalRef(keyString);
+            env->DeleteLocalRef(valueString);
+
+            if (env->ExceptionCheck()) {
+                return nullptr;
+            }
         }
 
-        auto tmpl = llama_model_chat_template(model.get(), nullptr);
+        auto nHead = llama_model_n_head(llamaModel.get());
 
-        std::vector<char> formatted(llama_n_ctx(context));
+        auto nHeadKv = getMetadata(llamaModel.get(),
+                                   getMetadata(llamaModel.get(), "general.architecture") + ".attention.head_count_kv");
 
-        int new_len = llama_chat_apply_template(tmpl, chatMessages.data(), chatMessages.size(), true,
-                                                formatted.data(), static_cast<int32_t>(formatted.size()));
+        jlong info[] = {
+                llama_model_n_ctx_train(llamaModel.get()),
+                llama_model_n_embd(llamaModel.get()),
+                llama_model_n_layer(llamaModel.get()),
+                nHead,
+                nHeadKv.empty() ? nHead : std::strtoll(nHeadKv.c_str(), nullptr, 10),
+                static_cast<jlong>(nParams),
+                static_cast<jlong>(size)
+        };
 
-        if (new_len > static_cast<int>(formatted.size())) {
-            formatted.resize(new_len);
-            new_len = llama_chat_apply_template(tmpl, chatMessages.data(), chatMessages.size(), true, formatted.data(),
-                                                static_cast<int32_t>(formatted.size()));
+        auto result = env->NewLongArray(7);
+        env->SetLongArrayRegion(result, 0, 7, info);
+
+        return result;
+    } catch (const std::exception &e) {
+        if (!env->ExceptionCheck()) {
+            handleException(env, e.what());
         }
+    }
 
-        std::string formattedPrompt(formatted.begin(), formatted.begin() + new_len);
+    return nullptr;
+}
 
-        try {
-            llama_sampler_chain_add(
-                    sampler,
-                    llama_sampler_init_top_k(topK)
-            );
-
-            llama_sampler_chain_add(
-                    sampler,
-                    llama_sampler_init_top_p(topP, true)
-            );
-
-            llama_sampler_chain_add(
-                    sampler,
-                    seed > 0 ? llama_sampler_init_dist(seed) : llama_sampler_init_greedy()
-            );
-
-            llama_sampler_chain_add(
-                    sampler,
-                    llama_sampler_init_temp(temperature)
-            );
-
-            llama_sampler_chain_add(
-                    sampler,
-                    llama_sampler_init_penalties(
-                            0,
-                            repetitionPenalty,
-                            0,
-                            0
-                    )
-            );
-
-            auto result = generate(vocab, context, sampler, formattedPrompt);
-            if (result.empty()) {
-                throw std::runtime_error("Unable to generate response");
-            }
-
-            return env->NewStringUTF(result.c_str());
-        } catch (...) {
-            llama_sampler_free(sampler);
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_openConversationNative(JNIEnv *env,
+                                                                                           jclass thisClass,
+                                                                                           jlong handle) {
+    try {
+        auto conversation = std::make_unique<Instance>();
+
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+
+            auto instance = getPointer(handle);
+
+            {
+                std::lock_guard<std::mutex> usage(instance->usage);
+
+                conversation->model = instance->model;
+                conversation->contextParams = instance->contextParams;
+                conversation->loadReport = instance->loadReport;
+                conversation->pool = instance->pool;
+
+                if (instance->placement) {
+                    conversation->placement = createPlacement(instance->placement->node,
+                                                              conversation->contextParams);
+                }
+            }
+
+            if (!conversation->pool->sizeClasses.empty()) {
+                conversation->contextParams.n_ctx = conversation->pool->sizeClasses.front();
+            }
+
+            std::lock_guard<std::mutex> swapLock(swapMutex);
 
-            throw;
+            enforceResidentCells(nullptr, 0);
+
+            conversation->context = acquireContext(conversation.get());
+            conversation->lastUsed = ++useClock;
         }
+
+        auto conversationHandle = reinterpret_cast<jlong>(conversation.get());
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+
+        pointers[conversationHandle] = std::move(conversation);
+
+        return conversationHandle;
     } catch (const std::exception &e) {
         handleException(env, e.what());
     }
 
-    return nullptr;
+    return -1;
 }
 
 JNIEXPORT void JNICALL
 Java_com_github_numq_textgeneration_llama_NativeLlamaTextGeneration_freeNative(JNIEnv *env, jclass thisClass,
                                                                                jlong handle) {
-    std::shared_lock<std::shared_mutex> lock(mutex);
+    std::unique_lock<std::shared_mutex> lock(mutex);
 
     try {
-        if (pointers.erase(handle) == 0) {
+        auto it = pointers.find(handle);
+        if (it == pointers.end()) {
             handleException(env, "Unable to free native pointer");
+            return;
         }
+
+        releaseContext(it->second.get());
+
+        pointers.erase(it);
+
+        std::lock_guard<std::mutex> stagedLock(stagedMutex);
+
+        std::erase_if(stagedModels, [handle](const auto &entry) {
+            return entry.second->owner == handle;
+        });
     } catch (const std::exception &e) {
         handleException(env, e.what());
     }
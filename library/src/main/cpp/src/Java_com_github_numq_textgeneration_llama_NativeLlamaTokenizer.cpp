@@ -0,0 +1,183 @@
+#include "Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer.h"
+
+static std::shared_mutex mutex;
+static std::unordered_map<jlong, llama_model_ptr> pointers;
+
+static const llama_vocab *getVocab(jlong handle) {
+    auto it = pointers.find(handle);
+    if (it == pointers.end()) {
+        throw std::runtime_error("Invalid handle");
+    }
+
+    auto vocab = llama_model_get_vocab(it->second.get());
+    if (!vocab) {
+        throw std::runtime_error("Failed to get model vocab");
+    }
+
+    return vocab;
+}
+
+static std::vector<std::string> getStrings(JNIEnv *env, jobjectArray strings) {
+    std::vector<std::string> result(env->GetArrayLength(strings));
+
+    for (size_t i = 0; i < result.size(); ++i) {
+        auto string = reinterpret_cast<jstring>(env->GetObjectArrayElement(strings, static_cast<jsize>(i)));
+        result[i] = jstringToString(env, string);
+        env->DeleteLocalRef(string);
+    }
+
+    return result;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_initNative(JNIEnv *env, jclass thisClass,
+                                                                          jstring modelPath) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto modelPathStr = jstringToString(env, modelPath);
+        if (modelPathStr.empty()) {
+            throw std::runtime_error("Model path should not be empty");
+        }
+
+        auto modelParams = llama_model_default_params();
+        modelParams.vocab_only = true;
+
+        auto paths = discoverSplits(modelPathStr);
+
+        std::vector<const char *> splitPaths;
+
+        for (const auto &splitPath: paths) {
+            splitPaths.push_back(splitPath.c_str());
+        }
+
+        llama_model_ptr vocabModel(
+                splitPaths.size() > 1 ? llama_model_load_from_splits(splitPaths.data(), splitPaths.size(), modelParams)
+                                      : llama_model_load_from_file(modelPathStr.c_str(), modelParams)
+        );
+        if (!vocabModel) {
+            throw std::runtime_error("Failed to load model vocab");
+        }
+
+        auto handle = reinterpret_cast<jlong>(vocabModel.get());
+
+        pointers[handle] = std::move(vocabModel);
+
+        return handle;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+        return -1;
+    }
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_tokenizeNative(JNIEnv *env, jclass thisClass,
+                                                                              jlong handle, jobjectArray texts,
+                                                                              jboolean addSpecial,
+                                                                              jintArray offsets) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto vocab = getVocab(handle);
+
+        auto textStrings = getStrings(env, texts);
+
+        if (env->GetArrayLength(offsets) != static_cast<jsize>(textStrings.size() + 1)) {
+            throw std::runtime_error("Offsets array should have one element more than texts");
+        }
+
+        std::vector<std::vector<llama_token>> textTokens(textStrings.size());
+
+        parallelFor(textStrings.size(), [&](size_t i) {
+            textTokens[i] = tokenize(vocab, textStrings[i], addSpecial);
+        });
+
+        std::vector<jint> offsetValues(textStrings.size() + 1, 0);
+        for (size_t i = 0; i < textTokens.size(); ++i) {
+            offsetValues[i + 1] = offsetValues[i] + static_cast<jint>(textTokens[i].size());
+        }
+
+        auto result = env->NewIntArray(offsetValues.back());
+        for (size_t i = 0; i < textTokens.size(); ++i) {
+            env->SetIntArrayRegion(result, offsetValues[i], static_cast<jsize>(textTokens[i].size()),
+                                   textTokens[i].data());
+        }
+
+        env->SetIntArrayRegion(offsets, 0, static_cast<jsize>(offsetValues.size()), offsetValues.data());
+
+        return result;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return nullptr;
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_countTokensNative(JNIEnv *env, jclass thisClass,
+                                                                                 jlong handle, jobjectArray texts,
+                                                                                 jboolean addSpecial) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto vocab = getVocab(handle);
+
+        auto textStrings = getStrings(env, texts);
+
+        std::vector<jint> counts(textStrings.size());
+
+        parallelFor(textStrings.size(), [&](size_t i) {
+            counts[i] = countTokens(vocab, textStrings[i], addSpecial);
+        });
+
+        auto result = env->NewIntArray(static_cast<jsize>(counts.size()));
+        env->SetIntArrayRegion(result, 0, static_cast<jsize>(counts.size()), counts.data());
+
+        return result;
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return nullptr;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_detokenizeNative(JNIEnv *env, jclass thisClass,
+                                                                                jlong handle, jintArray tokens,
+                                                                                jboolean removeSpecial) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        auto vocab = getVocab(handle);
+
+        std::vector<llama_token> tokenValues(env->GetArrayLength(tokens));
+        env->GetIntArrayRegion(tokens, 0, static_cast<jsize>(tokenValues.size()), tokenValues.data());
+
+        auto nVocab = llama_vocab_n_tokens(vocab);
+        for (auto token: tokenValues) {
+            if (token < 0 || token >= nVocab) {
+                throw std::runtime_error("Invalid token " + std::to_string(token));
+            }
+        }
+
+        return env->NewStringUTF(detokenize(vocab, tokenValues, removeSpecial).c_str());
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+
+    return nullptr;
+}
+
+JNIEXPORT void JNICALL
+Java_com_github_numq_textgeneration_llama_NativeLlamaTokenizer_freeNative(JNIEnv *env, jclass thisClass,
+                                                                          jlong handle) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+
+    try {
+        if (pointers.erase(handle) == 0) {
+            handleException(env, "Unable to free native pointer");
+        }
+    } catch (const std::exception &e) {
+        handleException(env, e.what());
+    }
+}
@@ -0,0 +1,154 @@
+#include "common.h"
+
+jclass exceptionClass = nullptr;
+
+void handleException(JNIEnv *env, const std::string &errorMessage) {
+    env->ThrowNew(exceptionClass, errorMessage.c_str());
+}
+
+std::string jstringToString(JNIEnv *env, jstring string) {
+    auto chars = env->GetStringUTFChars(string, nullptr);
+    if (!chars) {
+        throw std::runtime_error("Failed to get string");
+    }
+
+    std::string result(chars);
+    env->ReleaseStringUTFChars(string, chars);
+
+    return result;
+}
+
+std::string getMetadata(const llama_model *model, const std::string &key) {
+    auto length = llama_model_meta_val_str(model, key.c_str(), nullptr, 0);
+    if (length < 0) {
+        return {};
+    }
+
+    std::string value(length + 1, '\0');
+    llama_model_meta_val_str(model, key.c_str(), value.data(), value.size());
+    value.resize(length);
+
+    return value;
+}
+
+std::vector<llama_token> tokenize(const llama_vocab *vocab, const std::string &text, bool addSpecial) {
+    auto nTokens = -llama_tokenize(vocab, text.c_str(), static_cast<int>(text.size()), nullptr, 0, addSpecial, true);
+
+    std::vector<llama_token> tokens(nTokens);
+    if (llama_tokenize(
+            vocab,
+            text.c_str(),
+            static_cast<int>(text.size()),
+            tokens.data(),
+            static_cast<int>(tokens.size()),
+            addSpecial,
+            true
+    ) < 0) {
+        throw std::runtime_error("Failed to tokenize the prompt");
+    }
+
+    return tokens;
+}
+
+int32_t countTokens(const llama_vocab *vocab, const std::string &text, bool addSpecial) {
+    return -llama_tokenize(vocab, text.c_str(), static_cast<int>(text.size()), nullptr, 0, addSpecial, true);
+}
+
+std::string tokenToPiece(const llama_vocab *vocab, llama_token token) {
+    char buf[256];
+    auto n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+    if (n < 0) {
+        throw std::runtime_error("Failed to convert token to piece");
+    }
+    return {buf, static_cast<size_t>(n)};
+}
+
+void parallelFor(size_t count, const std::function<void(size_t)> &task) {
+    auto nThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    std::vector<std::thread> workers;
+    workers.reserve(nThreads);
+
+    for (size_t t = 0; t < nThreads; ++t) {
+        workers.emplace_back([&] {
+            for (auto i = next++; i < count; i = next++) {
+                try {
+                    task(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> errorLock(errorMutex);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        });
+    }
+
+    for (auto &worker: workers) {
+        worker.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+std::string detokenize(const llama_vocab *vocab, const std::vector<llama_token> &tokens, bool removeSpecial) {
+    std::string text(tokens.size() * 4, '\0');
+
+    auto n = llama_detokenize(vocab, tokens.data(), static_cast<int32_t>(tokens.size()), text.data(),
+                              static_cast<int32_t>(text.size()), removeSpecial, true);
+
+    if (n < 0) {
+        text.resize(-n);
+        n = llama_detokenize(vocab, tokens.data(), static_cast<int32_t>(tokens.size()), text.data(),
+                             static_cast<int32_t>(text.size()), removeSpecial, true);
+    }
+
+    if (n < 0) {
+        throw std::runtime_error("Failed to detokenize tokens");
+    }
+
+    text.resize(n);
+
+    return text;
+}
+
+/**
+ * Returns the paths of all splits of a model given the path of any of them, named like
+ * `<prefix>-00001-of-00004.gguf`, or only the given path if the model is not split.
+ */
+std::vector<std::string> discoverSplits(const std::string &path) {
+    int splitNo = 0, splitCount = 0;
+
+    auto suffix = path.size() > SPLIT_SUFFIX_LENGTH ? path.substr(path.size() - SPLIT_SUFFIX_LENGTH) : path;
+
+    if (std::sscanf(suffix.c_str(), "-%5d-of-%5d.gguf", &splitNo, &splitCount) != 2 || splitCount < 2) {
+        return {path};
+    }
+
+    std::vector<char> buffer(path.size() + 1);
+
+    // Split numbers start at 1 in file names, while llama_split_prefix and llama_split_path take a 0-based index.
+    if (llama_split_prefix(buffer.data(), buffer.size(), path.c_str(), splitNo - 1, splitCount) == 0) {
+        return {path};
+    }
+
+    std::string prefix(buffer.data());
+
+    std::vector<std::string> paths;
+
+    for (int i = 0; i < splitCount; ++i) {
+        llama_split_path(buffer.data(), buffer.size(), prefix.c_str(), i, splitCount);
+
+        if (!std::filesystem::is_regular_file(buffer.data())) {
+            throw std::runtime_error("Missing model split " + std::string(buffer.data()));
+        }
+
+        paths.emplace_back(buffer.data());
+    }
+
+    return paths;
+}
@@ -1,15 +1,19 @@
 package com.github.numq.textgeneration
 
-import com.github.numq.textgeneration.llama.LlamaExchange
-import com.github.numq.textgeneration.llama.LlamaMessage
-import com.github.numq.textgeneration.llama.LlamaTextGeneration
-import com.github.numq.textgeneration.llama.NativeLlamaTextGeneration
+import com.github.numq.textgeneration.llama.*
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.Job
+import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.withContext
+import java.nio.ByteBuffer
 
 interface TextGeneration : AutoCloseable {
     interface Llama : TextGeneration {
         companion object {
             private const val DEFAULT_CONTEXT_SIZE = 2048
-            private const val DEFAULT_BATCH_SIZE = 4096
+            private const val DEFAULT_BATCH_SIZE = 2048
+            private const val DEFAULT_PARALLELISM = 8
+            private const val DEFAULT_BENCHMARK_DECODE_TOKENS = 128
 
             private sealed interface LoadState {
                 data object Unloaded : LoadState
@@ -22,10 +26,12 @@ interface TextGeneration : AutoCloseable {
             @Volatile
             private var loadState: LoadState = LoadState.Unloaded
 
+            internal val isLoaded get() = loadState !is LoadState.Unloaded
+
             /**
-             * Loads the CPU-based native libraries required for Whisper speech recognition.
+             * Loads the CPU-based native libraries required for Llama text generation.
              *
-             * This method must be called before creating a Whisper instance.
+             * This method must be called before creating a Llama instance.
              *
              * @param ggmlBase The path to the `ggml-base` binary.
              * @param ggmlCpu The path to the `ggml-cpu` binary.
@@ -33,6 +39,8 @@ interface TextGeneration : AutoCloseable {
              * @param ggml The path to the `ggml` binary.
              * @param llama The path to the `llama` binary.
              * @param textGeneration The path to the `text-generation` binary.
+             * @param numaStrategy the strategy used to place threads and memory on a NUMA machine, or `null` to leave
+             * placement to the operating system.
              * @return A [Result] indicating the success or failure of the operation.
              */
             fun loadCPU(
@@ -42,6 +50,7 @@ interface TextGeneration : AutoCloseable {
                 ggml: String,
                 llama: String,
                 textGeneration: String,
+                numaStrategy: LlamaNumaStrategy? = null,
             ) = runCatching {
                 check(loadState is LoadState.Unloaded) { "Native binaries have already been loaded as ${loadState::class.simpleName}" }
 
@@ -52,13 +61,67 @@ interface TextGeneration : AutoCloseable {
                 System.load(llama)
                 System.load(textGeneration)
 
+                numaStrategy?.let(NativeLlamaTextGeneration::initNuma)
+
                 loadState = LoadState.CPU
             }
 
             /**
-             * Loads the CUDA-based native libraries required for Whisper speech recognition.
+             * Loads the CPU-based native libraries like [loadCPU], choosing the `ggml-cpu` and `text-generation`
+             * binaries of the best variant this CPU supports.
              *
-             * This method must be called before creating a Whisper instance.
+             * The CPU is probed with the `cpu-features` binary, which does not depend on the other binaries. The
+             * reported variant is then read from the instruction sets the loaded `ggml-cpu` binary was compiled with.
+             *
+             * @param ggmlBase The path to the `ggml-base` binary.
+             * @param ggmlRpc The path to the `ggml-rpc` binary.
+             * @param ggml The path to the `ggml` binary.
+             * @param llama The path to the `llama` binary.
+             * @param cpuFeatures The path to the `cpu-features` binary.
+             * @param variants the binaries of each available variant, which should include
+             * [LlamaCpuVariant.BASELINE] to run on any CPU.
+             * @param numaStrategy the strategy used to place threads and memory on a NUMA machine, or `null` to leave
+             * placement to the operating system.
+             * @return A [Result] containing the variant of the loaded binaries.
+             */
+            fun loadCPU(
+                ggmlBase: String,
+                ggmlRpc: String,
+                ggml: String,
+                llama: String,
+                cpuFeatures: String,
+                variants: Map<LlamaCpuVariant, LlamaCpuBinaries>,
+                numaStrategy: LlamaNumaStrategy? = null,
+            ) = runCatching {
+                check(loadState is LoadState.Unloaded) { "Native binaries have already been loaded as ${loadState::class.simpleName}" }
+
+                System.load(cpuFeatures)
+
+                val supportedVariant = NativeCpuFeatures.detectVariant()
+
+                val binaries = variants.filterKeys { variant -> variant <= supportedVariant }.maxByOrNull { (variant, _) ->
+                    variant
+                }?.value
+
+                checkNotNull(binaries) { "None of the variants is supported by this CPU, which supports $supportedVariant" }
+
+                loadCPU(
+                    ggmlBase = ggmlBase,
+                    ggmlCpu = binaries.ggmlCpu,
+                    ggmlRpc = ggmlRpc,
+                    ggml = ggml,
+                    llama = llama,
+                    textGeneration = binaries.textGeneration,
+                    numaStrategy = numaStrategy
+                ).getOrThrow()
+
+                NativeLlamaTextGeneration.getCpuVariant()
+            }
+
+            /**
+             * Loads the CUDA-based native libraries required for Llama text generation.
+             *
+             * This method must be called before creating a Llama instance.
              *
              * @param ggmlBase The path to the `ggml-base` binary.
              * @param ggmlCpu The path to the `ggml-cpu` binary.
@@ -92,14 +155,181 @@ interface TextGeneration : AutoCloseable {
             }
 
             /**
-             * Creates a new instance of [TextGeneration] using the Whisper implementation.
+             * Sets the policy used to swap out idle instances when their contexts take too much memory.
+             *
+             * The policy applies to all instances and is enforced immediately.
+             *
+             * @param policy the swap policy, or `null` to keep every context resident.
+             * @return A [Result] indicating the success or failure of the operation.
+             */
+            fun setSwapPolicy(policy: LlamaSwapPolicy?) = runCatching {
+                check(loadState !is LoadState.Unloaded) { "Native binaries were not loaded" }
+
+                NativeLlamaTextGeneration.setSwapPolicy(policy = policy)
+            }
+
+            /**
+             * Quantizes a model to a smaller data type and writes it to a new file.
+             *
+             * Quantization runs on the IO dispatcher and cannot be cancelled once started. An already quantized model can
+             * be quantized again, at a greater cost in accuracy than quantizing it from a 16-bit model.
+             *
+             * @param inputPath the path to the model to quantize.
+             * @param outputPath the path to write the quantized model to.
+             * @param type the data type to quantize to.
+             * @param onProgress the callback invoked with the quantization progress, from `0` to `1`, estimated from the
+             * share of the expected output size written so far.
+             * @return A [Result] indicating the success or failure of the operation.
+             * @see benchmark
+             */
+            suspend fun quantize(
+                inputPath: String,
+                outputPath: String,
+                type: LlamaQuantizationType,
+                onProgress: (Float) -> Unit = {},
+            ) = withContext(Dispatchers.IO) {
+                runCatching {
+                    check(loadState !is LoadState.Unloaded) { "Native binaries were not loaded" }
+
+                    NativeLlamaTextGeneration.quantize(
+                        inputPath = inputPath,
+                        outputPath = outputPath,
+                        type = type,
+                        callback = NativeLlamaLoadCallback { progress ->
+                            onProgress(progress)
+
+                            true
+                        }
+                    )
+                }
+            }
+
+            /**
+             * Benchmarks a model on this machine, to compare quantizations of the same model.
+             *
+             * @param modelPath the path to the model to benchmark.
+             * @param text the text to measure the prefill throughput and the perplexity on.
+             * @param contextSize the size of the context, and of the windows the text is evaluated in.
+             * @param batchSize the maximum number of tokens decoded at once.
+             * @param decodeTokens the number of tokens to generate to measure the decode throughput.
+             * @return A [Result] containing the [LlamaBenchmark] of the model.
+             */
+            suspend fun benchmark(
+                modelPath: String,
+                text: String,
+                contextSize: Int = DEFAULT_CONTEXT_SIZE,
+                batchSize: Int = DEFAULT_BATCH_SIZE,
+                decodeTokens: Int = DEFAULT_BENCHMARK_DECODE_TOKENS,
+            ) = withContext(Dispatchers.IO) {
+                runCatching {
+                    check(loadState !is LoadState.Unloaded) { "Native binaries were not loaded" }
+
+                    require(contextSize > 1) { "Context size should be greater than one" }
+
+                    require(batchSize > 0) { "Batch size should be positive" }
+
+                    require(decodeTokens > 0) { "Decode tokens should be positive" }
+
+                    NativeLlamaTextGeneration.benchmark(
+                        modelPath = modelPath,
+                        text = text,
+                        contextSize = contextSize,
+                        batchSize = batchSize,
+                        decodeTokens = decodeTokens
+                    )
+                }
+            }
+
+            private fun createLlama(
+                modelPath: String,
+                systemPrompt: String,
+                contextSize: Int,
+                batchSize: Int,
+                microBatchSize: Int?,
+                cacheTypeK: LlamaCacheType,
+                cacheTypeV: LlamaCacheType,
+                flashAttention: Boolean,
+                threads: Int?,
+                batchThreads: Int?,
+                contextPoolSize: Int,
+                contextSizeClasses: List<Int>,
+                numaNode: Int?,
+                calibrate: Boolean,
+                truncationPolicy: LlamaTruncationPolicy?,
+                modelParameters: LlamaModelParameters,
+                callback: NativeLlamaLoadCallback?,
+            ): Llama {
+                check(loadState !is LoadState.Unloaded) { "Native binaries were not loaded" }
+
+                require(microBatchSize == null || microBatchSize in 1..batchSize) {
+                    "Micro batch size should be positive and not exceed batch size"
+                }
+
+                require(cacheTypeV == LlamaCacheType.F16 || flashAttention) {
+                    "Quantized V cache requires flash attention"
+                }
+
+                require((threads ?: 1) > 0 && (batchThreads ?: 1) > 0) { "Thread counts should be positive" }
+
+                require(contextPoolSize >= 0) { "Context pool size should not be negative" }
+
+                require(contextSizeClasses.all { sizeClass -> sizeClass in 1..contextSize }) {
+                    "Context size classes should be positive and not exceed the context size"
+                }
+
+                require((numaNode ?: 0) >= 0) { "NUMA node should not be negative" }
+
+                return LlamaTextGeneration(
+                    nativeLlamaTextGeneration = NativeLlamaTextGeneration(
+                        modelPath = modelPath,
+                        contextSize = contextSize,
+                        batchSize = batchSize,
+                        microBatchSize = microBatchSize,
+                        cacheTypeK = cacheTypeK,
+                        cacheTypeV = cacheTypeV,
+                        flashAttention = flashAttention,
+                        threads = threads,
+                        batchThreads = batchThreads,
+                        contextPoolSize = contextPoolSize,
+                        contextSizeClasses = contextSizeClasses,
+                        numaNode = numaNode,
+                        calibrate = calibrate,
+                        modelParameters = modelParameters,
+                        callback = callback
+                    ),
+                    systemPrompt = systemPrompt,
+                    truncationPolicy = truncationPolicy
+                )
+            }
+
+            /**
+             * Creates a new instance of [TextGeneration] using the Llama implementation.
              *
-             * This method initializes the Llama text generation with the specified model.
+             * This method loads the model and creates its context on the calling thread.
              *
-             * @param modelPath the path to the Llama model file.
+             * @param modelPath the path to the Llama model file, or to any of its splits if the model is split.
              * @param systemPrompt the optional system prompt that will be used as the system message.
              * @param contextSize the size of the context window.
              * @param batchSize the batch size.
+             * @param microBatchSize the physical batch size, or `null` for the default.
+             * @param cacheTypeK the data type of the K cache, where a quantized type takes less memory per token at a
+             * small cost in accuracy.
+             * @param cacheTypeV the data type of the V cache, which can only be quantized with flash attention.
+             * @param flashAttention whether flash attention is used.
+             * @param threads the number of threads used to generate tokens one at a time, or `null` for the default.
+             * @param batchThreads the number of threads used to decode prompts and batches, or `null` for the default.
+             * @param contextPoolSize the number of contexts of each size class created and warmed up ahead for
+             * [Llama.openConversation].
+             * @param contextSizeClasses the context sizes, smaller than [contextSize], that conversations start with and
+             * grow through as their prompts get longer, so that short conversations take less memory.
+             * @param numaNode the NUMA node the threads and buffers of the instance, and of the conversations opened on
+             * it, are pinned to, or `null` to leave placement to the [LlamaNumaStrategy] chosen at load time. Pinning
+             * is only supported on Linux.
+             * @param calibrate whether the batch sizes and the number of batch threads are chosen by timing prompt
+             * decoding on this machine, starting from the given values, which takes several seconds.
+             * @param truncationPolicy the policy used to drop the oldest turns when the conversation outgrows the
+             * context size, or `null` to fail instead.
+             * @param modelParameters the parameters used to load the model.
              * @return a [Result] containing the created instance if successful.
              * @throws IllegalStateException if the native libraries are not loaded or if there is an issue with the underlying native libraries.
              */
@@ -108,17 +338,186 @@ interface TextGeneration : AutoCloseable {
                 systemPrompt: String = "",
                 contextSize: Int = DEFAULT_CONTEXT_SIZE,
                 batchSize: Int = DEFAULT_BATCH_SIZE,
+                microBatchSize: Int? = null,
+                cacheTypeK: LlamaCacheType = LlamaCacheType.F16,
+                cacheTypeV: LlamaCacheType = LlamaCacheType.F16,
+                flashAttention: Boolean = false,
+                threads: Int? = null,
+                batchThreads: Int? = null,
+                contextPoolSize: Int = 0,
+                contextSizeClasses: List<Int> = emptyList(),
+                numaNode: Int? = null,
+                calibrate: Boolean = false,
+                truncationPolicy: LlamaTruncationPolicy? = LlamaTruncationPolicy(),
+                modelParameters: LlamaModelParameters = LlamaModelParameters(),
             ): Result<Llama> = runCatching {
+                createLlama(
+                    modelPath = modelPath,
+                    systemPrompt = systemPrompt,
+                    contextSize = contextSize,
+                    batchSize = batchSize,
+                    microBatchSize = microBatchSize,
+                    cacheTypeK = cacheTypeK,
+                    cacheTypeV = cacheTypeV,
+                    flashAttention = flashAttention,
+                    threads = threads,
+                    batchThreads = batchThreads,
+                    contextPoolSize = contextPoolSize,
+                    contextSizeClasses = contextSizeClasses,
+                    numaNode = numaNode,
+                    calibrate = calibrate,
+                    truncationPolicy = truncationPolicy,
+                    modelParameters = modelParameters,
+                    callback = null
+                )
+            }
+
+            /**
+             * Reads the metadata of a model without loading its weights.
+             *
+             * @param modelPath the path to the Llama model file, or to any of its splits if the model is split.
+             * @return a [Result] containing the [LlamaModelInfo] of the model.
+             */
+            fun probe(modelPath: String) = runCatching {
                 check(loadState !is LoadState.Unloaded) { "Native binaries were not loaded" }
 
-                LlamaTextGeneration(
-                    nativeLlamaTextGeneration = NativeLlamaTextGeneration(
+                NativeLlamaTextGeneration.probe(modelPath = modelPath)
+            }
+
+            /**
+             * Creates a new instance of [TextGeneration] like [create], with the context size, the KV cache type and
+             * the thread counts derived from the model and a memory budget.
+             *
+             * The model is probed first, and flash attention is enabled when the derived cache type is quantized.
+             *
+             * @param modelPath the path to the Llama model file, or to any of its splits if the model is split.
+             * @param memoryBudget the memory the instance may take, including the model weights, in bytes.
+             * @param systemPrompt the optional system prompt that will be used as the system message.
+             * @param batchSize the batch size, capped at the derived context size.
+             * @param contextPoolSize the number of contexts of each size class created and warmed up ahead for
+             * [Llama.openConversation].
+             * @param contextSizeClasses the context sizes that conversations start with and grow through, where those
+             * not smaller than the derived context size are ignored.
+             * @param numaNode the NUMA node the threads and buffers of the instance are pinned to, or `null` to leave
+             * placement to the [LlamaNumaStrategy] chosen at load time.
+             * @param truncationPolicy the policy used to drop the oldest turns when the conversation outgrows the
+             * context size, or `null` to fail instead.
+             * @param modelParameters the parameters used to load the model.
+             * @return a [Result] containing the created instance if successful.
+             * @see LlamaModelInfo.autoConfiguration
+             */
+            fun createAuto(
+                modelPath: String,
+                memoryBudget: Long,
+                systemPrompt: String = "",
+                batchSize: Int = DEFAULT_BATCH_SIZE,
+                contextPoolSize: Int = 0,
+                contextSizeClasses: List<Int> = emptyList(),
+                numaNode: Int? = null,
+                truncationPolicy: LlamaTruncationPolicy? = LlamaTruncationPolicy(),
+                modelParameters: LlamaModelParameters = LlamaModelParameters(),
+            ): Result<Llama> = probe(modelPath = modelPath).mapCatching { info ->
+                val configuration = info.autoConfiguration(memoryBudget = memoryBudget)
+
+                createLlama(
+                    modelPath = modelPath,
+                    systemPrompt = systemPrompt,
+                    contextSize = configuration.contextSize,
+                    batchSize = minOf(batchSize, configuration.contextSize),
+                    microBatchSize = null,
+                    cacheTypeK = configuration.cacheType,
+                    cacheTypeV = configuration.cacheType,
+                    flashAttention = configuration.flashAttention,
+                    threads = configuration.threads,
+                    batchThreads = configuration.batchThreads,
+                    contextPoolSize = contextPoolSize,
+                    contextSizeClasses = contextSizeClasses.filter { sizeClass ->
+                        sizeClass < configuration.contextSize
+                    },
+                    numaNode = numaNode,
+                    calibrate = false,
+                    truncationPolicy = truncationPolicy,
+                    modelParameters = modelParameters,
+                    callback = null
+                )
+            }
+
+            /**
+             * Creates a new instance of [TextGeneration] like [create], loading the model on the IO dispatcher.
+             *
+             * Cancelling the coroutine aborts loading at the next progress report.
+             *
+             * @param modelPath the path to the Llama model file, or to any of its splits if the model is split.
+             * @param systemPrompt the optional system prompt that will be used as the system message.
+             * @param contextSize the size of the context window.
+             * @param batchSize the batch size.
+             * @param microBatchSize the physical batch size, or `null` for the default.
+             * @param cacheTypeK the data type of the K cache.
+             * @param cacheTypeV the data type of the V cache, which can only be quantized with flash attention.
+             * @param flashAttention whether flash attention is used.
+             * @param threads the number of threads used to generate tokens one at a time, or `null` for the default.
+             * @param batchThreads the number of threads used to decode prompts and batches, or `null` for the default.
+             * @param contextPoolSize the number of contexts of each size class created and warmed up ahead for
+             * [Llama.openConversation].
+             * @param contextSizeClasses the context sizes, smaller than [contextSize], that conversations start with and
+             * grow through as their prompts get longer.
+             * @param numaNode the NUMA node the threads and buffers of the instance are pinned to, or `null` to leave
+             * placement to the [LlamaNumaStrategy] chosen at load time.
+             * @param calibrate whether the batch sizes and the number of batch threads are chosen by timing prompt
+             * decoding on this machine.
+             * @param truncationPolicy the policy used to drop the oldest turns when the conversation outgrows the
+             * context size, or `null` to fail instead.
+             * @param modelParameters the parameters used to load the model.
+             * @param onProgress the callback invoked with the loading progress, from `0` to `1`.
+             * @return a [Result] containing the created instance if successful.
+             * @see create
+             */
+            suspend fun load(
+                modelPath: String,
+                systemPrompt: String = "",
+                contextSize: Int = DEFAULT_CONTEXT_SIZE,
+                batchSize: Int = DEFAULT_BATCH_SIZE,
+                microBatchSize: Int? = null,
+                cacheTypeK: LlamaCacheType = LlamaCacheType.F16,
+                cacheTypeV: LlamaCacheType = LlamaCacheType.F16,
+                flashAttention: Boolean = false,
+                threads: Int? = null,
+                batchThreads: Int? = null,
+                contextPoolSize: Int = 0,
+                contextSizeClasses: List<Int> = emptyList(),
+                numaNode: Int? = null,
+                calibrate: Boolean = false,
+                truncationPolicy: LlamaTruncationPolicy? = LlamaTruncationPolicy(),
+                modelParameters: LlamaModelParameters = LlamaModelParameters(),
+                onProgress: (Float) -> Unit = {},
+            ): Result<Llama> = withContext(Dispatchers.IO) {
+                val job = coroutineContext[Job]
+
+                runCatching {
+                    createLlama(
                         modelPath = modelPath,
+                        systemPrompt = systemPrompt,
                         contextSize = contextSize,
-                        batchSize = batchSize
-                    ),
-                    systemPrompt = systemPrompt
-                )
+                        batchSize = batchSize,
+                        microBatchSize = microBatchSize,
+                        cacheTypeK = cacheTypeK,
+                        cacheTypeV = cacheTypeV,
+                        flashAttention = flashAttention,
+                        threads = threads,
+                        batchThreads = batchThreads,
+                        contextPoolSize = contextPoolSize,
+                        contextSizeClasses = contextSizeClasses,
+                        numaNode = numaNode,
+                        calibrate = calibrate,
+                        truncationPolicy = truncationPolicy,
+                        modelParameters = modelParameters,
+                        callback = NativeLlamaLoadCallback { progress ->
+                            onProgress(progress)
+
+                            job?.isActive != false
+                        }
+                    )
+                }
             }
         }
 
@@ -132,20 +531,279 @@ interface TextGeneration : AutoCloseable {
         /**
          * Generates a response based on the provided prompt.
          *
+         * The history is kept in full, while the prompt sent to the model is truncated according to the truncation
+         * policy, and the cached part of the context is reused instead of being decoded again.
+         *
+         * The prompt is decoded in chunks of the batch size, and cancelling the coroutine stops between chunks while
+         * keeping the chunks decoded so far.
+         *
          * @param prompt The input text prompt to generate a response from.
+         * @param parameters The sampling parameters.
+         * @param onProgress The callback invoked with the [LlamaPrefillProgress] after each decoded chunk.
          * @return A [Result] containing a [LlamaExchange] object with the generated response.
          */
-        suspend fun generate(prompt: String): Result<LlamaExchange>
+        suspend fun generate(
+            prompt: String,
+            parameters: LlamaGenerationParameters = LlamaGenerationParameters(),
+            onProgress: (LlamaPrefillProgress) -> Unit = {},
+        ): Result<LlamaExchange>
+
+        /**
+         * Adds messages to the history and decodes them into the context without generating a response.
+         *
+         * Content known ahead of time, such as a document, is decoded before the question is asked, so that the
+         * following [generate] only decodes the question. The history is not truncated, so it must fit into the
+         * context as it is.
+         *
+         * @param messages The messages to add to the history.
+         * @param onProgress The callback invoked with the [LlamaPrefillProgress] after each decoded chunk.
+         * @return A [Result] indicating the success or failure of the operation.
+         */
+        suspend fun prefill(
+            messages: List<LlamaMessage>,
+            onProgress: (LlamaPrefillProgress) -> Unit = {},
+        ): Result<Unit>
+
+        /**
+         * Speculatively decodes a partially typed prompt into the context without adding it to the history.
+         *
+         * If the prompt eventually passed to [generate] extends the partial prompt, the decoded part is reused, and
+         * otherwise it is discarded.
+         *
+         * @param partialPrompt The beginning of the next prompt.
+         * @param onProgress The callback invoked with the [LlamaPrefillProgress] after each decoded chunk.
+         * @return A [Result] indicating the success or failure of the operation.
+         */
+        suspend fun prefill(
+            partialPrompt: String,
+            onProgress: (LlamaPrefillProgress) -> Unit = {},
+        ): Result<Unit>
+
+        /**
+         * Generates a new response to the last prompt, replacing the previous response in the history.
+         *
+         * The prompt is not decoded again, since the context is cut back to the point where the previous response
+         * began.
+         *
+         * @param parameters The sampling parameters.
+         * @return A [Result] containing a [LlamaExchange] object with the regenerated response.
+         */
+        suspend fun regenerate(
+            parameters: LlamaGenerationParameters = LlamaGenerationParameters(),
+        ): Result<LlamaExchange>
+
+        /**
+         * Replaces the last prompt and generates a response to it, dropping the previous prompt and its response from
+         * the history.
+         *
+         * Only the replacement prompt is decoded, since the context is cut back to the point where the last turn began.
+         *
+         * @param prompt The replacement text prompt.
+         * @param parameters The sampling parameters.
+         * @param onProgress The callback invoked with the [LlamaPrefillProgress] after each decoded chunk.
+         * @return A [Result] containing a [LlamaExchange] object with the generated response.
+         */
+        suspend fun editLast(
+            prompt: String,
+            parameters: LlamaGenerationParameters = LlamaGenerationParameters(),
+            onProgress: (LlamaPrefillProgress) -> Unit = {},
+        ): Result<LlamaExchange>
+
+        /**
+         * Generates a continuation of pre-tokenized input.
+         *
+         * The tokens are decoded as they are, without the chat template, the system prompt or the conversation
+         * history, which is left untouched. They are decoded on a single-sequence context of the context size of this
+         * instance, created on the first call and kept with the instance, where it counts towards the
+         * [LlamaSwapPolicy].
+         *
+         * @param tokens The input token ids, for example produced by [Tokenizer.Llama.tokenize].
+         * @param parameters The sampling parameters.
+         * @return A [Result] containing the generated text.
+         */
+        suspend fun complete(
+            tokens: IntArray,
+            parameters: LlamaGenerationParameters = LlamaGenerationParameters(),
+        ): Result<String>
+
+        /**
+         * Generates responses for independent prompts, decoding up to [parallelism] of them together.
+         *
+         * Each prompt is answered on its own, with the system prompt but without the conversation history, which is
+         * left untouched. A new prompt is admitted as soon as another one finishes, and results are emitted in order
+         * of completion rather than submission.
+         *
+         * The batch context reserves the context size of this instance for each of the [parallelism] sequences.
+         *
+         * @param prompts The input text prompts to generate responses from.
+         * @param parameters The sampling parameters applied to every prompt.
+         * @param parallelism The number of prompts decoded together.
+         * @return A [Flow] of [LlamaBatchResult] objects, one for each prompt.
+         */
+        fun generateBatch(
+            prompts: List<String>,
+            parameters: LlamaGenerationParameters = LlamaGenerationParameters(),
+            parallelism: Int = DEFAULT_PARALLELISM,
+        ): Flow<LlamaBatchResult>
+
+        /**
+         * Computes one embedding vector per text.
+         *
+         * Texts are packed as separate sequences into as few decodes as the batch size allows, using a dedicated
+         * embedding context that is created on first use and recreated when the pooling changes. Embeddings are always
+         * computed by the base model, without adapters or control vectors.
+         *
+         * @param texts The texts to embed, each of which must fit into the batch size.
+         * @param pooling The pooling applied to the token embeddings of each text.
+         * @param normalize Whether the vectors are scaled to unit length.
+         * @return A [Result] containing the [LlamaEmbeddings] of the texts, in order.
+         */
+        suspend fun embed(
+            texts: List<String>,
+            pooling: LlamaPooling = LlamaPooling.MEAN,
+            normalize: Boolean = true,
+        ): Result<LlamaEmbeddings>
+
+        /**
+         * Scores how likely each candidate is as the response to the prompt, without generating text.
+         *
+         * The prompt is decoded once with the system prompt but without the conversation history, then every
+         * candidate continues it on its own sequence, and the candidates are evaluated together in a single decode.
+         * Scores are always computed by the base model, without adapters or control vectors.
+         *
+         * @param prompt The input text prompt.
+         * @param candidates The candidate responses, such as classification labels.
+         * @return A [Result] containing a [LlamaCandidateScore] for each candidate, in order.
+         */
+        suspend fun score(prompt: String, candidates: List<String>): Result<List<LlamaCandidateScore>>
+
+        /**
+         * Returns the number of bytes needed to take a snapshot of the conversation in its current state.
+         *
+         * @return A [Result] containing the snapshot size in bytes.
+         */
+        suspend fun snapshotSize(): Result<Int>
+
+        /**
+         * Writes the conversation history together with its context state into the buffer, starting at its position.
+         *
+         * The context state is written by the native layer straight into the buffer, which must therefore be direct.
+         * A snapshot can only be restored by an instance of the same model on the same host.
+         *
+         * @param buffer The direct buffer with at least [snapshotSize] bytes remaining, whose position is advanced past
+         * the snapshot.
+         * @return A [Result] containing the number of bytes written.
+         */
+        suspend fun snapshot(buffer: ByteBuffer): Result<Int>
+
+        /**
+         * Replaces the conversation history and its context state with a snapshot read from the buffer, starting at
+         * its position.
+         *
+         * The conversation continues from the restored context state, without decoding the history again. A
+         * conversation opened with `contextSizeClasses` moves to the smallest size that holds the snapshot.
+         *
+         * @param buffer The direct buffer containing a snapshot, whose position is advanced past it.
+         * @return A [Result] indicating the success or failure of the operation.
+         */
+        suspend fun restore(buffer: ByteBuffer): Result<Unit>
+
+        /**
+         * Reports the context configuration in effect, including the values chosen by calibration.
+         *
+         * @return A [Result] containing the [LlamaConfiguration] of this instance.
+         */
+        suspend fun configuration(): Result<LlamaConfiguration>
+
+        /**
+         * Retrieves how the current model was loaded, including the number of split files and the load throughput.
+         *
+         * @return A [Result] containing the [LlamaLoadReport] of the current model.
+         */
+        suspend fun loadReport(): Result<LlamaLoadReport>
+
+        /**
+         * Reports the memory taken by the model weights, the KV cache and the compute buffers of this instance.
+         *
+         * @return A [Result] containing the [LlamaMemoryUsage] of this instance.
+         */
+        suspend fun memoryUsage(): Result<LlamaMemoryUsage>
+
+        /**
+         * Opens a new conversation on the model of this instance.
+         *
+         * The conversation shares the model and the configuration of this instance and starts with the given system
+         * prompt. Its context is taken from the pool created with `contextPoolSize`, or created if the pool is empty,
+         * and closing the conversation returns the context to the pool with its cache cleared.
+         *
+         * With `contextSizeClasses`, the conversation starts with a context of the smallest size and, when a prompt
+         * together with the tokens to generate no longer fits, moves with its cache to the smallest size that fits.
+         *
+         * @param systemPrompt the system prompt of the conversation.
+         * @return A [Result] containing the conversation, which should be closed when it ends.
+         */
+        suspend fun openConversation(systemPrompt: String = ""): Result<Llama>
+
+        /**
+         * Loads a LoRA adapter for the current model.
+         *
+         * The adapter is loaded once and can be applied to any request of this instance with
+         * [LlamaGenerationParameters.adapter], so that a single base model serves several fine-tunes.
+         *
+         * @param adapterPath the path to the adapter file.
+         * @return A [Result] containing the loaded [LlamaAdapter], which should be closed when it is no longer needed.
+         */
+        suspend fun loadAdapter(adapterPath: String): Result<LlamaAdapter>
+
+        /**
+         * Loads a control vector for the current model.
+         *
+         * The control vector is loaded once and can steer any request of this instance with
+         * [LlamaGenerationParameters.controlVector], without spending prompt tokens on instructions.
+         *
+         * @param controlVectorPath the path to the control vector file in GGUF format.
+         * @return A [Result] containing the loaded [LlamaControlVector], which should be closed when it is no longer
+         * needed.
+         */
+        suspend fun loadControlVector(controlVectorPath: String): Result<LlamaControlVector>
+
+        /**
+         * Replaces the model with the one at [modelPath] without closing this instance.
+         *
+         * The replacement is loaded and warmed up on the IO dispatcher while requests keep running on the current
+         * model. Requests in flight when it is ready finish on the current model, subsequent requests use the
+         * replacement, and the current model is freed once nothing uses it anymore. The conversation history is
+         * kept and prefilled again on the next request.
+         *
+         * Cancelling the coroutine aborts loading at the next progress report and keeps the current model.
+         *
+         * @param modelPath the path to the replacement model.
+         * @param modelParameters the parameters used to load the replacement model.
+         * @param onProgress the callback invoked with the loading progress, from `0` to `1`.
+         * @return A [Result] indicating the success or failure of the operation.
+         */
+        suspend fun swapModel(
+            modelPath: String,
+            modelParameters: LlamaModelParameters = LlamaModelParameters(),
+            onProgress: (Float) -> Unit = {},
+        ): Result<Unit>
 
         /**
          * Resets the conversation history and clears the current context.
          *
+         * The context is reused rather than recreated, and the cached system prompt is kept, so a new conversation
+         * starts without decoding it again.
+         *
          * @return A [Result] indicating the success or failure of the operation.
          */
         suspend fun reset(): Result<Unit>
 
-        override fun close() {
-            loadState = LoadState.Unloaded
-        }
+        /**
+         * Releases the native resources of this instance or conversation.
+         *
+         * The native binaries stay loaded, since they cannot be unloaded from the process, so new instances can be
+         * created afterwards.
+         */
+        override fun close()
     }
 }
\ No newline at end of file
@@ -0,0 +1,72 @@
+package com.github.numq.textgeneration
+
+import com.github.numq.textgeneration.llama.LlamaTokenBatch
+import com.github.numq.textgeneration.llama.LlamaTokenizer
+import com.github.numq.textgeneration.llama.NativeLlamaTokenizer
+
+interface Tokenizer : AutoCloseable {
+    interface Llama : Tokenizer {
+        companion object {
+            /**
+             * Creates a new instance of [Tokenizer] using the Llama implementation.
+             *
+             * Only the vocabulary of the model is loaded, without weights or context, so that prompts can be measured
+             * before deciding which model serves them.
+             *
+             * @param modelPath the path to the Llama model file, or to any of its splits if the model is split.
+             * @return a [Result] containing the created instance if successful.
+             * @throws IllegalStateException if the native libraries are not loaded or if there is an issue with the underlying native libraries.
+             */
+            fun create(modelPath: String): Result<Llama> = runCatching {
+                check(TextGeneration.Llama.isLoaded) { "Native binaries were not loaded" }
+
+                LlamaTokenizer(nativeLlamaTokenizer = NativeLlamaTokenizer(modelPath = modelPath))
+            }
+        }
+
+        /**
+         * Converts the text into token ids.
+         *
+         * @param text The text to tokenize.
+         * @param addSpecial Whether the special tokens of the model, such as BOS, are added.
+         * @return A [Result] containing the token ids.
+         */
+        suspend fun tokenize(text: String, addSpecial: Boolean = true): Result<IntArray>
+
+        /**
+         * Converts the texts into token ids, tokenizing them in parallel.
+         *
+         * @param texts The texts to tokenize.
+         * @param addSpecial Whether the special tokens of the model, such as BOS, are added.
+         * @return A [Result] containing the token ids of all texts in a single [LlamaTokenBatch].
+         */
+        suspend fun tokenize(texts: List<String>, addSpecial: Boolean = true): Result<LlamaTokenBatch>
+
+        /**
+         * Counts the tokens of the text without storing them.
+         *
+         * @param text The text to measure.
+         * @param addSpecial Whether the special tokens of the model, such as BOS, are counted.
+         * @return A [Result] containing the number of tokens.
+         */
+        suspend fun countTokens(text: String, addSpecial: Boolean = true): Result<Int>
+
+        /**
+         * Counts the tokens of the texts in parallel without storing them.
+         *
+         * @param texts The texts to measure.
+         * @param addSpecial Whether the special tokens of the model, such as BOS, are counted.
+         * @return A [Result] containing the number of tokens of each text, in order.
+         */
+        suspend fun countTokens(texts: List<String>, addSpecial: Boolean = true): Result<IntArray>
+
+        /**
+         * Converts token ids back into text.
+         *
+         * @param tokens The token ids.
+         * @param removeSpecial Whether the special tokens of the model, such as BOS, are removed.
+         * @return A [Result] containing the text.
+         */
+        suspend fun detokenize(tokens: IntArray, removeSpecial: Boolean = false): Result<String>
+    }
+}
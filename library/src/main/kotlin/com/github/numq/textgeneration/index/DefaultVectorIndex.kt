@@ -0,0 +1,35 @@
+package com.github.numq.textgeneration.index
+
+import java.nio.FloatBuffer
+
+internal class DefaultVectorIndex(private val nativeVectorIndex: NativeVectorIndex) : VectorIndex {
+    override val dimension get() = nativeVectorIndex.dimension
+
+    override suspend fun size() = runCatching { nativeVectorIndex.size }
+
+    override suspend fun train(vectors: FloatBuffer) = runCatching {
+        require(vectors.isDirect) { "Vector buffer should be direct" }
+
+        nativeVectorIndex.train(vectors = vectors)
+    }
+
+    override suspend fun add(ids: LongArray, vectors: FloatBuffer) = runCatching {
+        require(vectors.isDirect) { "Vector buffer should be direct" }
+
+        require(vectors.remaining() >= ids.size * dimension) { "Vector buffer is too small" }
+
+        nativeVectorIndex.add(ids = ids, vectors = vectors)
+    }
+
+    override suspend fun search(queries: FloatBuffer, limit: Int, probes: Int) = runCatching {
+        require(queries.isDirect) { "Query buffer should be direct" }
+
+        require(limit > 0) { "Limit should be positive" }
+
+        nativeVectorIndex.search(queries = queries, limit = limit, probes = probes)
+    }
+
+    override suspend fun save(path: String) = runCatching { nativeVectorIndex.save(path = path) }
+
+    override fun close() = runCatching { nativeVectorIndex.close() }.getOrDefault(Unit)
+}
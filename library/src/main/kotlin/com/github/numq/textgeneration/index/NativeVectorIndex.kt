@@ -0,0 +1,110 @@
+package com.github.numq.textgeneration.index
+
+import java.lang.ref.Cleaner
+import java.nio.FloatBuffer
+
+internal class NativeVectorIndex private constructor(private val nativeHandle: Long) : AutoCloseable {
+    init {
+        require(nativeHandle != -1L) { "Unable to initialize native index" }
+    }
+
+    private val cleanable = cleaner.register(this) { freeNative(nativeHandle) }
+
+    companion object {
+        private val cleaner: Cleaner = Cleaner.create()
+
+        @JvmStatic
+        private external fun createNative(dimension: Int, metric: Int, quantization: Int, lists: Int): Long
+
+        @JvmStatic
+        private external fun loadNative(path: String): Long
+
+        @JvmStatic
+        private external fun getDimensionNative(handle: Long): Int
+
+        @JvmStatic
+        private external fun getSizeNative(handle: Long): Long
+
+        @JvmStatic
+        private external fun trainNative(handle: Long, vectors: FloatBuffer, offset: Int, count: Int)
+
+        @JvmStatic
+        private external fun addNative(handle: Long, ids: LongArray, vectors: FloatBuffer, offset: Int)
+
+        @JvmStatic
+        private external fun searchNative(
+            handle: Long,
+            queries: FloatBuffer,
+            offset: Int,
+            count: Int,
+            limit: Int,
+            probes: Int,
+            ids: LongArray,
+            scores: FloatArray,
+        )
+
+        @JvmStatic
+        private external fun saveNative(handle: Long, path: String)
+
+        @JvmStatic
+        private external fun freeNative(handle: Long)
+
+        fun create(dimension: Int, metric: VectorMetric, quantization: VectorQuantization, lists: Int) =
+            NativeVectorIndex(
+                createNative(
+                    dimension = dimension,
+                    metric = metric.nativeValue,
+                    quantization = quantization.nativeValue,
+                    lists = lists
+                )
+            )
+
+        fun load(path: String) = NativeVectorIndex(loadNative(path = path))
+    }
+
+    val dimension by lazy { getDimensionNative(handle = nativeHandle) }
+
+    val size get() = getSizeNative(handle = nativeHandle)
+
+    fun train(vectors: FloatBuffer) = trainNative(
+        handle = nativeHandle,
+        vectors = vectors,
+        offset = vectors.position(),
+        count = vectors.remaining() / dimension
+    )
+
+    fun add(ids: LongArray, vectors: FloatBuffer) = addNative(
+        handle = nativeHandle,
+        ids = ids,
+        vectors = vectors,
+        offset = vectors.position()
+    )
+
+    fun search(queries: FloatBuffer, limit: Int, probes: Int): List<List<VectorSearchResult>> {
+        val count = queries.remaining() / dimension
+
+        val ids = LongArray(count * limit)
+        val scores = FloatArray(count * limit)
+
+        searchNative(
+            handle = nativeHandle,
+            queries = queries,
+            offset = queries.position(),
+            count = count,
+            limit = limit,
+            probes = probes,
+            ids = ids,
+            scores = scores
+        )
+
+        return List(count) { query ->
+            (query * limit until (query + 1) * limit).filter { ids[it] >= 0 }.map { index ->
+                VectorSearchResult(id = ids[index], score = scores[index])
+            }
+        }
+    }
+
+    fun save(path: String) = saveNative(handle = nativeHandle, path = path)
+
+    override fun close() = cleanable.clean()
+}
@@ -0,0 +1,105 @@
+package com.github.numq.textgeneration.index
+
+import java.nio.FloatBuffer
+
+interface VectorIndex : AutoCloseable {
+    /**
+     * The size of the stored vectors.
+     */
+    val dimension: Int
+
+    companion object {
+        private const val DEFAULT_PROBES = 8
+
+        /**
+         * Creates an empty in-memory index.
+         *
+         * With a single list the index is flat and every search scans all vectors. With more lists it is an IVF
+         * index: it has to be trained first, vectors are assigned to the list of their nearest centroid, and a search
+         * only scans the lists of the nearest centroids.
+         *
+         * @param dimension the size of the stored vectors.
+         * @param metric the similarity metric.
+         * @param quantization the storage type of the vectors.
+         * @param lists the number of inverted lists, `1` for a flat index.
+         * @return a [Result] containing the created index if successful.
+         */
+        fun create(
+            dimension: Int,
+            metric: VectorMetric = VectorMetric.COSINE,
+            quantization: VectorQuantization = VectorQuantization.FLOAT32,
+            lists: Int = 1,
+        ): Result<VectorIndex> = runCatching {
+            require(dimension > 0) { "Dimension should be positive" }
+
+            require(lists > 0) { "Number of lists should be positive" }
+
+            DefaultVectorIndex(
+                nativeVectorIndex = NativeVectorIndex.create(
+                    dimension = dimension,
+                    metric = metric,
+                    quantization = quantization,
+                    lists = lists
+                )
+            )
+        }
+
+        /**
+         * Memory-maps an index previously written by [save].
+         *
+         * The vectors are searched in place from the mapping and are only copied into memory on the first [add].
+         *
+         * @param path the path to the index file.
+         * @return a [Result] containing the loaded index if successful.
+         */
+        fun load(path: String): Result<VectorIndex> = runCatching {
+            DefaultVectorIndex(nativeVectorIndex = NativeVectorIndex.load(path = path))
+        }
+    }
+
+    /**
+     * Retrieves the number of stored vectors.
+     *
+     * @return A [Result] containing the number of stored vectors.
+     */
+    suspend fun size(): Result<Long>
+
+    /**
+     * Trains the centroids of an IVF index with spherical k-means.
+     *
+     * @param vectors A direct buffer with the training vectors between its position and its limit.
+     * @return A [Result] indicating the success or failure of the operation.
+     */
+    suspend fun train(vectors: FloatBuffer): Result<Unit>
+
+    /**
+     * Adds vectors to the index.
+     *
+     * @param ids The identifiers of the vectors.
+     * @param vectors A direct buffer with one vector per identifier, starting at its position.
+     * @return A [Result] indicating the success or failure of the operation.
+     */
+    suspend fun add(ids: LongArray, vectors: FloatBuffer): Result<Unit>
+
+    /**
+     * Finds the most similar stored vectors for each query.
+     *
+     * @param queries A direct buffer with the query vectors between its position and its limit.
+     * @param limit The maximum number of results per query.
+     * @param probes The number of lists scanned per query by an IVF index.
+     * @return A [Result] containing, for each query, the results ordered by descending score.
+     */
+    suspend fun search(
+        queries: FloatBuffer,
+        limit: Int,
+        probes: Int = DEFAULT_PROBES,
+    ): Result<List<List<VectorSearchResult>>>
+
+    /**
+     * Writes the index to a file that can be memory-mapped with [load].
+     *
+     * @param path The path to the index file.
+     * @return A [Result] indicating the success or failure of the operation.
+     */
+    suspend fun save(path: String): Result<Unit>
+}
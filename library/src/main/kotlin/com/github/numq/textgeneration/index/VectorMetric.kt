@@ -0,0 +1,5 @@
+package com.github.numq.textgeneration.index
+
+enum class VectorMetric(internal val nativeValue: Int) {
+    DOT_PRODUCT(0), COSINE(1)
+}
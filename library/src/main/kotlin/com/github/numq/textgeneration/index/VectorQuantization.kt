@@ -0,0 +1,5 @@
+package com.github.numq.textgeneration.index
+
+enum class VectorQuantization(internal val nativeValue: Int) {
+    FLOAT32(0), INT8(1)
+}
@@ -0,0 +1,3 @@
+package com.github.numq.textgeneration.index
+
+data class VectorSearchResult(val id: Long, val score: Float)
@@ -0,0 +1,19 @@
+package com.github.numq.textgeneration.llama
+
+import java.lang.ref.Cleaner
+
+/**
+ * A LoRA adapter loaded once for the model of an instance and applied per request with
+ * [LlamaGenerationParameters.adapter].
+ *
+ * The adapter keeps its model in memory until it is closed, even if the instance swaps the model.
+ */
+class LlamaAdapter internal constructor(internal val handle: Long) : AutoCloseable {
+    private val cleanable = cleaner.register(this) { NativeLlamaTextGeneration.freeAdapter(adapterHandle = handle) }
+
+    private companion object {
+        val cleaner: Cleaner = Cleaner.create()
+    }
+
+    override fun close() = cleanable.clean()
+}
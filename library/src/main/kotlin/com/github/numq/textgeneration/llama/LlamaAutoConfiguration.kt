@@ -0,0 +1,19 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Configuration derived from a model and a memory budget.
+ *
+ * @property contextSize the size of the context window.
+ * @property cacheType the data type of the K and V caches.
+ * @property flashAttention whether flash attention is used, which a quantized V cache requires.
+ * @property threads the number of threads used for decoding.
+ * @property batchThreads the number of threads used for prompt processing.
+ * @see LlamaModelInfo.autoConfiguration
+ */
+data class LlamaAutoConfiguration(
+    val contextSize: Int,
+    val cacheType: LlamaCacheType,
+    val flashAttention: Boolean,
+    val threads: Int,
+    val batchThreads: Int,
+)
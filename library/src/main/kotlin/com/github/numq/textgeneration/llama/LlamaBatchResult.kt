@@ -0,0 +1,10 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * The result of a single prompt of a batch generation.
+ *
+ * @property index the index of the prompt in the submitted batch.
+ * @property input the prompt message.
+ * @property output the generated message, or the failure that prevented its generation.
+ */
+data class LlamaBatchResult(val index: Int, val input: LlamaMessage.Input, val output: Result<LlamaMessage.Output>)
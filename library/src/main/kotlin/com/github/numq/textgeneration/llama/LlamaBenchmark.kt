@@ -0,0 +1,20 @@
+package com.github.numq.textgeneration.llama
+
+import kotlin.time.Duration
+
+/**
+ * Measurements of a model on this machine, used to compare quantizations.
+ *
+ * @property size the size of the model files, in bytes.
+ * @property loadTime the time to load the model, create a context and warm it up.
+ * @property prefillThroughput the number of prompt tokens decoded per second.
+ * @property decodeThroughput the number of tokens generated per second, one at a time.
+ * @property perplexity the perplexity of the model on the benchmark text, lower is better.
+ */
+data class LlamaBenchmark(
+    val size: Long,
+    val loadTime: Duration,
+    val prefillThroughput: Double,
+    val decodeThroughput: Double,
+    val perplexity: Double,
+)
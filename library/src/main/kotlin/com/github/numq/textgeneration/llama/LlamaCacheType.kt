@@ -0,0 +1,11 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Data type of the KV cache.
+ *
+ * Quantized types take less memory per cell at a small cost in accuracy: `Q8_0` takes about half and `Q4_0` about a
+ * quarter of the memory of `F16`.
+ */
+enum class LlamaCacheType(internal val nativeValue: Int, internal val bytesPerElement: Double) {
+    F16(1, 2.0), Q8_0(8, 34.0 / 32), Q4_0(2, 18.0 / 32)
+}
@@ -0,0 +1,16 @@
+package com.github.numq.textgeneration.llama
+
+import kotlin.math.exp
+
+/**
+ * The likelihood of a candidate response to a prompt.
+ *
+ * @property candidate the candidate response.
+ * @property logProbability the sum of the log-probabilities of the candidate tokens.
+ */
+data class LlamaCandidateScore(val candidate: String, val logProbability: Float) {
+    /**
+     * The probability of the model responding with exactly the candidate tokens.
+     */
+    val probability get() = exp(logProbability.toDouble())
+}
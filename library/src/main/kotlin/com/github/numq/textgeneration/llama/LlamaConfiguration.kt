@@ -0,0 +1,18 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Context configuration in effect for an instance.
+ *
+ * @property contextSize the size of the context window.
+ * @property batchSize the logical batch size, the maximum number of tokens submitted in one decode.
+ * @property microBatchSize the physical batch size, the maximum number of tokens computed at once.
+ * @property threads the number of threads used to generate tokens one by one.
+ * @property batchThreads the number of threads used to decode prompts.
+ */
+data class LlamaConfiguration(
+    val contextSize: Int,
+    val batchSize: Int,
+    val microBatchSize: Int,
+    val threads: Int,
+    val batchThreads: Int,
+)
@@ -0,0 +1,21 @@
+package com.github.numq.textgeneration.llama
+
+import java.lang.ref.Cleaner
+
+/**
+ * A control vector loaded once for the model of an instance and applied per request with
+ * [LlamaGenerationParameters.controlVector].
+ *
+ * The control vector keeps its model in memory until it is closed, even if the instance swaps the model.
+ */
+class LlamaControlVector internal constructor(internal val handle: Long) : AutoCloseable {
+    private val cleanable = cleaner.register(this) {
+        NativeLlamaTextGeneration.freeControlVector(controlVectorHandle = handle)
+    }
+
+    private companion object {
+        val cleaner: Cleaner = Cleaner.create()
+    }
+
+    override fun close() = cleanable.clean()
+}
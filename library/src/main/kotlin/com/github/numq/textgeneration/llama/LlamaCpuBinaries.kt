@@ -0,0 +1,9 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Native binaries built for one [LlamaCpuVariant].
+ *
+ * @property ggmlCpu the path to the `ggml-cpu` binary.
+ * @property textGeneration the path to the `text-generation` binary.
+ */
+data class LlamaCpuBinaries(val ggmlCpu: String, val textGeneration: String)
@@ -0,0 +1,11 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Instruction set a CPU build of the native binaries is compiled for.
+ *
+ * Each variant requires the instruction sets of the variants before it, and runs faster on CPUs that support it:
+ * `AVX512_VNNI` speeds up quantized dot products and `AMX` runs them on tile matrix units.
+ */
+enum class LlamaCpuVariant(internal val nativeValue: Int) {
+    BASELINE(0), AVX2(1), AVX512(2), AVX512_VNNI(3), AMX(4)
+}
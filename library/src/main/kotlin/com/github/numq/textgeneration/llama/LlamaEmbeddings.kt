@@ -0,0 +1,21 @@
+package com.github.numq.textgeneration.llama
+
+import java.nio.FloatBuffer
+
+/**
+ * Embedding vectors stored contiguously in a direct [FloatBuffer], one row of [dimension] floats per text.
+ *
+ * @property count the number of embedded texts.
+ * @property dimension the size of each embedding vector.
+ * @property buffer the direct buffer holding `count * dimension` floats.
+ */
+class LlamaEmbeddings internal constructor(val count: Int, val dimension: Int, val buffer: FloatBuffer) {
+    /**
+     * Copies the embedding vector of the text at [index].
+     */
+    operator fun get(index: Int): FloatArray {
+        require(index in 0 until count) { "Index $index is out of bounds" }
+
+        return FloatArray(dimension).also { vector -> buffer.duplicate().position(index * dimension).get(vector) }
+    }
+}
@@ -0,0 +1,41 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Sampling parameters used to generate a response.
+ *
+ * @property temperature the sampling temperature.
+ * @property topP the cumulative probability threshold for nucleus sampling.
+ * @property repetitionPenalty the penalty applied to repeated tokens.
+ * @property topK the number of most likely tokens to sample from.
+ * @property seed the sampling seed, or `0` for greedy sampling.
+ * @property maxTokens the maximum number of tokens to generate, or `null` to generate until the end of the response.
+ * @property adapter the LoRA adapter applied to the request, or `null` to use the base model. Changing the adapter or
+ * its scale between requests decodes the conversation again.
+ * @property adapterScale the scale the adapter is applied with.
+ * @property controlVector the control vector that steers the request, or `null` to leave it unsteered. Changing the
+ * control vector or its scale between requests decodes the conversation again.
+ * @property controlVectorScale the strength the control vector is applied with, negative to steer away from it.
+ */
+data class LlamaGenerationParameters(
+    val temperature: Float = DEFAULT_TEMPERATURE,
+    val topP: Float = DEFAULT_TOP_P,
+    val repetitionPenalty: Float = DEFAULT_REPETITION_PENALTY,
+    val topK: Int = DEFAULT_TOP_K,
+    val seed: Int = 0,
+    val maxTokens: Int? = null,
+    val adapter: LlamaAdapter? = null,
+    val adapterScale: Float = 1f,
+    val controlVector: LlamaControlVector? = null,
+    val controlVectorScale: Float = 1f,
+) {
+    init {
+        require(maxTokens == null || maxTokens > 0) { "Max tokens should be positive" }
+    }
+
+    private companion object {
+        const val DEFAULT_TEMPERATURE = .98f
+        const val DEFAULT_TOP_P = .37f
+        const val DEFAULT_REPETITION_PENALTY = 1.18f
+        const val DEFAULT_TOP_K = 100
+    }
+}
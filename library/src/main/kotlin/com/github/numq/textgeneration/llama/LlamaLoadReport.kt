@@ -0,0 +1,24 @@
+package com.github.numq.textgeneration.llama
+
+import kotlin.time.Duration
+import kotlin.time.DurationUnit
+
+/**
+ * Report of how the current model was loaded.
+ *
+ * @property splitCount the number of files the model is split into, `1` if it is not split.
+ * @property size the total size of the model files, in bytes.
+ * @property readTime the time spent validating the files and, if prefetching, reading them.
+ * @property loadTime the time spent loading the model from the files.
+ */
+data class LlamaLoadReport(
+    val splitCount: Int,
+    val size: Long,
+    val readTime: Duration,
+    val loadTime: Duration,
+) {
+    /**
+     * The throughput of loading the model, in bytes per second.
+     */
+    val throughput get() = size / (readTime + loadTime).toDouble(DurationUnit.SECONDS)
+}
@@ -0,0 +1,11 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Memory taken by an instance, in bytes.
+ *
+ * @property modelSize the size of the model weights, shared by all instances.
+ * @property kvCacheSize the size of the KV cache of the context.
+ * @property computeBufferSize the estimated size of the compute buffers of the context, from its micro batch size, its
+ * context size and the model hyperparameters.
+ */
+data class LlamaMemoryUsage(val modelSize: Long, val kvCacheSize: Long, val computeBufferSize: Long)
@@ -0,0 +1,82 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Information about a model, read from its metadata without loading the weights.
+ *
+ * @property architecture the architecture of the model.
+ * @property trainContextSize the context size the model was trained with.
+ * @property embeddingSize the size of the embeddings.
+ * @property layerCount the number of layers.
+ * @property headCount the number of attention heads.
+ * @property kvHeadCount the number of key and value heads, fewer than [headCount] with grouped-query attention.
+ * @property parameterCount the number of parameters.
+ * @property size the total size of the model files, in bytes.
+ * @property chatTemplate the chat template of the model, or `null` if it has none.
+ * @property metadata all metadata of the model as strings.
+ */
+data class LlamaModelInfo(
+    val architecture: String,
+    val trainContextSize: Int,
+    val embeddingSize: Int,
+    val layerCount: Int,
+    val headCount: Int,
+    val kvHeadCount: Int,
+    val parameterCount: Long,
+    val size: Long,
+    val chatTemplate: String?,
+    val metadata: Map<String, String>,
+) {
+    private companion object {
+        const val COMPUTE_BUFFER_SHARE = 8
+        const val CONTEXT_SIZE_STEP = 256
+        const val MIN_CONTEXT_SIZE = 512
+    }
+
+    /**
+     * The size of one KV cache cell with the given data type, in bytes.
+     */
+    fun kvCacheCellSize(cacheType: LlamaCacheType) =
+        2.0 * layerCount * kvHeadCount * (embeddingSize / headCount.coerceAtLeast(1)) * cacheType.bytesPerElement
+
+    /**
+     * Derives a configuration that fits the model into a memory budget.
+     *
+     * After the model weights and a share reserved for compute buffers, the KV cache takes the rest of the budget. The
+     * context size is the training context size if it fits with the most precise cache type that allows it, and
+     * otherwise the most that fits with a `Q4_0` cache. Decoding uses half of the available processors, which
+     * typically are the physical cores, and prompt processing uses all of them.
+     *
+     * @param memoryBudget the memory the instance may take, in bytes.
+     * @param processors the number of processors available to the instance.
+     * @return the derived [LlamaAutoConfiguration].
+     * @throws IllegalArgumentException if the budget does not fit a minimal context.
+     */
+    fun autoConfiguration(
+        memoryBudget: Long,
+        processors: Int = Runtime.getRuntime().availableProcessors(),
+    ): LlamaAutoConfiguration {
+        val available = memoryBudget - size
+
+        require(available > 0) { "Memory budget should exceed the model size" }
+
+        val kvCacheBudget = available - available / COMPUTE_BUFFER_SHARE
+
+        fun cells(cacheType: LlamaCacheType) = (kvCacheBudget / kvCacheCellSize(cacheType)).toLong()
+
+        val cacheType = LlamaCacheType.entries.firstOrNull { cacheType ->
+            cells(cacheType) >= trainContextSize
+        } ?: LlamaCacheType.Q4_0
+
+        val contextSize = minOf(trainContextSize.toLong(), cells(cacheType) / CONTEXT_SIZE_STEP * CONTEXT_SIZE_STEP)
+
+        require(contextSize >= MIN_CONTEXT_SIZE) { "Memory budget does not fit a context of $MIN_CONTEXT_SIZE tokens" }
+
+        return LlamaAutoConfiguration(
+            contextSize = contextSize.toInt(),
+            cacheType = cacheType,
+            flashAttention = cacheType != LlamaCacheType.F16,
+            threads = (processors / 2).coerceAtLeast(1),
+            batchThreads = processors.coerceAtLeast(1)
+        )
+    }
+}
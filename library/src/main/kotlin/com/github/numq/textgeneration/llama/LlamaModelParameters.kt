@@ -0,0 +1,18 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Parameters used to load a model.
+ *
+ * @property useMmap whether the model file is memory-mapped instead of read into memory.
+ * @property useMlock whether the model is locked in memory so that it is not swapped out.
+ * @property prefetch whether the model file is read in parallel before loading, so that mapped pages are already in
+ * the page cache.
+ * @property warmup whether a couple of tokens are decoded after loading, so that the first request does not pay for
+ * page faults and buffer allocation.
+ */
+data class LlamaModelParameters(
+    val useMmap: Boolean = true,
+    val useMlock: Boolean = false,
+    val prefetch: Boolean = false,
+    val warmup: Boolean = true,
+)
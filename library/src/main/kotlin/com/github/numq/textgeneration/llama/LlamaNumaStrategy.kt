@@ -0,0 +1,11 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Strategy used to spread the threads and memory of inference over the nodes of a NUMA machine.
+ *
+ * `DISTRIBUTE` spreads threads evenly over all nodes, `ISOLATE` keeps them on the node the process started on, and
+ * `NUMACTL` follows the CPU set the process was started with by `numactl`.
+ */
+enum class LlamaNumaStrategy(internal val nativeValue: Int) {
+    DISTRIBUTE(1), ISOLATE(2), NUMACTL(3)
+}
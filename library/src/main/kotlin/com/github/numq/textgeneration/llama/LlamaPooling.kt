@@ -0,0 +1,5 @@
+package com.github.numq.textgeneration.llama
+
+enum class LlamaPooling(internal val nativeValue: Int) {
+    MEAN(1), CLS(2), LAST(3)
+}
@@ -0,0 +1,20 @@
+package com.github.numq.textgeneration.llama
+
+import kotlin.time.Duration
+
+/**
+ * Progress of decoding a prompt, reported after each chunk of the batch size.
+ *
+ * Tokens that are already in the context are not counted.
+ *
+ * @property processedTokens the number of prompt tokens decoded so far.
+ * @property totalTokens the number of prompt tokens to decode.
+ * @property elapsed the time spent decoding so far.
+ * @property remaining the estimated time until the prompt is decoded, extrapolated from the throughput so far.
+ */
+data class LlamaPrefillProgress(
+    val processedTokens: Int,
+    val totalTokens: Int,
+    val elapsed: Duration,
+    val remaining: Duration,
+)
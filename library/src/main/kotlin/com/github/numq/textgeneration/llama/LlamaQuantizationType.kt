@@ -0,0 +1,12 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Data type a model is quantized to.
+ *
+ * Types with fewer bits per weight take less memory and decode faster at a cost in accuracy. The `K` types mix
+ * precisions per tensor, with `S`, `M` and `L` keeping more tensors at a higher precision.
+ */
+enum class LlamaQuantizationType(internal val nativeValue: Int) {
+    F16(1), BF16(32), Q8_0(7), Q6_K(18), Q5_K_M(17), Q5_K_S(16), Q5_0(8), Q4_K_M(15), Q4_K_S(14), Q4_0(2), Q3_K_L(13),
+    Q3_K_M(12), Q3_K_S(11), Q2_K(10)
+}
@@ -0,0 +1,18 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Policy used to keep the memory of idle instances in check.
+ *
+ * When the contexts of all instances together would occupy more than [maxResidentCells] KV cells, the least recently
+ * used idle instances are swapped out: the context state of the conversation is moved to host memory, the context is
+ * returned to the context pool and the embedding, scoring, completion and batch contexts are freed. A swapped out instance is
+ * restored transparently on its next use, without decoding its history again.
+ *
+ * @property maxResidentCells the maximum number of KV cells occupied across the contexts of all instances, where an
+ * idle context counts the cells its cache holds and a context in use counts its full size.
+ */
+data class LlamaSwapPolicy(val maxResidentCells: Int) {
+    init {
+        require(maxResidentCells > 0) { "Maximum number of resident cells should be positive" }
+    }
+}
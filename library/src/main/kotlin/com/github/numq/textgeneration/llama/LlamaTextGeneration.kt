@@ -1,12 +1,25 @@
 package com.github.numq.textgeneration.llama
 
 import com.github.numq.textgeneration.TextGeneration
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.Job
+import kotlinx.coroutines.NonCancellable
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.flow.buffer
+import kotlinx.coroutines.flow.channelFlow
+import kotlinx.coroutines.flow.flowOn
+import kotlinx.coroutines.isActive
 import kotlinx.coroutines.sync.Mutex
 import kotlinx.coroutines.sync.withLock
+import kotlinx.coroutines.withContext
+import java.nio.ByteBuffer
+import kotlin.coroutines.coroutineContext
+import kotlin.time.TimeSource
 
 internal class LlamaTextGeneration(
     private val nativeLlamaTextGeneration: NativeLlamaTextGeneration,
     systemPrompt: String,
+    private val truncationPolicy: LlamaTruncationPolicy?,
 ) : TextGeneration.Llama {
     private val mutex = Mutex()
 
@@ -14,17 +27,160 @@ internal class LlamaTextGeneration(
 
     private val messages = mutableListOf<LlamaMessage>(systemMessage)
 
+    private suspend fun progressCallback(onProgress: (LlamaPrefillProgress) -> Unit): NativeLlamaProgressCallback {
+        val job = coroutineContext[Job]
+
+        val start = TimeSource.Monotonic.markNow()
+
+        return NativeLlamaProgressCallback { processed, total ->
+            val elapsed = start.elapsedNow()
+
+            onProgress(
+                LlamaPrefillProgress(
+                    processedTokens = processed,
+                    totalTokens = total,
+                    elapsed = elapsed,
+                    remaining = elapsed / processed * (total - processed)
+                )
+            )
+
+            job?.isActive != false
+        }
+    }
+
     override suspend fun history() = mutex.withLock { Result.success(messages.toList()) }
 
-    override suspend fun generate(prompt: String) = mutex.withLock {
+    override suspend fun generate(
+        prompt: String,
+        parameters: LlamaGenerationParameters,
+        onProgress: (LlamaPrefillProgress) -> Unit,
+    ) = mutex.withLock {
+        runCatching {
+            val userMessage = LlamaMessage.Input(content = prompt.trim())
+
+            messages.add(userMessage)
+
+            val response = runCatching {
+                nativeLlamaTextGeneration.generate(
+                    messages = messages.map { message ->
+                        NativeLlamaMessage(role = message.role.name.lowercase(), content = message.content)
+                    }.toTypedArray(),
+                    parameters = parameters,
+                    truncationPolicy = truncationPolicy,
+                    callback = progressCallback(onProgress)
+                )
+            }.onFailure {
+                messages.removeAt(messages.lastIndex)
+            }.getOrThrow()
+
+            val assistantMessage = LlamaMessage.Output(content = response.trim())
+
+            messages.add(assistantMessage)
+
+            LlamaExchange(input = userMessage, output = assistantMessage)
+        }
+    }
+
+    override suspend fun prefill(messages: List<LlamaMessage>, onProgress: (LlamaPrefillProgress) -> Unit) =
+        mutex.withLock {
+            runCatching {
+                val size = this.messages.size
+
+                this.messages.addAll(messages.map { message ->
+                    when (message) {
+                        is LlamaMessage.System -> message.copy(content = message.content.trim())
+
+                        is LlamaMessage.Input -> message.copy(content = message.content.trim())
+
+                        is LlamaMessage.Output -> message.copy(content = message.content.trim())
+                    }
+                })
+
+                runCatching {
+                    nativeLlamaTextGeneration.prefill(
+                        messages = this.messages.map { message ->
+                            NativeLlamaMessage(role = message.role.name.lowercase(), content = message.content)
+                        }.toTypedArray(),
+                        partialPrompt = null,
+                        callback = progressCallback(onProgress)
+                    )
+                }.onFailure {
+                    this.messages.subList(size, this.messages.size).clear()
+                }.getOrThrow()
+            }
+        }
+
+    override suspend fun prefill(partialPrompt: String, onProgress: (LlamaPrefillProgress) -> Unit) = mutex.withLock {
+        runCatching {
+            nativeLlamaTextGeneration.prefill(
+                messages = messages.map { message ->
+                    NativeLlamaMessage(role = message.role.name.lowercase(), content = message.content)
+                }.toTypedArray(),
+                partialPrompt = partialPrompt.trimStart(),
+                callback = progressCallback(onProgress)
+            )
+        }
+    }
+
+    override suspend fun regenerate(parameters: LlamaGenerationParameters) = mutex.withLock {
+        runCatching {
+            val assistantMessage = messages.lastOrNull()
+
+            check(assistantMessage is LlamaMessage.Output) { "There is no response to regenerate" }
+
+            val userMessage = messages[messages.lastIndex - 1]
+
+            check(userMessage is LlamaMessage.Input) { "There is no prompt to regenerate the response to" }
+
+            messages.removeAt(messages.lastIndex)
+
+            val response = runCatching {
+                nativeLlamaTextGeneration.regenerate(messages = messages.map { message ->
+                    NativeLlamaMessage(role = message.role.name.lowercase(), content = message.content)
+                }.toTypedArray(), parameters = parameters, truncationPolicy = truncationPolicy, callback = null)
+            }.onFailure {
+                messages.add(assistantMessage)
+            }.getOrThrow()
+
+            val regeneratedMessage = LlamaMessage.Output(content = response.trim())
+
+            messages.add(regeneratedMessage)
+
+            LlamaExchange(input = userMessage, output = regeneratedMessage)
+        }
+    }
+
+    override suspend fun editLast(
+        prompt: String,
+        parameters: LlamaGenerationParameters,
+        onProgress: (LlamaPrefillProgress) -> Unit,
+    ) = mutex.withLock {
         runCatching {
+            val lastIndex = messages.indexOfLast { message -> message is LlamaMessage.Input }
+
+            check(lastIndex >= 0) { "There is no prompt to edit" }
+
+            val editedMessages = messages.subList(lastIndex, messages.size).toList()
+
+            messages.subList(lastIndex, messages.size).clear()
+
             val userMessage = LlamaMessage.Input(content = prompt.trim())
 
             messages.add(userMessage)
 
-            val response = nativeLlamaTextGeneration.generate(messages = messages.map { message ->
-                NativeLlamaMessage(role = message.role.name.lowercase(), content = message.content)
-            }.toTypedArray())
+            val response = runCatching {
+                nativeLlamaTextGeneration.editLast(
+                    messages = messages.map { message ->
+                        NativeLlamaMessage(role = message.role.name.lowercase(), content = message.content)
+                    }.toTypedArray(),
+                    parameters = parameters,
+                    truncationPolicy = truncationPolicy,
+                    callback = progressCallback(onProgress)
+                )
+            }.onFailure {
+                messages.removeAt(messages.lastIndex)
+                messages.addAll(editedMessages)
+            }.getOrThrow()
 
             val assistantMessage = LlamaMessage.Output(content = response.trim())
 
@@ -34,8 +190,220 @@ internal class LlamaTextGeneration(
         }
     }
 
+    override suspend fun complete(tokens: IntArray, parameters: LlamaGenerationParameters) = mutex.withLock {
+        runCatching {
+            nativeLlamaTextGeneration.complete(tokens = tokens, parameters = parameters)
+        }
+    }
+
+    override fun generateBatch(prompts: List<String>, parameters: LlamaGenerationParameters, parallelism: Int) =
+        channelFlow {
+            require(parallelism > 0) { "Parallelism should be positive" }
+
+            val inputs = prompts.map { prompt -> LlamaMessage.Input(content = prompt.trim()) }
+
+            nativeLlamaTextGeneration.generateBatch(
+                systemPrompt = systemMessage.content,
+                prompts = inputs.map(LlamaMessage.Input::content).toTypedArray(),
+                parameters = parameters,
+                parallelism = parallelism
+            ) { index, output, error ->
+                val result = when (output) {
+                    null -> Result.failure(IllegalStateException(error ?: "Unable to generate response"))
+
+                    else -> Result.success(LlamaMessage.Output(content = output.trim()))
+                }
+
+                trySend(LlamaBatchResult(index = index, input = inputs[index], output = result)).isSuccess && isActive
+            }
+        }.buffer(Channel.UNLIMITED).flowOn(Dispatchers.IO)
+
+    override suspend fun embed(texts: List<String>, pooling: LlamaPooling, normalize: Boolean) = mutex.withLock {
+        runCatching {
+            val buffer = nativeLlamaTextGeneration.embed(
+                texts = texts.toTypedArray(),
+                pooling = pooling,
+                normalize = normalize
+            )
+
+            LlamaEmbeddings(count = texts.size, dimension = nativeLlamaTextGeneration.embeddingSize, buffer = buffer)
+        }
+    }
+
+    override suspend fun score(prompt: String, candidates: List<String>) = mutex.withLock {
+        runCatching {
+            val logProbabilities = nativeLlamaTextGeneration.score(
+                systemPrompt = systemMessage.content,
+                prompt = prompt.trim(),
+                candidates = candidates.toTypedArray()
+            )
+
+            candidates.zip(logProbabilities.toList()) { candidate, logProbability ->
+                LlamaCandidateScore(candidate = candidate, logProbability = logProbability)
+            }
+        }
+    }
+
+    private fun historySize() = Int.SIZE_BYTES + messages.sumOf { message ->
+        Byte.SIZE_BYTES + Int.SIZE_BYTES + message.content.encodeToByteArray().size
+    }
+
+    private fun writeHistory(buffer: ByteBuffer) {
+        buffer.putInt(messages.size)
+
+        messages.forEach { message ->
+            val content = message.content.encodeToByteArray()
+
+            buffer.put(message.role.ordinal.toByte())
+            buffer.putInt(content.size)
+            buffer.put(content)
+        }
+    }
+
+    private fun readHistory(buffer: ByteBuffer) = List(buffer.getInt()) {
+        val role = LlamaRole.entries.getOrNull(buffer.get().toInt())
+
+        val content = ByteArray(buffer.getInt()).also(buffer::get).decodeToString()
+
+        when (role) {
+            LlamaRole.SYSTEM -> LlamaMessage.System(content = content)
+
+            LlamaRole.USER -> LlamaMessage.Input(content = content)
+
+            LlamaRole.ASSISTANT -> LlamaMessage.Output(content = content)
+
+            null -> throw IllegalArgumentException("Invalid snapshot")
+        }
+    }
+
+    override suspend fun snapshotSize() = mutex.withLock {
+        runCatching {
+            historySize() + nativeLlamaTextGeneration.snapshotSize
+        }
+    }
+
+    override suspend fun snapshot(buffer: ByteBuffer) = mutex.withLock {
+        runCatching {
+            require(buffer.isDirect) { "Buffer should be direct" }
+
+            require(buffer.remaining() >= historySize() + nativeLlamaTextGeneration.snapshotSize) {
+                "Buffer is too small"
+            }
+
+            val start = buffer.position()
+
+            writeHistory(buffer)
+
+            val size = nativeLlamaTextGeneration.snapshot(buffer = buffer, offset = buffer.position())
+
+            buffer.position(buffer.position() + size)
+
+            buffer.position() - start
+        }
+    }
+
+    override suspend fun restore(buffer: ByteBuffer) = mutex.withLock {
+        runCatching {
+            require(buffer.isDirect) { "Buffer should be direct" }
+
+            val start = buffer.position()
+
+            val history = runCatching {
+                readHistory(buffer)
+            }.getOrElse { throwable ->
+                buffer.position(start)
+
+                throw IllegalArgumentException("Invalid snapshot", throwable)
+            }
+
+            val size = runCatching {
+                nativeLlamaTextGeneration.restore(
+                    buffer = buffer,
+                    offset = buffer.position(),
+                    length = buffer.remaining()
+                )
+            }.onFailure {
+                buffer.position(start)
+            }.getOrThrow()
+
+            buffer.position(buffer.position() + size)
+
+            messages.clear()
+
+            messages.addAll(history)
+        }
+    }
+
+    override suspend fun configuration() = mutex.withLock {
+        runCatching {
+            nativeLlamaTextGeneration.configuration
+        }
+    }
+
+    override suspend fun loadReport() = mutex.withLock {
+        runCatching {
+            nativeLlamaTextGeneration.loadReport
+        }
+    }
+
+    override suspend fun memoryUsage() = mutex.withLock {
+        runCatching {
+            nativeLlamaTextGeneration.memoryUsage
+        }
+    }
+
+    override suspend fun openConversation(systemPrompt: String) = withContext(Dispatchers.IO) {
+        runCatching {
+            LlamaTextGeneration(
+                nativeLlamaTextGeneration = nativeLlamaTextGeneration.openConversation(),
+                systemPrompt = systemPrompt,
+                truncationPolicy = truncationPolicy
+            )
+        }
+    }
+
+    override suspend fun loadAdapter(adapterPath: String) = withContext(Dispatchers.IO) {
+        runCatching {
+            nativeLlamaTextGeneration.loadAdapter(adapterPath = adapterPath)
+        }
+    }
+
+    override suspend fun loadControlVector(controlVectorPath: String) = withContext(Dispatchers.IO) {
+        runCatching {
+            nativeLlamaTextGeneration.loadControlVector(controlVectorPath = controlVectorPath)
+        }
+    }
+
+    override suspend fun swapModel(
+        modelPath: String,
+        modelParameters: LlamaModelParameters,
+        onProgress: (Float) -> Unit,
+    ) = withContext(Dispatchers.IO) {
+        val job = coroutineContext[Job]
+
+        runCatching {
+            val stagedHandle = nativeLlamaTextGeneration.prepareModel(
+                modelPath = modelPath,
+                modelParameters = modelParameters,
+                callback = NativeLlamaLoadCallback { progress ->
+                    onProgress(progress)
+
+                    job?.isActive != false
+                }
+            )
+
+            withContext(NonCancellable) {
+                mutex.withLock {
+                    nativeLlamaTextGeneration.swapModel(stagedHandle = stagedHandle)
+                }
+            }
+        }
+    }
+
     override suspend fun reset() = mutex.withLock {
         runCatching {
+            nativeLlamaTextGeneration.reset(systemPrompt = systemMessage.content)
+
             messages.clear()
 
             messages.add(systemMessage)
@@ -45,8 +413,6 @@ internal class LlamaTextGeneration(
     }
 
     override fun close() = runCatching {
-        super.close()
-
         nativeLlamaTextGeneration.close()
     }.getOrDefault(Unit)
-}
\ No newline at end of file
+}
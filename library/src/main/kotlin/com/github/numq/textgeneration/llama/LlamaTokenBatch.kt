@@ -0,0 +1,23 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Token ids of several texts stored in a single array.
+ *
+ * @property tokens the token ids of all texts, one after another.
+ * @property offsets the start of each text in [tokens], followed by the total number of tokens.
+ */
+class LlamaTokenBatch internal constructor(val tokens: IntArray, val offsets: IntArray) {
+    /**
+     * The number of texts.
+     */
+    val size get() = offsets.size - 1
+
+    /**
+     * Copies the token ids of the text at [index].
+     */
+    operator fun get(index: Int): IntArray {
+        require(index in 0 until size) { "Index $index is out of bounds" }
+
+        return tokens.copyOfRange(offsets[index], offsets[index + 1])
+    }
+}
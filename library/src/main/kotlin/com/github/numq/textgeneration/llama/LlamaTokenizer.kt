@@ -0,0 +1,27 @@
+package com.github.numq.textgeneration.llama
+
+import com.github.numq.textgeneration.Tokenizer
+
+internal class LlamaTokenizer(private val nativeLlamaTokenizer: NativeLlamaTokenizer) : Tokenizer.Llama {
+    override suspend fun tokenize(text: String, addSpecial: Boolean) = runCatching {
+        nativeLlamaTokenizer.tokenize(texts = arrayOf(text), addSpecial = addSpecial).tokens
+    }
+
+    override suspend fun tokenize(texts: List<String>, addSpecial: Boolean) = runCatching {
+        nativeLlamaTokenizer.tokenize(texts = texts.toTypedArray(), addSpecial = addSpecial)
+    }
+
+    override suspend fun countTokens(text: String, addSpecial: Boolean) = runCatching {
+        nativeLlamaTokenizer.countTokens(texts = arrayOf(text), addSpecial = addSpecial).single()
+    }
+
+    override suspend fun countTokens(texts: List<String>, addSpecial: Boolean) = runCatching {
+        nativeLlamaTokenizer.countTokens(texts = texts.toTypedArray(), addSpecial = addSpecial)
+    }
+
+    override suspend fun detokenize(tokens: IntArray, removeSpecial: Boolean) = runCatching {
+        nativeLlamaTokenizer.detokenize(tokens = tokens, removeSpecial = removeSpecial)
+    }
+
+    override fun close() = runCatching { nativeLlamaTokenizer.close() }.getOrDefault(Unit)
+}
@@ -0,0 +1,27 @@
+package com.github.numq.textgeneration.llama
+
+/**
+ * Policy used to fit the conversation history into the context window.
+ *
+ * Whole turns, each a user message with the responses that follow it, are dropped oldest first until the prompt fits
+ * into the context size minus the tokens reserved for the response.
+ *
+ * @property keepSystemMessage whether the system message is kept when dropping the oldest turns is not enough.
+ * @property keepLastTurns the number of most recent turns that are never dropped.
+ * @property reservedTokens the number of tokens reserved for the response when `maxTokens` is not specified.
+ */
+data class LlamaTruncationPolicy(
+    val keepSystemMessage: Boolean = true,
+    val keepLastTurns: Int = DEFAULT_KEEP_LAST_TURNS,
+    val reservedTokens: Int = DEFAULT_RESERVED_TOKENS,
+) {
+    init {
+        require(keepLastTurns > 0) { "Number of kept turns should be positive" }
+        require(reservedTokens >= 0) { "Reserved tokens should not be negative" }
+    }
+
+    private companion object {
+        const val DEFAULT_KEEP_LAST_TURNS = 1
+        const val DEFAULT_RESERVED_TOKENS = 512
+    }
+}
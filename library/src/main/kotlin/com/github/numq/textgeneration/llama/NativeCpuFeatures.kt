@@ -0,0 +1,14 @@
+package com.github.numq.textgeneration.llama
+
+internal class NativeCpuFeatures {
+    companion object {
+        @JvmStatic
+        private external fun detectVariantNative(): Int
+
+        fun detectVariant(): LlamaCpuVariant {
+            val nativeValue = detectVariantNative()
+
+            return LlamaCpuVariant.entries.first { variant -> variant.nativeValue == nativeValue }
+        }
+    }
+}
@@ -0,0 +1,5 @@
+package com.github.numq.textgeneration.llama
+
+internal fun interface NativeLlamaBatchCallback {
+    fun onResult(index: Int, output: String?, error: String?): Boolean
+}
@@ -0,0 +1,5 @@
+package com.github.numq.textgeneration.llama
+
+internal fun interface NativeLlamaLoadCallback {
+    fun onProgress(progress: Float): Boolean
+}
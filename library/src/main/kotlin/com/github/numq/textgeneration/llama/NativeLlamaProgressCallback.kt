@@ -0,0 +1,5 @@
+package com.github.numq.textgeneration.llama
+
+internal fun interface NativeLlamaProgressCallback {
+    fun onProgress(processed: Int, total: Int): Boolean
+}
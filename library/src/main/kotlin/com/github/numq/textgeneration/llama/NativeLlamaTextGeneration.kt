@@ -1,28 +1,79 @@
 package com.github.numq.textgeneration.llama
 
 import java.lang.ref.Cleaner
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.nio.FloatBuffer
+import kotlin.time.Duration.Companion.nanoseconds
 
-internal class NativeLlamaTextGeneration(modelPath: String, contextSize: Int, batchSize: Int) : AutoCloseable {
-    private val nativeHandle = initNative(
-        modelPath = modelPath,
-        contextSize = contextSize,
-        batchSize = batchSize
-    ).also { handle ->
-        require(handle != -1L) { "Unable to initialize native library" }
-    }
+internal class NativeLlamaTextGeneration private constructor(private val nativeHandle: Long) : AutoCloseable {
+    constructor(
+        modelPath: String,
+        contextSize: Int,
+        batchSize: Int,
+        microBatchSize: Int?,
+        cacheTypeK: LlamaCacheType,
+        cacheTypeV: LlamaCacheType,
+        flashAttention: Boolean,
+        threads: Int?,
+        batchThreads: Int?,
+        contextPoolSize: Int,
+        contextSizeClasses: List<Int>,
+        numaNode: Int?,
+        calibrate: Boolean,
+        modelParameters: LlamaModelParameters,
+        callback: NativeLlamaLoadCallback?,
+    ) : this(
+        initNative(
+            modelPath = modelPath,
+            contextSize = contextSize,
+            batchSize = batchSize,
+            microBatchSize = microBatchSize ?: 0,
+            cacheTypeK = cacheTypeK.nativeValue,
+            cacheTypeV = cacheTypeV.nativeValue,
+            flashAttention = flashAttention,
+            threads = threads ?: 0,
+            batchThreads = batchThreads ?: 0,
+            contextPoolSize = contextPoolSize,
+            contextSizeClasses = contextSizeClasses.toIntArray(),
+            numaNode = numaNode ?: -1,
+            calibrate = calibrate,
+            useMmap = modelParameters.useMmap,
+            useMlock = modelParameters.useMlock,
+            prefetch = modelParameters.prefetch,
+            warmup = modelParameters.warmup,
+            callback = callback
+        ).also { handle ->
+            require(handle != -1L) { "Unable to initialize native library" }
+        }
+    )
 
     private val cleanable = cleaner.register(this) { freeNative(nativeHandle) }
 
-    private companion object {
-        const val DEFAULT_TEMPERATURE = .98f
-        const val DEFAULT_TOP_P = .37f
-        const val DEFAULT_REPETITION_PENALTY = 1.18f
-        const val DEFAULT_TOP_K = 100
-
+    companion object {
         private val cleaner: Cleaner = Cleaner.create()
 
         @JvmStatic
-        private external fun initNative(modelPath: String, contextSize: Int, batchSize: Int): Long
+        private external fun initNative(
+            modelPath: String,
+            contextSize: Int,
+            batchSize: Int,
+            microBatchSize: Int,
+            cacheTypeK: Int,
+            cacheTypeV: Int,
+            flashAttention: Boolean,
+            threads: Int,
+            batchThreads: Int,
+            contextPoolSize: Int,
+            contextSizeClasses: IntArray,
+            numaNode: Int,
+            calibrate: Boolean,
+            useMmap: Boolean,
+            useMlock: Boolean,
+            prefetch: Boolean,
+            warmup: Boolean,
+            callback: NativeLlamaLoadCallback?,
+        ): Long
 
         @JvmStatic
         private external fun generateNative(
@@ -33,28 +84,497 @@ internal class NativeLlamaTextGeneration(modelPath: String, contextSize: Int, ba
             repetitionPenalty: Float,
             topK: Int,
             seed: Int,
+            maxTokens: Int,
+            truncate: Boolean,
+            keepSystemMessage: Boolean,
+            keepLastTurns: Int,
+            reservedTokens: Int,
+            adapter: Long,
+            adapterScale: Float,
+            controlVector: Long,
+            controlVectorScale: Float,
+            callback: NativeLlamaProgressCallback?,
+        ): String
+
+        @JvmStatic
+        private external fun prefillNative(
+            handle: Long,
+            messages: Array<NativeLlamaMessage>,
+            partialPrompt: String?,
+            callback: NativeLlamaProgressCallback?,
+        )
+
+        @JvmStatic
+        private external fun regenerateNative(
+            handle: Long,
+            messages: Array<NativeLlamaMessage>,
+            temperature: Float,
+            topP: Float,
+            repetitionPenalty: Float,
+            topK: Int,
+            seed: Int,
+            maxTokens: Int,
+            truncate: Boolean,
+            keepSystemMessage: Boolean,
+            keepLastTurns: Int,
+            reservedTokens: Int,
+            adapter: Long,
+            adapterScale: Float,
+            controlVector: Long,
+            controlVectorScale: Float,
+            callback: NativeLlamaProgressCallback?,
         ): String
 
+        @JvmStatic
+        private external fun editLastNative(
+            handle: Long,
+            messages: Array<NativeLlamaMessage>,
+            temperature: Float,
+            topP: Float,
+            repetitionPenalty: Float,
+            topK: Int,
+            seed: Int,
+            maxTokens: Int,
+            truncate: Boolean,
+            keepSystemMessage: Boolean,
+            keepLastTurns: Int,
+            reservedTokens: Int,
+            adapter: Long,
+            adapterScale: Float,
+            controlVector: Long,
+            controlVectorScale: Float,
+            callback: NativeLlamaProgressCallback?,
+        ): String
+
+        @JvmStatic
+        private external fun generateBatchNative(
+            handle: Long,
+            systemPrompt: String,
+            prompts: Array<String>,
+            temperature: Float,
+            topP: Float,
+            repetitionPenalty: Float,
+            topK: Int,
+            seed: Int,
+            maxTokens: Int,
+            parallelism: Int,
+            adapter: Long,
+            adapterScale: Float,
+            controlVector: Long,
+            controlVectorScale: Float,
+            callback: NativeLlamaBatchCallback,
+        )
+
+        @JvmStatic
+        private external fun getEmbeddingSizeNative(handle: Long): Int
+
+        @JvmStatic
+        private external fun embedNative(
+            handle: Long,
+            texts: Array<String>,
+            pooling: Int,
+            normalize: Boolean,
+            output: FloatBuffer,
+        )
+
+        @JvmStatic
+        private external fun scoreNative(
+            handle: Long,
+            systemPrompt: String,
+            prompt: String,
+            candidates: Array<String>,
+        ): FloatArray
+
+        @JvmStatic
+        private external fun completeNative(
+            handle: Long,
+            tokens: IntArray,
+            temperature: Float,
+            topP: Float,
+            repetitionPenalty: Float,
+            topK: Int,
+            seed: Int,
+            maxTokens: Int,
+            adapter: Long,
+            adapterScale: Float,
+            controlVector: Long,
+            controlVectorScale: Float,
+        ): String
+
+        @JvmStatic
+        private external fun getSnapshotSizeNative(handle: Long): Long
+
+        @JvmStatic
+        private external fun snapshotNative(handle: Long, buffer: ByteBuffer, offset: Long): Long
+
+        @JvmStatic
+        private external fun restoreNative(handle: Long, buffer: ByteBuffer, offset: Long, length: Long): Long
+
+        @JvmStatic
+        private external fun getMemoryUsageNative(handle: Long): LongArray
+
+        @JvmStatic
+        private external fun getLoadReportNative(handle: Long): LongArray
+
+        @JvmStatic
+        private external fun getConfigurationNative(handle: Long): IntArray
+
+        @JvmStatic
+        private external fun resetNative(handle: Long, systemPrompt: String)
+
+        @JvmStatic
+        private external fun setMaxResidentCellsNative(cells: Long)
+
+        @JvmStatic
+        private external fun initNumaNative(strategy: Int)
+
+        @JvmStatic
+        private external fun getCpuVariantNative(): Int
+
+        @JvmStatic
+        private external fun prepareModelNative(
+            handle: Long,
+            modelPath: String,
+            useMmap: Boolean,
+            useMlock: Boolean,
+            prefetch: Boolean,
+            warmup: Boolean,
+            callback: NativeLlamaLoadCallback?,
+        ): Long
+
+        @JvmStatic
+        private external fun swapModelNative(handle: Long, stagedHandle: Long)
+
+        @JvmStatic
+        private external fun loadAdapterNative(handle: Long, adapterPath: String): Long
+
+        @JvmStatic
+        private external fun freeAdapterNative(adapterHandle: Long)
+
+        @JvmStatic
+        private external fun loadControlVectorNative(handle: Long, controlVectorPath: String): Long
+
+        @JvmStatic
+        private external fun freeControlVectorNative(controlVectorHandle: Long)
+
+        @JvmStatic
+        private external fun quantizeNative(
+            inputPath: String,
+            outputPath: String,
+            type: Int,
+            callback: NativeLlamaLoadCallback?,
+        )
+
+        @JvmStatic
+        private external fun benchmarkNative(
+            modelPath: String,
+            text: String,
+            contextSize: Int,
+            batchSize: Int,
+            decodeTokens: Int,
+        ): DoubleArray
+
+        @JvmStatic
+        private external fun probeNative(modelPath: String, metadata: MutableMap<String, String>): LongArray
+
+        @JvmStatic
+        private external fun openConversationNative(handle: Long): Long
+
         @JvmStatic
         private external fun freeNative(handle: Long)
+
+        fun freeAdapter(adapterHandle: Long) = freeAdapterNative(adapterHandle = adapterHandle)
+
+        fun freeControlVector(controlVectorHandle: Long) = freeControlVectorNative(
+            controlVectorHandle = controlVectorHandle
+        )
+
+        fun quantize(
+            inputPath: String,
+            outputPath: String,
+            type: LlamaQuantizationType,
+            callback: NativeLlamaLoadCallback?,
+        ) = quantizeNative(inputPath = inputPath, outputPath = outputPath, type = type.nativeValue, callback = callback)
+
+        fun benchmark(modelPath: String, text: String, contextSize: Int, batchSize: Int, decodeTokens: Int) =
+            benchmarkNative(
+                modelPath = modelPath,
+                text = text,
+                contextSize = contextSize,
+                batchSize = batchSize,
+                decodeTokens = decodeTokens
+            ).let { (size, loadTime, prefillThroughput, decodeThroughput, perplexity) ->
+                LlamaBenchmark(
+                    size = size.toLong(),
+                    loadTime = loadTime.toLong().nanoseconds,
+                    prefillThroughput = prefillThroughput,
+                    decodeThroughput = decodeThroughput,
+                    perplexity = perplexity
+                )
+            }
+
+        fun probe(modelPath: String): LlamaModelInfo {
+            val metadata = mutableMapOf<String, String>()
+
+            val info = probeNative(modelPath = modelPath, metadata = metadata)
+
+            return LlamaModelInfo(
+                architecture = metadata["general.architecture"].orEmpty(),
+                trainContextSize = info[0].toInt(),
+                embeddingSize = info[1].toInt(),
+                layerCount = info[2].toInt(),
+                headCount = info[3].toInt(),
+                kvHeadCount = info[4].toInt(),
+                parameterCount = info[5],
+                size = info[6],
+                chatTemplate = metadata["tokenizer.chat_template"],
+                metadata = metadata
+            )
+        }
+
+        fun setSwapPolicy(policy: LlamaSwapPolicy?) = setMaxResidentCellsNative(
+            cells = policy?.maxResidentCells?.toLong() ?: 0L
+        )
+
+        fun initNuma(strategy: LlamaNumaStrategy) = initNumaNative(strategy = strategy.nativeValue)
+
+        fun getCpuVariant(): LlamaCpuVariant {
+            val nativeValue = getCpuVariantNative()
+
+            return LlamaCpuVariant.entries.first { variant -> variant.nativeValue == nativeValue }
+        }
     }
 
     fun generate(
         messages: Array<NativeLlamaMessage>,
-        temperature: Float = DEFAULT_TEMPERATURE,
-        topP: Float = DEFAULT_TOP_P,
-        repetitionPenalty: Float = DEFAULT_REPETITION_PENALTY,
-        topK: Int = DEFAULT_TOP_K,
-        seed: Int = 0,
+        parameters: LlamaGenerationParameters,
+        truncationPolicy: LlamaTruncationPolicy?,
+        callback: NativeLlamaProgressCallback?,
     ) = generateNative(
         handle = nativeHandle,
         messages = messages,
-        temperature = temperature,
-        topP = topP,
-        repetitionPenalty = repetitionPenalty,
-        topK = topK,
-        seed = seed
+        temperature = parameters.temperature,
+        topP = parameters.topP,
+        repetitionPenalty = parameters.repetitionPenalty,
+        topK = parameters.topK,
+        seed = parameters.seed,
+        maxTokens = parameters.maxTokens ?: -1,
+        truncate = truncationPolicy != null,
+        keepSystemMessage = truncationPolicy?.keepSystemMessage ?: true,
+        keepLastTurns = truncationPolicy?.keepLastTurns ?: 0,
+        reservedTokens = truncationPolicy?.reservedTokens ?: 0,
+        adapter = parameters.adapter?.handle ?: 0L,
+        adapterScale = parameters.adapterScale,
+        controlVector = parameters.controlVector?.handle ?: 0L,
+        controlVectorScale = parameters.controlVectorScale,
+        callback = callback
     )
 
+    fun prefill(
+        messages: Array<NativeLlamaMessage>,
+        partialPrompt: String?,
+        callback: NativeLlamaProgressCallback?,
+    ) = prefillNative(
+        handle = nativeHandle,
+        messages = messages,
+        partialPrompt = partialPrompt,
+        callback = callback
+    )
+
+    fun regenerate(
+        messages: Array<NativeLlamaMessage>,
+        parameters: LlamaGenerationParameters,
+        truncationPolicy: LlamaTruncationPolicy?,
+        callback: NativeLlamaProgressCallback?,
+    ) = regenerateNative(
+        handle = nativeHandle,
+        messages = messages,
+        temperature = parameters.temperature,
+        topP = parameters.topP,
+        repetitionPenalty = parameters.repetitionPenalty,
+        topK = parameters.topK,
+        seed = parameters.seed,
+        maxTokens = parameters.maxTokens ?: -1,
+        truncate = truncationPolicy != null,
+        keepSystemMessage = truncationPolicy?.keepSystemMessage ?: true,
+        keepLastTurns = truncationPolicy?.keepLastTurns ?: 0,
+        reservedTokens = truncationPolicy?.reservedTokens ?: 0,
+        adapter = parameters.adapter?.handle ?: 0L,
+        adapterScale = parameters.adapterScale,
+        controlVector = parameters.controlVector?.handle ?: 0L,
+        controlVectorScale = parameters.controlVectorScale,
+        callback = callback
+    )
+
+    fun editLast(
+        messages: Array<NativeLlamaMessage>,
+        parameters: LlamaGenerationParameters,
+        truncationPolicy: LlamaTruncationPolicy?,
+        callback: NativeLlamaProgressCallback?,
+    ) = editLastNative(
+        handle = nativeHandle,
+        messages = messages,
+        temperature = parameters.temperature,
+        topP = parameters.topP,
+        repetitionPenalty = parameters.repetitionPenalty,
+        topK = parameters.topK,
+        seed = parameters.seed,
+        maxTokens = parameters.maxTokens ?: -1,
+        truncate = truncationPolicy != null,
+        keepSystemMessage = truncationPolicy?.keepSystemMessage ?: true,
+        keepLastTurns = truncationPolicy?.keepLastTurns ?: 0,
+        reservedTokens = truncationPolicy?.reservedTokens ?: 0,
+        adapter = parameters.adapter?.handle ?: 0L,
+        adapterScale = parameters.adapterScale,
+        controlVector = parameters.controlVector?.handle ?: 0L,
+        controlVectorScale = parameters.controlVectorScale,
+        callback = callback
+    )
+
+    fun generateBatch(
+        systemPrompt: String,
+        prompts: Array<String>,
+        parameters: LlamaGenerationParameters,
+        parallelism: Int,
+        callback: NativeLlamaBatchCallback,
+    ) = generateBatchNative(
+        handle = nativeHandle,
+        systemPrompt = systemPrompt,
+        prompts = prompts,
+        temperature = parameters.temperature,
+        topP = parameters.topP,
+        repetitionPenalty = parameters.repetitionPenalty,
+        topK = parameters.topK,
+        seed = parameters.seed,
+        maxTokens = parameters.maxTokens ?: -1,
+        parallelism = parallelism,
+        adapter = parameters.adapter?.handle ?: 0L,
+        adapterScale = parameters.adapterScale,
+        controlVector = parameters.controlVector?.handle ?: 0L,
+        controlVectorScale = parameters.controlVectorScale,
+        callback = callback
+    )
+
+    val embeddingSize get() = getEmbeddingSizeNative(handle = nativeHandle)
+
+    fun embed(texts: Array<String>, pooling: LlamaPooling, normalize: Boolean): FloatBuffer {
+        val output = ByteBuffer.allocateDirect(texts.size * embeddingSize * Float.SIZE_BYTES)
+            .order(ByteOrder.nativeOrder())
+            .asFloatBuffer()
+
+        embedNative(
+            handle = nativeHandle,
+            texts = texts,
+            pooling = pooling.nativeValue,
+            normalize = normalize,
+            output = output
+        )
+
+        return output
+    }
+
+    fun score(systemPrompt: String, prompt: String, candidates: Array<String>) = scoreNative(
+        handle = nativeHandle,
+        systemPrompt = systemPrompt,
+        prompt = prompt,
+        candidates = candidates
+    )
+
+    fun complete(tokens: IntArray, parameters: LlamaGenerationParameters) = completeNative(
+        handle = nativeHandle,
+        tokens = tokens,
+        temperature = parameters.temperature,
+        topP = parameters.topP,
+        repetitionPenalty = parameters.repetitionPenalty,
+        topK = parameters.topK,
+        seed = parameters.seed,
+        maxTokens = parameters.maxTokens ?: -1,
+        adapter = parameters.adapter?.handle ?: 0L,
+        adapterScale = parameters.adapterScale,
+        controlVector = parameters.controlVector?.handle ?: 0L,
+        controlVectorScale = parameters.controlVectorScale
+    )
+
+    val snapshotSize get() = Math.toIntExact(getSnapshotSizeNative(handle = nativeHandle))
+
+    fun snapshot(buffer: ByteBuffer, offset: Int) = snapshotNative(
+        handle = nativeHandle,
+        buffer = buffer,
+        offset = offset.toLong()
+    ).toInt()
+
+    fun restore(buffer: ByteBuffer, offset: Int, length: Int) = restoreNative(
+        handle = nativeHandle,
+        buffer = buffer,
+        offset = offset.toLong(),
+        length = length.toLong()
+    ).toInt()
+
+    val memoryUsage
+        get() = getMemoryUsageNative(handle = nativeHandle).let { (modelSize, kvCacheSize, computeBufferSize) ->
+            LlamaMemoryUsage(modelSize = modelSize, kvCacheSize = kvCacheSize, computeBufferSize = computeBufferSize)
+        }
+
+    val loadReport
+        get() = getLoadReportNative(handle = nativeHandle).let { (splitCount, size, readTime, loadTime) ->
+            LlamaLoadReport(
+                splitCount = splitCount.toInt(),
+                size = size,
+                readTime = readTime.nanoseconds,
+                loadTime = loadTime.nanoseconds
+            )
+        }
+
+    val configuration
+        get() = getConfigurationNative(handle = nativeHandle).let { configuration ->
+            LlamaConfiguration(
+                contextSize = configuration[0],
+                batchSize = configuration[1],
+                microBatchSize = configuration[2],
+                threads = configuration[3],
+                batchThreads = configuration[4]
+            )
+        }
+
+    fun reset(systemPrompt: String) = resetNative(handle = nativeHandle, systemPrompt = systemPrompt)
+
+    fun prepareModel(
+        modelPath: String,
+        modelParameters: LlamaModelParameters,
+        callback: NativeLlamaLoadCallback?,
+    ) = prepareModelNative(
+        handle = nativeHandle,
+        modelPath = modelPath,
+        useMmap = modelParameters.useMmap,
+        useMlock = modelParameters.useMlock,
+        prefetch = modelParameters.prefetch,
+        warmup = modelParameters.warmup,
+        callback = callback
+    ).also { stagedHandle ->
+        require(stagedHandle != -1L) { "Unable to prepare model" }
+    }
+
+    fun loadAdapter(adapterPath: String) = loadAdapterNative(
+        handle = nativeHandle,
+        adapterPath = adapterPath
+    ).also { adapterHandle ->
+        require(adapterHandle != -1L) { "Unable to load adapter" }
+    }.let(::LlamaAdapter)
+
+    fun loadControlVector(controlVectorPath: String) = loadControlVectorNative(
+        handle = nativeHandle,
+        controlVectorPath = controlVectorPath
+    ).also { controlVectorHandle ->
+        require(controlVectorHandle != -1L) { "Unable to load control vector" }
+    }.let(::LlamaControlVector)
+
+    fun openConversation() = NativeLlamaTextGeneration(
+        openConversationNative(handle = nativeHandle).also { handle ->
+            require(handle != -1L) { "Unable to open conversation" }
+        }
+    )
+
+    fun swapModel(stagedHandle: Long) = swapModelNative(handle = nativeHandle, stagedHandle = stagedHandle)
+
     override fun close() = cleanable.clean()
-}
\ No newline at end of file
+}
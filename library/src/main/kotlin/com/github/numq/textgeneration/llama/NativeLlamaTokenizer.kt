@@ -0,0 +1,51 @@
+package com.github.numq.textgeneration.llama
+
+import java.lang.ref.Cleaner
+
+internal class NativeLlamaTokenizer(modelPath: String) : AutoCloseable {
+    private val nativeHandle = initNative(modelPath = modelPath).also { handle ->
+        require(handle != -1L) { "Unable to initialize native library" }
+    }
+
+    private val cleanable = cleaner.register(this) { freeNative(nativeHandle) }
+
+    private companion object {
+        private val cleaner: Cleaner = Cleaner.create()
+
+        @JvmStatic
+        private external fun initNative(modelPath: String): Long
+
+        @JvmStatic
+        private external fun tokenizeNative(
+            handle: Long,
+            texts: Array<String>,
+            addSpecial: Boolean,
+            offsets: IntArray,
+        ): IntArray
+
+        @JvmStatic
+        private external fun countTokensNative(handle: Long, texts: Array<String>, addSpecial: Boolean): IntArray
+
+        @JvmStatic
+        private external fun detokenizeNative(handle: Long, tokens: IntArray, removeSpecial: Boolean): String
+
+        @JvmStatic
+        private external fun freeNative(handle: Long)
+    }
+
+    fun tokenize(texts: Array<String>, addSpecial: Boolean): LlamaTokenBatch {
+        val offsets = IntArray(texts.size + 1)
+
+        val tokens = tokenizeNative(handle = nativeHandle, texts = texts, addSpecial = addSpecial, offsets = offsets)
+
+        return LlamaTokenBatch(tokens = tokens, offsets = offsets)
+    }
+
+    fun countTokens(texts: Array<String>, addSpecial: Boolean) =
+        countTokensNative(handle = nativeHandle, texts = texts, addSpecial = addSpecial)
+
+    fun detokenize(tokens: IntArray, removeSpecial: Boolean) =
+        detokenizeNative(handle = nativeHandle, tokens = tokens, removeSpecial = removeSpecial)
+
+    override fun close() = cleanable.clean()
+}
@@ -1,8 +1,30 @@
 import com.github.numq.textgeneration.TextGeneration
+import com.github.numq.textgeneration.Tokenizer
+import com.github.numq.textgeneration.index.VectorIndex
+import com.github.numq.textgeneration.llama.LlamaCacheType
+import com.github.numq.textgeneration.llama.LlamaGenerationParameters
+import com.github.numq.textgeneration.llama.LlamaMessage
+import com.github.numq.textgeneration.llama.LlamaPrefillProgress
+import com.github.numq.textgeneration.llama.LlamaQuantizationType
+import com.github.numq.textgeneration.llama.LlamaSwapPolicy
+import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.async
+import kotlinx.coroutines.flow.onEach
+import kotlinx.coroutines.flow.toList
 import kotlinx.coroutines.test.runTest
 import org.junit.jupiter.api.AfterAll
 import org.junit.jupiter.api.BeforeAll
+import java.io.File
+import java.io.FileOutputStream
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.nio.channels.FileChannel
+import kotlin.io.path.createTempDirectory
+import kotlin.math.abs
 import kotlin.test.Test
+import kotlin.test.assertEquals
+import kotlin.test.assertNotEquals
 import kotlin.test.assertTrue
 
 class TextGenerationTest {
@@ -36,10 +58,861 @@ class TextGenerationTest {
         }
     }
 
+    private fun writeGguf(file: File, metadata: Map<String, String>, tensors: Map<String, Pair<LongArray, FloatArray>>) {
+        val alignment = 32
+
+        val stringsSize = (metadata.keys + metadata.values + tensors.keys).sumOf { string ->
+            Long.SIZE_BYTES + string.encodeToByteArray().size
+        }
+
+        val infoSize = Int.SIZE_BYTES * 2 + Long.SIZE_BYTES * 2 + stringsSize + metadata.size * Int.SIZE_BYTES +
+                tensors.values.sumOf { (shape, _) -> Int.SIZE_BYTES * 2 + Long.SIZE_BYTES * (shape.size + 1) }
+
+        val dataSizes = tensors.values.map { (_, data) ->
+            (data.size * Float.SIZE_BYTES + alignment - 1) / alignment * alignment
+        }
+
+        val buffer = ByteBuffer.allocate((infoSize + alignment - 1) / alignment * alignment + dataSizes.sum())
+            .order(ByteOrder.LITTLE_ENDIAN)
+
+        fun putString(string: String) = string.encodeToByteArray().let { bytes ->
+            buffer.putLong(bytes.size.toLong()).put(bytes)
+        }
+
+        buffer.putInt(0x46554747).putInt(3).putLong(tensors.size.toLong()).putLong(metadata.size.toLong())
+
+        metadata.forEach { (key, value) ->
+            putString(key)
+            buffer.putInt(8)
+            putString(value)
+        }
+
+        var offset = 0L
+
+        tensors.entries.forEachIndexed { index, (name, tensor) ->
+            putString(name)
+            buffer.putInt(tensor.first.size)
+            tensor.first.forEach { dimension -> buffer.putLong(dimension) }
+            buffer.putInt(0)
+            buffer.putLong(offset)
+
+            offset += dataSizes[index]
+        }
+
+        buffer.position((buffer.position() + alignment - 1) / alignment * alignment)
+
+        tensors.values.forEachIndexed { index, (_, data) ->
+            val start = buffer.position()
+
+            data.forEach { value -> buffer.putFloat(value) }
+
+            buffer.position(start + dataSizes[index])
+        }
+
+        file.writeBytes(buffer.array())
+    }
+
+    private fun splitGguf(source: File, directory: File, splitCount: Int): List<File> {
+        val valueSizes = mapOf(0 to 1, 1 to 1, 2 to 2, 3 to 2, 4 to 4, 5 to 4, 6 to 4, 7 to 1, 10 to 8, 11 to 8, 12 to 8)
+
+        val input = FileChannel.open(source.toPath()).use { channel ->
+            channel.map(FileChannel.MapMode.READ_ONLY, 0, channel.size())
+        }.order(ByteOrder.LITTLE_ENDIAN)
+
+        fun readString() = ByteArray(input.long.toInt()).also(input::get).decodeToString()
+
+        fun skipValue(type: Int) {
+            when (type) {
+                8 -> input.position(input.position() + input.long.toInt())
+
+                9 -> {
+                    val elementType = input.int
+
+                    repeat(input.long.toInt()) { skipValue(elementType) }
+                }
+
+                else -> input.position(input.position() + valueSizes.getValue(type))
+            }
+        }
+
+        input.position(Int.SIZE_BYTES * 2)
+
+        val tensorCount = input.long.toInt()
+
+        val kvCount = input.long
+
+        val kvStart = input.position()
+
+        var alignment = 32
+
+        repeat(kvCount.toInt()) {
+            val key = readString()
+
+            val type = input.int
+
+            if (key == "general.alignment") {
+                alignment = input.getInt(input.position())
+            }
+
+            skipValue(type)
+        }
+
+        val kvEnd = input.position()
+
+        val tensors = List(tensorCount) {
+            val infoStart = input.position()
+
+            input.position(input.position() + input.long.toInt())
+
+            val nDims = input.int
+
+            input.position(input.position() + nDims * Long.SIZE_BYTES + Int.SIZE_BYTES)
+
+            val infoEnd = input.position()
+
+            infoStart until infoEnd to input.long
+        }.sortedBy { (_, offset) -> offset }
+
+        val dataStart = (input.position() + alignment - 1) / alignment * alignment
+
+        val groups = tensors.chunked((tensorCount + splitCount - 1) / splitCount)
+
+        return groups.mapIndexed { index, group ->
+            val dataEnd = groups.getOrNull(index + 1)?.first()?.second ?: (input.capacity() - dataStart).toLong()
+
+            val groupStart = group.first().second
+
+            val splitKeys = listOf("split.no" to index, "split.count" to splitCount, "split.tensors.count" to tensorCount)
+
+            val header = ByteBuffer.allocate(
+                Int.SIZE_BYTES * 2 + Long.SIZE_BYTES * 2 + (if (index == 0) kvEnd - kvStart else 0) +
+                        splitKeys.sumOf { (key, _) -> Long.SIZE_BYTES + key.length + Int.SIZE_BYTES * 2 } +
+                        group.sumOf { (info, _) -> info.last - info.first + 1 + Long.SIZE_BYTES } + alignment
+            ).order(ByteOrder.LITTLE_ENDIAN)
+
+            header.putInt(0x46554747).putInt(3).putLong(group.size.toLong())
+
+            header.putLong(splitKeys.size + if (index == 0) kvCount else 0L)
+
+            if (index == 0) {
+                header.put(input.duplicate().position(kvStart).limit(kvEnd))
+            }
+
+            splitKeys.forEach { (key, value) ->
+                header.putLong(key.length.toLong()).put(key.encodeToByteArray())
+
+                if (key == "split.tensors.count") header.putInt(5).putInt(value) else header.putInt(2).putShort(value.toShort())
+            }
+
+            group.forEach { (info, offset) ->
+                header.put(input.duplicate().position(info.first).limit(info.last + 1))
+
+                header.putLong(offset - groupStart)
+            }
+
+            header.position((header.position() + alignment - 1) / alignment * alignment).flip()
+
+            File(directory, "model-%05d-of-%05d.gguf".format(index + 1, splitCount)).apply {
+                FileOutputStream(this).channel.use { output ->
+                    val data = input.duplicate().position(dataStart + groupStart.toInt()).limit(dataStart + dataEnd.toInt())
+
+                    listOf(header, data).forEach { buffer ->
+                        while (buffer.hasRemaining()) output.write(buffer)
+                    }
+                }
+            }
+        }
+    }
+
     @Test
     fun `should return non-blank output string`() = runTest {
         val result = llama.generate("What is Python?").getOrThrow()
 
         assertTrue(result.output.content.contains("programming language"))
     }
-}
\ No newline at end of file
+
+    @Test
+    fun `should truncate a history longer than the context`() = runTest {
+        val prompt = "Tell me about Python, a programming language used for web development, data analysis and automation."
+
+        val parameters = LlamaGenerationParameters(maxTokens = 32)
+
+        TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256).getOrThrow().use { llama ->
+            repeat(8) {
+                assertTrue(llama.generate(prompt, parameters).getOrThrow().output.content.isNotBlank())
+            }
+
+            assertEquals(1 + 2 * 8, llama.history().getOrThrow().size)
+        }
+
+        TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256, truncationPolicy = null).getOrThrow()
+            .use { llama ->
+                val failure = List(8) { llama.generate(prompt, parameters) }.firstNotNullOfOrNull { result ->
+                    result.exceptionOrNull()
+                }
+
+                assertEquals("Context size exceeded", failure?.message)
+
+                assertTrue(llama.history().getOrThrow().size < 1 + 2 * 8)
+            }
+    }
+
+    @Test
+    fun `should replace the last exchange and start over after reset`() = runTest {
+        val parameters = LlamaGenerationParameters(maxTokens = 64)
+
+        llama.generate("What is Python?", parameters).getOrThrow()
+
+        val regenerated = llama.regenerate(parameters).getOrThrow()
+
+        val edited = llama.editLast("What is Kotlin?", parameters).getOrThrow()
+
+        assertEquals("What is Python?", regenerated.input.content)
+
+        assertEquals(listOf(edited.input, edited.output), llama.history().getOrThrow().takeLast(2))
+
+        llama.reset().getOrThrow()
+
+        assertEquals(1, llama.history().getOrThrow().size)
+
+        assertTrue(llama.generate("What is C++?", parameters).getOrThrow().output.content.isNotBlank())
+    }
+
+    @Test
+    fun `should restore the conversation from a snapshot`() = runTest {
+        llama.generate("What is Python?", LlamaGenerationParameters(maxTokens = 64)).getOrThrow()
+
+        val history = llama.history().getOrThrow()
+
+        val buffer = ByteBuffer.allocateDirect(llama.snapshotSize().getOrThrow())
+
+        llama.snapshot(buffer).getOrThrow()
+
+        llama.reset().getOrThrow()
+
+        llama.restore(buffer.flip()).getOrThrow()
+
+        assertEquals(history, llama.history().getOrThrow())
+
+        assertEquals(0, buffer.remaining())
+    }
+
+    @Test
+    fun `should restore a snapshot larger than the context of a conversation`() = runTest {
+        TextGeneration.Llama.create(
+            modelPath = modelPath,
+            contextSize = 1024,
+            contextSizeClasses = listOf(256, 512)
+        ).getOrThrow().use { llama ->
+            val document = List(24) { "Python is a programming language used for web development." }.joinToString(" ")
+
+            val buffer = llama.openConversation().getOrThrow().use { conversation ->
+                conversation.prefill(listOf(LlamaMessage.Input(document))).getOrThrow()
+
+                ByteBuffer.allocateDirect(conversation.snapshotSize().getOrThrow()).also { buffer ->
+                    conversation.snapshot(buffer).getOrThrow()
+                }
+            }
+
+            llama.openConversation().getOrThrow().use { conversation ->
+                conversation.restore(buffer.duplicate().flip()).getOrThrow()
+
+                assertEquals(512, conversation.configuration().getOrThrow().contextSize)
+
+                assertEquals(document, conversation.history().getOrThrow().last().content)
+            }
+
+            val truncated = buffer.duplicate().flip().limit(buffer.position() - 1)
+
+            assertTrue(llama.restore(truncated).isFailure)
+        }
+    }
+
+    @Test
+    fun `should report loading of the model`() = runTest {
+        val report = llama.loadReport().getOrThrow()
+
+        assertTrue(report.splitCount == 1 && report.size > 0 && report.throughput > 0)
+    }
+
+    @Test
+    fun `should load a model split into several files from any of them`() = runTest {
+        val directory = createTempDirectory().toFile()
+
+        try {
+            val splits = splitGguf(source = File(modelPath), directory = directory, splitCount = 4)
+
+            val info = TextGeneration.Llama.probe(modelPath = splits[2].path).getOrThrow()
+
+            assertEquals(splits.sumOf(File::length), info.size)
+
+            assertEquals(TextGeneration.Llama.probe(modelPath = modelPath).getOrThrow().parameterCount, info.parameterCount)
+
+            TextGeneration.Llama.create(modelPath = splits[2].path, contextSize = 256).getOrThrow().use { split ->
+                assertEquals(4, split.loadReport().getOrThrow().splitCount)
+
+                assertTrue(split.generate("What is Python?", LlamaGenerationParameters(maxTokens = 8)).isSuccess)
+            }
+
+            splits.last().delete()
+
+            val missing = TextGeneration.Llama.probe(modelPath = splits.first().path).exceptionOrNull()
+
+            assertTrue(missing?.message.orEmpty().startsWith("Missing model split"))
+        } finally {
+            directory.deleteRecursively()
+        }
+    }
+
+    @Test
+    fun `should probe the model and fit a context into the memory budget`() = runTest {
+        val info = TextGeneration.Llama.probe(modelPath = modelPath).getOrThrow()
+
+        assertTrue(info.trainContextSize > 0 && info.layerCount > 0 && info.parameterCount > 0)
+
+        val configuration = info.autoConfiguration(memoryBudget = info.size + (1L shl 30))
+
+        assertTrue(configuration.contextSize in 512..info.trainContextSize)
+    }
+
+    @Test
+    fun `should benchmark the model`() = runTest {
+        val benchmark = TextGeneration.Llama.benchmark(
+            modelPath = modelPath,
+            text = "Python is a programming language. It is used for web development, data analysis and automation.",
+            contextSize = 128,
+            decodeTokens = 8
+        ).getOrThrow()
+
+        assertTrue(benchmark.size > 0 && benchmark.prefillThroughput > 0 && benchmark.decodeThroughput > 0)
+
+        assertTrue(benchmark.perplexity > 1)
+    }
+
+    @Test
+    fun `should quantize the model and generate with the result`() = runTest {
+        val output = File.createTempFile("model", ".gguf").apply { deleteOnExit() }
+
+        val progress = mutableListOf<Float>()
+
+        TextGeneration.Llama.quantize(
+            inputPath = modelPath,
+            outputPath = output.path,
+            type = LlamaQuantizationType.Q4_0,
+            onProgress = progress::add
+        ).getOrThrow()
+
+        assertTrue(output.length() in 1 until File(modelPath).length())
+
+        assertTrue(progress.zipWithNext().all { (previous, next) -> previous <= next })
+
+        assertEquals(1f, progress.last())
+
+        TextGeneration.Llama.create(modelPath = output.path).getOrThrow().use { quantized ->
+            assertTrue(quantized.generate("What is Python?").getOrThrow().output.content.isNotBlank())
+        }
+
+        assertTrue(
+            TextGeneration.Llama.quantize(
+                inputPath = "missing.gguf",
+                outputPath = output.path,
+                type = LlamaQuantizationType.Q4_0
+            ).isFailure
+        )
+    }
+
+    @Test
+    fun `should swap out an idle instance and restore its conversation on the next use`() = runTest {
+        val document = "Python is a programming language. It is used for web development, data analysis, machine " +
+                "learning, scripting and automation, and it is known for its readable syntax."
+
+        val parameters = LlamaGenerationParameters(maxTokens = 16)
+
+        TextGeneration.Llama.setSwapPolicy(LlamaSwapPolicy(maxResidentCells = 64)).getOrThrow()
+
+        try {
+            TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256).getOrThrow().use { first ->
+                TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256).getOrThrow().use { second ->
+                    val progress = mutableListOf<LlamaPrefillProgress>()
+
+                    first.generate(document, parameters, onProgress = progress::add).getOrThrow()
+
+                    val documentTokens = progress.last().totalTokens
+
+                    second.generate(document, parameters).getOrThrow()
+
+                    progress.clear()
+
+                    val result = first.generate("What is it used for?", parameters, onProgress = progress::add)
+                        .getOrThrow()
+
+                    assertTrue(result.output.content.isNotBlank())
+
+                    assertTrue(progress.last().totalTokens < documentTokens)
+
+                    assertEquals(5, first.history().getOrThrow().size)
+                }
+            }
+        } finally {
+            TextGeneration.Llama.setSwapPolicy(null).getOrThrow()
+        }
+    }
+
+    @Test
+    fun `should calibrate a valid configuration`() = runTest {
+        TextGeneration.Llama.create(modelPath = modelPath, contextSize = 512, batchSize = 512, calibrate = true)
+            .getOrThrow().use { llama ->
+                val configuration = llama.configuration().getOrThrow()
+
+                assertEquals(512, configuration.contextSize)
+
+                assertTrue(configuration.batchSize in 1..512)
+
+                assertTrue(configuration.microBatchSize in 1..configuration.batchSize)
+
+                assertTrue(configuration.threads > 0 && configuration.batchThreads > 0)
+
+                val result = llama.generate("What is Python?", LlamaGenerationParameters(maxTokens = 16)).getOrThrow()
+
+                assertTrue(result.output.content.isNotBlank())
+            }
+    }
+
+    @Test
+    fun `should report memory usage`() = runTest {
+        val usage = llama.memoryUsage().getOrThrow()
+
+        assertTrue(usage.modelSize > 0 && usage.kvCacheSize > 0 && usage.computeBufferSize > 0)
+    }
+
+    @Test
+    fun `should generate with quantized caches that take less memory`() = runTest {
+        val kvCacheSizes = listOf(LlamaCacheType.F16, LlamaCacheType.Q8_0, LlamaCacheType.Q4_0).map { cacheType ->
+            TextGeneration.Llama.create(
+                modelPath = modelPath,
+                contextSize = 256,
+                cacheTypeK = cacheType,
+                cacheTypeV = cacheType,
+                flashAttention = true
+            ).getOrThrow().use { llama ->
+                val result = llama.generate("What is Python?", LlamaGenerationParameters(maxTokens = 16)).getOrThrow()
+
+                assertTrue(result.output.content.isNotBlank())
+
+                llama.memoryUsage().getOrThrow().kvCacheSize
+            }
+        }
+
+        assertTrue(kvCacheSizes.zipWithNext().all { (larger, smaller) -> larger > smaller })
+
+        val result = TextGeneration.Llama.create(
+            modelPath = modelPath,
+            contextSize = 256,
+            cacheTypeV = LlamaCacheType.Q8_0,
+            flashAttention = false
+        )
+
+        result.onSuccess { it.close() }
+
+        val exception = result.exceptionOrNull()
+
+        assertTrue(exception is IllegalArgumentException)
+
+        assertEquals("Quantized V cache requires flash attention", exception.message)
+    }
+
+    @Test
+    fun `should report prefill progress up to the whole prompt`() = runTest {
+        val progress = mutableListOf<LlamaPrefillProgress>()
+
+        llama.generate("What is Python?", LlamaGenerationParameters(maxTokens = 16), onProgress = progress::add)
+            .getOrThrow()
+
+        assertTrue(progress.isNotEmpty())
+
+        assertTrue(progress.zipWithNext().all { (previous, next) -> previous.processedTokens < next.processedTokens })
+
+        assertEquals(progress.last().totalTokens, progress.last().processedTokens)
+    }
+
+    @Test
+    fun `should generate after prefilling a document and a partial prompt`() = runTest {
+        llama.reset().getOrThrow()
+
+        llama.prefill(listOf(LlamaMessage.Input("Python is a programming language."))).getOrThrow()
+
+        llama.prefill("What is").getOrThrow()
+
+        val result = llama.generate("What is Python?", LlamaGenerationParameters(maxTokens = 64)).getOrThrow()
+
+        assertTrue(result.output.content.isNotBlank())
+
+        assertEquals(4, llama.history().getOrThrow().size)
+    }
+
+    @Test
+    fun `should keep the history and generate after swapping the model`() = runTest {
+        llama.generate("What is Python?", LlamaGenerationParameters(maxTokens = 16)).getOrThrow()
+
+        val history = llama.history().getOrThrow()
+
+        llama.swapModel(modelPath = modelPath).getOrThrow()
+
+        assertEquals(history, llama.history().getOrThrow())
+
+        val result = llama.generate("What is Kotlin?", LlamaGenerationParameters(maxTokens = 16)).getOrThrow()
+
+        assertTrue(result.output.content.isNotBlank())
+    }
+
+    @Test
+    fun `should swap the model while a batch is running`() = runTest {
+        TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256).getOrThrow().use { llama ->
+            val prompts = List(8) { index -> "What is ${index + 1} plus ${index + 1}?" }
+
+            val started = CompletableDeferred<Unit>()
+
+            val batch = async(Dispatchers.IO) {
+                llama.generateBatch(prompts, LlamaGenerationParameters(maxTokens = 64), parallelism = 2)
+                    .onEach { started.complete(Unit) }
+                    .toList()
+            }
+
+            started.await()
+
+            llama.swapModel(modelPath = modelPath).getOrThrow()
+
+            val results = batch.await()
+
+            assertEquals(prompts.indices.toList(), results.map { it.index }.sorted())
+
+            assertTrue(results.all { it.output.getOrThrow().content.isNotBlank() })
+
+            val result = llama.generate("What is Python?", LlamaGenerationParameters(maxTokens = 16)).getOrThrow()
+
+            assertTrue(result.output.content.isNotBlank())
+        }
+    }
+
+    @Test
+    fun `should generate in conversations opened on the same model`() = runTest {
+        val history = llama.history().getOrThrow()
+
+        repeat(2) {
+            llama.openConversation(systemPrompt = "You are a helpful assistant.").getOrThrow().use { conversation ->
+                val result = conversation.generate("What is Python?", LlamaGenerationParameters(maxTokens = 16))
+                    .getOrThrow()
+
+                assertTrue(result.output.content.isNotBlank())
+
+                assertEquals(3, conversation.history().getOrThrow().size)
+            }
+        }
+
+        assertEquals(history, llama.history().getOrThrow())
+    }
+
+    @Test
+    fun `should keep the binaries loaded after closing a conversation and an instance`() = runTest {
+        llama.openConversation().getOrThrow().close()
+
+        TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256).getOrThrow().use { instance ->
+            assertTrue(instance.generate("What is Python?", LlamaGenerationParameters(maxTokens = 8)).isSuccess)
+        }
+
+        TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256).getOrThrow().close()
+
+        Tokenizer.Llama.create(modelPath = modelPath).getOrThrow().close()
+
+        assertTrue(TextGeneration.Llama.probe(modelPath = modelPath).isSuccess)
+
+        assertTrue(llama.generate("What is Python?", LlamaGenerationParameters(maxTokens = 8)).isSuccess)
+    }
+
+    @Test
+    fun `should move a conversation to a larger size class as its prompt grows`() = runTest {
+        TextGeneration.Llama.create(
+            modelPath = modelPath,
+            contextSize = 1024,
+            contextSizeClasses = listOf(256, 512)
+        ).getOrThrow().use { llama ->
+            llama.openConversation().getOrThrow().use { conversation ->
+                assertEquals(256, conversation.configuration().getOrThrow().contextSize)
+
+                val document = List(24) { "Python is a programming language used for web development." }
+                    .joinToString(" ")
+
+                conversation.prefill(listOf(LlamaMessage.Input(document))).getOrThrow()
+
+                assertEquals(512, conversation.configuration().getOrThrow().contextSize)
+
+                val result = conversation.generate("What is Python?", LlamaGenerationParameters(maxTokens = 16))
+                    .getOrThrow()
+
+                assertTrue(result.output.content.isNotBlank())
+
+                assertEquals(4, conversation.history().getOrThrow().size)
+            }
+        }
+    }
+
+    @Test
+    fun `should reject an invalid NUMA node`() = runTest {
+        val negative = TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256, numaNode = -1)
+
+        negative.onSuccess { it.close() }
+
+        val exception = negative.exceptionOrNull()
+
+        assertTrue(exception is IllegalArgumentException)
+
+        assertEquals("NUMA node should not be negative", exception.message)
+
+        val missing = TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256, numaNode = 4096)
+
+        missing.onSuccess { it.close() }
+
+        assertTrue(missing.exceptionOrNull()?.message.orEmpty().startsWith("NUMA node"))
+    }
+
+    @Test
+    fun `should return output for every prompt of a batch`() = runTest {
+        val prompts = listOf("What is Python?", "What is Kotlin?", "What is C++?")
+
+        val history = llama.history().getOrThrow()
+
+        val results = llama.generateBatch(prompts, LlamaGenerationParameters(maxTokens = 64)).toList()
+
+        assertEquals(prompts.indices.toList(), results.map { it.index }.sorted())
+
+        assertTrue(results.all { it.output.getOrThrow().content.isNotBlank() })
+
+        assertEquals(history, llama.history().getOrThrow())
+    }
+
+    @Test
+    fun `should generate a batch with more sequences than fit into one decode`() = runTest {
+        TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256, batchSize = 4).getOrThrow().use { llama ->
+            val prompts = List(6) { index -> "What is ${index + 1} plus ${index + 1}?" }
+
+            repeat(2) {
+                val results = llama.generateBatch(prompts, LlamaGenerationParameters(maxTokens = 8), parallelism = 6)
+                    .toList()
+
+                assertEquals(prompts.indices.toList(), results.map { it.index }.sorted())
+
+                assertTrue(results.all { it.output.getOrThrow().content.isNotBlank() })
+            }
+        }
+    }
+
+    @Test
+    fun `should return embedding for every text`() = runTest {
+        val texts = listOf("What is Python?", "What is the Python language?", "The cat sat on the mat")
+
+        val embeddings = llama.embed(texts).getOrThrow()
+
+        assertEquals(texts.size, embeddings.count)
+
+        assertTrue(texts.indices.all { index -> abs(embeddings[index].sumOf { it * it.toDouble() } - 1) < 1e-3 })
+
+        fun similarity(a: Int, b: Int) = embeddings[a].zip(embeddings[b]).sumOf { (x, y) -> x * y.toDouble() }
+
+        assertTrue(similarity(0, 1) > similarity(0, 2))
+    }
+
+    @Test
+    fun `should find the most similar embedding`() = runTest {
+        val texts = listOf("Python is a programming language", "The cat sat on the mat", "Paris is in France")
+
+        val embeddings = llama.embed(texts).getOrThrow()
+
+        VectorIndex.create(dimension = embeddings.dimension).getOrThrow().use { index ->
+            index.add(LongArray(texts.size) { it.toLong() }, embeddings.buffer).getOrThrow()
+
+            val query = llama.embed(listOf("Which language is Python?")).getOrThrow()
+
+            val results = index.search(query.buffer, limit = 1).getOrThrow()
+
+            assertEquals(0L, results.single().single().id)
+        }
+    }
+
+    @Test
+    fun `should reject a truncated index file`() = runTest {
+        val file = File.createTempFile("index", ".bin").apply { deleteOnExit() }
+
+        VectorIndex.create(dimension = 4).getOrThrow().use { index ->
+            val vectors = ByteBuffer.allocateDirect(2 * 4 * Float.SIZE_BYTES).order(ByteOrder.nativeOrder()).asFloatBuffer()
+
+            repeat(2 * 4) { vectors.put(it + 1f) }
+
+            index.add(longArrayOf(0L, 1L), vectors.flip()).getOrThrow()
+
+            index.save(file.path).getOrThrow()
+        }
+
+        VectorIndex.load(file.path).getOrThrow().use { index -> assertEquals(2L, index.size().getOrThrow()) }
+
+        file.writeBytes(file.readBytes().copyOf(file.length().toInt() - 1))
+
+        assertTrue(VectorIndex.load(file.path).isFailure)
+    }
+
+    @Test
+    fun `should score the expected candidate highest`() = runTest {
+        val scores = llama.score("Is Python a programming language? Answer yes or no.", listOf("Yes", "No")).getOrThrow()
+
+        assertEquals("Yes", scores.maxBy { it.logProbability }.candidate)
+    }
+
+    @Test
+    fun `should apply an adapter to completions and batches and reject a missing one`() = runTest {
+        val info = TextGeneration.Llama.probe(modelPath = modelPath).getOrThrow()
+
+        val embeddingSize = info.embeddingSize.toLong()
+
+        fun writeAdapter(value: Float) = File.createTempFile("adapter", ".gguf").apply {
+            deleteOnExit()
+
+            writeGguf(
+                file = this,
+                metadata = mapOf(
+                    "general.architecture" to info.architecture,
+                    "general.type" to "adapter",
+                    "adapter.type" to "lora"
+                ),
+                tensors = (0 until info.layerCount).flatMap { layer ->
+                    listOf(
+                        "blk.$layer.attn_q.weight.lora_a" to (longArrayOf(embeddingSize, 1) to FloatArray(info.embeddingSize) { 1f }),
+                        "blk.$layer.attn_q.weight.lora_b" to (longArrayOf(1, embeddingSize) to FloatArray(info.embeddingSize) { value })
+                    )
+                }.toMap()
+            )
+        }
+
+        assertTrue(llama.loadAdapter(adapterPath = "missing.gguf").isFailure)
+
+        val tokens = Tokenizer.Llama.create(modelPath = modelPath).getOrThrow().use { tokenizer ->
+            tokenizer.tokenize("Python is").getOrThrow()
+        }
+
+        val prompts = listOf("What is Python?")
+
+        val parameters = LlamaGenerationParameters(maxTokens = 16)
+
+        val completion = llama.complete(tokens, parameters).getOrThrow()
+
+        val batch = llama.generateBatch(prompts, parameters).toList().single().output.getOrThrow()
+
+        llama.loadAdapter(adapterPath = writeAdapter(0f).path).getOrThrow().use { adapter ->
+            assertEquals(completion, llama.complete(tokens, parameters.copy(adapter = adapter)).getOrThrow())
+        }
+
+        llama.loadAdapter(adapterPath = writeAdapter(1f).path).getOrThrow().use { adapter ->
+            val adapted = parameters.copy(adapter = adapter)
+
+            assertNotEquals(completion, llama.complete(tokens, adapted).getOrThrow())
+
+            assertNotEquals(batch, llama.generateBatch(prompts, adapted).toList().single().output.getOrThrow())
+        }
+
+        val closed = llama.loadAdapter(adapterPath = writeAdapter(1f).path).getOrThrow().apply { close() }
+
+        assertTrue(llama.complete(tokens, parameters.copy(adapter = closed)).isFailure)
+
+        assertEquals(completion, llama.complete(tokens, parameters).getOrThrow())
+    }
+
+    @Test
+    fun `should steer completions and batches with a control vector and reject a missing one`() = runTest {
+        val info = TextGeneration.Llama.probe(modelPath = modelPath).getOrThrow()
+
+        fun writeControlVector(value: Float) = File.createTempFile("control-vector", ".gguf").apply {
+            deleteOnExit()
+
+            writeGguf(
+                file = this,
+                metadata = mapOf("general.architecture" to info.architecture),
+                tensors = (1 until info.layerCount).associate { layer ->
+                    "direction.$layer" to (longArrayOf(info.embeddingSize.toLong()) to FloatArray(info.embeddingSize) { value })
+                }
+            )
+        }
+
+        assertTrue(llama.loadControlVector(controlVectorPath = "missing.gguf").isFailure)
+
+        val tokens = Tokenizer.Llama.create(modelPath = modelPath).getOrThrow().use { tokenizer ->
+            tokenizer.tokenize("Python is").getOrThrow()
+        }
+
+        val prompts = listOf("What is Python?")
+
+        val parameters = LlamaGenerationParameters(maxTokens = 16)
+
+        val completion = llama.complete(tokens, parameters).getOrThrow()
+
+        val batch = llama.generateBatch(prompts, parameters).toList().single().output.getOrThrow()
+
+        llama.loadControlVector(controlVectorPath = writeControlVector(0f).path).getOrThrow().use { controlVector ->
+            assertEquals(
+                completion,
+                llama.complete(tokens, parameters.copy(controlVector = controlVector)).getOrThrow()
+            )
+        }
+
+        llama.loadControlVector(controlVectorPath = writeControlVector(4f).path).getOrThrow().use { controlVector ->
+            val steered = parameters.copy(controlVector = controlVector)
+
+            assertNotEquals(completion, llama.complete(tokens, steered).getOrThrow())
+
+            assertNotEquals(batch, llama.generateBatch(prompts, steered).toList().single().output.getOrThrow())
+        }
+
+        assertEquals(completion, llama.complete(tokens, parameters).getOrThrow())
+    }
+
+    @Test
+    fun `should reuse the completion context after a failed completion`() = runTest {
+        val tokens = Tokenizer.Llama.create(modelPath = modelPath).getOrThrow().use { tokenizer ->
+            tokenizer.tokenize("Python is").getOrThrow()
+        }
+
+        val parameters = LlamaGenerationParameters(maxTokens = 16)
+
+        TextGeneration.Llama.create(modelPath = modelPath, contextSize = 256).getOrThrow().use { llama ->
+            val completion = llama.complete(tokens, parameters).getOrThrow()
+
+            val exception = llama.complete(IntArray(512) { tokens[it % tokens.size] }, parameters).exceptionOrNull()
+
+            assertEquals("Context size exceeded", exception?.message)
+
+            repeat(2) {
+                assertEquals(completion, llama.complete(tokens, parameters).getOrThrow())
+            }
+        }
+    }
+
+    @Test
+    fun `should count the tokens it produces`() = runTest {
+        Tokenizer.Llama.create(modelPath = modelPath).getOrThrow().use { tokenizer ->
+            val texts = listOf("What is Python?", "What is Kotlin?")
+
+            val batch = tokenizer.tokenize(texts).getOrThrow()
+
+            val counts = tokenizer.countTokens(texts).getOrThrow()
+
+            assertEquals(texts.indices.map { batch[it].size }, counts.toList())
+
+            assertEquals(texts.first(), tokenizer.detokenize(batch[0], removeSpecial = true).getOrThrow())
+
+            val history = llama.history().getOrThrow()
+
+            val result = llama.complete(batch[0], LlamaGenerationParameters(maxTokens = 16)).getOrThrow()
+
+            assertTrue(result.isNotBlank())
+
+            assertEquals(history, llama.history().getOrThrow())
+        }
+    }
+}